@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "breaker.h"
+#include "network.h"
+#include "log.h"
+
+/* Maximum number of distinct peer addresses to track */
+#define BREAKER_MAX_PEERS 256
+
+/*
+ * A circuit breaker opens after a number of consecutive failed connections to a peer address.
+ * While open, connections to the address are rejected immediately. Probe connections are
+ * started from the core loop at a fixed interval; once one succeeds, the breaker is half-open
+ * and admits a single trial connection, closing on its success and re-opening on its failure.
+ * Further connections are rejected until the trial resolves, or the probe interval passes
+ * without a result.
+ */
+
+typedef enum /*_breaker_state*/ {
+	breaker_closed = 0,
+	breaker_half_open,
+	breaker_opened
+} breaker_state;
+
+typedef struct /*_peer_breaker*/ {
+	peer_transport transport;
+	char* host;
+	char* port;
+	breaker_state state;
+	size_t failures;
+	time_t next_probe;
+	time_t trial;
+	int probe_fd;
+} peer_breaker;
+
+static size_t breaker_threshold = 5;
+static time_t breaker_interval = 5;
+static char* breaker_response = NULL;
+static size_t breakers_rejected = 0, breakers_probed = 0;
+
+static size_t breakers = 0;
+static peer_breaker* breaker = NULL;
+
+/* Configure the breakers, a threshold of 0 disables them */
+void breaker_init(size_t threshold, time_t probe_interval, char* status){
+	breaker_threshold = threshold;
+	breaker_interval = probe_interval;
+	breaker_response = status;
+}
+
+static peer_breaker* breaker_find(peer_transport transport, char* host, char* port, int create){
+	size_t u;
+	peer_breaker* resized = NULL;
+	peer_breaker empty = {
+		.transport = transport,
+		.probe_fd = -1
+	};
+
+	for(u = 0; u < breakers; u++){
+		if(breaker[u].transport == transport
+				&& !strcmp(breaker[u].host, host)
+				&& ((!breaker[u].port && !port) || (breaker[u].port && port && !strcmp(breaker[u].port, port)))){
+			return breaker + u;
+		}
+	}
+
+	if(!create || breakers == BREAKER_MAX_PEERS){
+		return NULL;
+	}
+
+	resized = realloc(breaker, (breakers + 1) * sizeof(peer_breaker));
+	if(!resized){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return NULL;
+	}
+	breaker = resized;
+
+	empty.host = strdup(host);
+	empty.port = port ? strdup(port) : NULL;
+	if(!empty.host || (port && !empty.port)){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		free(empty.host);
+		free(empty.port);
+		return NULL;
+	}
+	breaker[breakers] = empty;
+	breakers++;
+	return breaker + breakers - 1;
+}
+
+static time_t breaker_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/*
+ * Check whether connections to a peer should be rejected immediately.
+ * A half-open breaker lets a single trial connection through, which has to be
+ * reported via `breaker_result`.
+ */
+int breaker_open(peer_transport transport, char* host, char* port){
+	peer_breaker* entry = NULL;
+	time_t now;
+
+	if(!breaker_threshold){
+		return 0;
+	}
+
+	entry = breaker_find(transport, host, port, 0);
+	if(!entry || entry->state == breaker_closed){
+		return 0;
+	}
+
+	if(entry->state == breaker_half_open){
+		now = breaker_now();
+		//a trial that was never reported does not block the peer forever
+		if(!entry->trial || now >= entry->trial + breaker_interval){
+			entry->trial = now;
+			return 0;
+		}
+	}
+
+	breakers_rejected++;
+	return 1;
+}
+
+static void breaker_trip(peer_breaker* entry, time_t now){
+	LOG(log_peer, log_warn, "Peer %s%s%s unavailable, rejecting connections\n", entry->host, entry->port ? ":" : "", entry->port ? entry->port : "");
+	entry->state = breaker_opened;
+	entry->failures = 0;
+	entry->trial = 0;
+	entry->next_probe = now + breaker_interval;
+}
+
+/* Record the result of a connection attempt */
+void breaker_result(peer_transport transport, char* host, char* port, int success){
+	peer_breaker* entry = NULL;
+
+	if(!breaker_threshold){
+		return;
+	}
+
+	//only failing peers need to be tracked
+	entry = breaker_find(transport, host, port, !success);
+	if(!entry){
+		return;
+	}
+
+	if(success){
+		entry->failures = 0;
+		entry->trial = 0;
+		if(entry->state == breaker_half_open){
+			LOG(log_peer, log_info, "Peer %s%s%s recovered\n", entry->host, entry->port ? ":" : "", entry->port ? entry->port : "");
+			entry->state = breaker_closed;
+		}
+		return;
+	}
+
+	entry->failures++;
+	if(entry->state == breaker_half_open || entry->failures >= breaker_threshold){
+		breaker_trip(entry, breaker_now());
+	}
+}
+
+/* HTTP status line sent when rejecting connections */
+char* breaker_status(){
+	return breaker_response ? breaker_response : "503 Service Unavailable";
+}
+
+/* Start and complete probe connections, returns the number of open breakers */
+size_t breaker_maintain(time_t current_time){
+	size_t u, open = 0;
+	int status;
+
+	for(u = 0; u < breakers; u++){
+		if(breaker[u].state != breaker_opened){
+			continue;
+		}
+		open++;
+
+		if(breaker[u].probe_fd >= 0){
+			status = network_connect_done(breaker[u].probe_fd);
+			if(status == 1){
+				//still connecting
+				continue;
+			}
+
+			close(breaker[u].probe_fd);
+			breaker[u].probe_fd = -1;
+			if(!status){
+				breaker[u].state = breaker_half_open;
+				breaker[u].trial = 0;
+				continue;
+			}
+			breaker[u].next_probe = current_time + breaker_interval;
+		}
+		else if(current_time >= breaker[u].next_probe){
+			breakers_probed++;
+			if(breaker[u].transport == peer_unix_stream){
+				breaker[u].probe_fd = network_socket_unix(breaker[u].host, SOCK_STREAM, 0);
+				if(breaker[u].probe_fd >= 0){
+					close(breaker[u].probe_fd);
+					breaker[u].probe_fd = -1;
+					breaker[u].state = breaker_half_open;
+					breaker[u].trial = 0;
+					continue;
+				}
+			}
+			else{
+				breaker[u].probe_fd = network_connect_start(breaker[u].host, breaker[u].port, SOCK_STREAM);
+			}
+
+			if(breaker[u].probe_fd < 0){
+				breaker[u].next_probe = current_time + breaker_interval;
+			}
+		}
+	}
+
+	return open;
+}
+
+void breaker_stats(size_t* open, size_t* rejected, size_t* probes){
+	size_t u;
+
+	*open = 0;
+	for(u = 0; u < breakers; u++){
+		*open += (breaker[u].state == breaker_opened) ? 1 : 0;
+	}
+	*rejected = breakers_rejected;
+	*probes = breakers_probed;
+}
+
+void breaker_cleanup(){
+	size_t u;
+
+	for(u = 0; u < breakers; u++){
+		if(breaker[u].probe_fd >= 0){
+			close(breaker[u].probe_fd);
+		}
+		free(breaker[u].host);
+		free(breaker[u].port);
+	}
+	free(breaker);
+	breaker = NULL;
+	breakers = 0;
+}
@@ -0,0 +1,13 @@
+#include "websocksy.h"
+
+/* Returned by client_connect when the peer was rejected by its circuit breaker */
+#define BREAKER_REJECTED 2
+
+/* Per-peer circuit breakers */
+void breaker_init(size_t threshold, time_t probe_interval, char* status);
+int breaker_open(peer_transport transport, char* host, char* port);
+void breaker_result(peer_transport transport, char* host, char* port, int success);
+char* breaker_status();
+size_t breaker_maintain(time_t current_time);
+void breaker_stats(size_t* open, size_t* rejected, size_t* probes);
+void breaker_cleanup();
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "broadcast.h"
+#include "network.h"
+#include "websocket.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Broadcast sources are peer connections shared by all WebSockets connecting to the same
+ * `broadcast://` address. Data from the source is framed once, each resulting message
+ * is encoded into a single reference-counted frame buffer which is queued to every subscriber.
+ * Messages from subscribers are not forwarded.
+ */
+
+typedef struct /*_broadcast_source*/ {
+	peer_transport transport;
+	char* host;
+	char* port;
+	int fd;
+
+	ws_framing framing;
+	char* framing_config;
+	void* framing_data;
+	uint8_t buffer[PEER_BUFFER_SIZE];
+	size_t buffer_offset;
+
+	size_t subscribers;
+	size_t subscribers_alloc;
+	size_t* subscriber;
+} broadcast_source;
+
+static size_t queue_limit = 64;
+static broadcast_policy policy = broadcast_drop;
+
+static size_t sources = 0;
+static broadcast_source** source = NULL;
+
+/* Configure the slow subscriber policy */
+void broadcast_init(size_t limit, broadcast_policy selected){
+	queue_limit = limit;
+	policy = selected;
+}
+
+/* Close a source and all its subscribers */
+static void broadcast_fail(broadcast_source* src, ws_close_reason code, char* reason){
+	websocket* ws = NULL;
+	size_t remaining;
+
+	//closing a subscriber removes it from the list
+	while(src->subscribers){
+		remaining = src->subscribers;
+		ws = client_get(src->subscriber[remaining - 1]);
+		if(ws){
+			ws_close(ws, code, reason);
+		}
+		if(src->subscribers == remaining){
+			src->subscribers--;
+		}
+	}
+
+	if(src->framing_data){
+		src->framing(NULL, 0, 0, NULL, &(src->framing_data), src->framing_config);
+		src->framing_data = NULL;
+	}
+
+	if(src->fd >= 0){
+		close(src->fd);
+		src->fd = -1;
+	}
+	src->buffer_offset = 0;
+}
+
+/* Open the connection for a new source */
+static int broadcast_connect(broadcast_source* src){
+	switch(src->transport){
+		case peer_tcp_client:
+			src->fd = network_socket(src->host, src->port, SOCK_STREAM, 0);
+			break;
+		case peer_unix_stream:
+			src->fd = network_socket_unix(src->host, SOCK_STREAM, 0);
+			break;
+		case peer_fifo_rx:
+			//opening the fifo read-write keeps it from signaling EOF when writers come and go
+			src->fd = open(src->host, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+			if(src->fd < 0){
+				LOG(log_peer, log_error, "Failed to open %s: %s\n", src->host, strerror(errno));
+			}
+			break;
+		default:
+			LOG(log_peer, log_error, "Broadcast sources must be stream or fifo transports\n");
+			break;
+	}
+
+	return (src->fd < 0) ? 1 : 0;
+}
+
+/* Find or open the source for a peer address */
+static broadcast_source* broadcast_source_find(websocket* ws, peer_transport transport, size_t* index){
+	size_t u, free_slot = sources;
+	broadcast_source* src = NULL, **resized = NULL;
+
+	for(u = 0; u < sources; u++){
+		if(source[u]->fd < 0){
+			free_slot = (free_slot == sources) ? u : free_slot;
+			continue;
+		}
+
+		if(source[u]->transport == transport
+				&& !strcmp(source[u]->host, ws->peer.host)
+				&& ((!source[u]->port && !ws->peer.port) || (source[u]->port && ws->peer.port && !strcmp(source[u]->port, ws->peer.port)))){
+			*index = u;
+			return source[u];
+		}
+	}
+
+	if(free_slot == sources){
+		resized = realloc(source, (sources + 1) * sizeof(broadcast_source*));
+		if(!resized){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return NULL;
+		}
+		source = resized;
+		source[sources] = calloc(1, sizeof(broadcast_source));
+		if(!source[sources]){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return NULL;
+		}
+		source[sources]->fd = -1;
+		sources++;
+	}
+
+	src = source[free_slot];
+	free(src->host);
+	free(src->port);
+	free(src->framing_config);
+	src->transport = transport;
+	src->host = strdup(ws->peer.host);
+	src->port = ws->peer.port ? strdup(ws->peer.port) : NULL;
+	//the first subscriber selects the framing for the source
+	src->framing = ws->peer.framing;
+	src->framing_config = ws->peer.framing_config ? strdup(ws->peer.framing_config) : NULL;
+	src->framing_data = NULL;
+	src->buffer_offset = 0;
+	src->subscribers = 0;
+
+	if(broadcast_connect(src)){
+		return NULL;
+	}
+
+	*index = free_slot;
+	return src;
+}
+
+/*
+ * Subscribe a WebSocket to the broadcast source at its peer address.
+ * Returns 0 on success
+ */
+int broadcast_attach(websocket* ws, peer_transport transport){
+	size_t index = 0, *subscriber = NULL;
+	broadcast_source* src = broadcast_source_find(ws, transport, &index);
+
+	if(!src){
+		return 1;
+	}
+
+	if(src->subscribers == src->subscribers_alloc){
+		subscriber = realloc(src->subscriber, (src->subscribers_alloc ? src->subscribers_alloc * 2 : 16) * sizeof(size_t));
+		if(!subscriber){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			//existing subscribers stay attached, only this client is rejected
+			return 1;
+		}
+		src->subscriber = subscriber;
+		src->subscribers_alloc = src->subscribers_alloc ? src->subscribers_alloc * 2 : 16;
+	}
+
+	src->subscriber[src->subscribers] = client_index(ws);
+	ws->peer_shared = index;
+	ws->peer_channel = src->subscribers;
+	src->subscribers++;
+	return 0;
+}
+
+/* Unsubscribe a WebSocket from its broadcast source */
+void broadcast_detach(websocket* ws){
+	broadcast_source* src = NULL;
+	websocket* moved = NULL;
+
+	if(ws->peer_shared >= sources){
+		return;
+	}
+
+	src = source[ws->peer_shared];
+	if(ws->peer_channel >= src->subscribers
+			|| src->subscriber[ws->peer_channel] != client_index(ws)){
+		return;
+	}
+
+	//move the last subscriber into the free position
+	src->subscribers--;
+	src->subscriber[ws->peer_channel] = src->subscriber[src->subscribers];
+	moved = client_get(src->subscriber[ws->peer_channel]);
+	if(moved && moved != ws){
+		moved->peer_channel = ws->peer_channel;
+	}
+	ws->peer_channel = 0;
+}
+
+/* Add all broadcast sources to a select set */
+void broadcast_fds(fd_set* fds, int* max_fd){
+	size_t u;
+
+	for(u = 0; u < sources; u++){
+		if(source[u]->fd >= 0){
+			FD_SET(source[u]->fd, fds);
+			if(*max_fd < source[u]->fd){
+				*max_fd = source[u]->fd;
+			}
+		}
+	}
+}
+
+/* Encode a message once and queue it to all subscribers */
+static void broadcast_message(broadcast_source* src, ws_operation opcode, uint8_t* data, size_t length){
+	size_t u, header_length;
+	uint8_t header[WS_FRAME_HEADER_LEN];
+	ws_buffer* frame = NULL;
+	websocket* ws = NULL;
+
+	header_length = ws_frame_header(header, opcode, length);
+	frame = ws_buffer_alloc(header_length + length);
+	if(!frame){
+		return;
+	}
+	memcpy(frame->data, header, header_length);
+	memcpy(frame->data + header_length, data, length);
+
+	for(u = src->subscribers; u > 0; u--){
+		ws = client_get(src->subscriber[u - 1]);
+		if(!ws){
+			continue;
+		}
+
+		if(ws->queue_entries >= queue_limit){
+			if(policy == broadcast_skip){
+				continue;
+			}
+			ws_close(ws, ws_close_again, "Subscriber too slow");
+			continue;
+		}
+
+		if(ws_queue(ws, frame)){
+			ws_close(ws, ws_close_unexpected, NULL);
+			continue;
+		}
+		metrics_traffic(ws, metrics_to_client, length);
+	}
+
+	ws_buffer_release(frame);
+}
+
+/* Handle incoming data on a source */
+static void broadcast_read(broadcast_source* src){
+	ssize_t bytes_read;
+	int64_t bytes_framed;
+	size_t offset = 0, unread;
+	ws_operation opcode;
+
+	bytes_read = read(src->fd, src->buffer + src->buffer_offset, sizeof(src->buffer) - src->buffer_offset);
+	if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return;
+	}
+	else if(bytes_read <= 0){
+		broadcast_fail(src, ws_close_normal, "Peer closed connection");
+		return;
+	}
+
+	src->buffer_offset += bytes_read;
+	unread = bytes_read;
+
+	do{
+		opcode = ws_frame_binary;
+		bytes_framed = src->framing(src->buffer + offset, src->buffer_offset - offset, unread, &opcode, &(src->framing_data), src->framing_config);
+		if(bytes_framed > 0){
+			if(bytes_framed > src->buffer_offset - offset){
+				LOG(log_peer, log_warn, "Overrun by framing function, have %lu bytes, framed %lu\n", src->buffer_offset - offset, bytes_framed);
+				broadcast_fail(src, ws_close_unexpected, "Internal error");
+				return;
+			}
+
+			if(opcode != ws_frame_discard){
+				broadcast_message(src, opcode, src->buffer + offset, bytes_framed);
+			}
+			offset += bytes_framed;
+			unread = (unread < bytes_framed) ? 0 : unread - bytes_framed;
+		}
+	}
+	while(bytes_framed > 0 && offset < src->buffer_offset);
+
+	//remove all framed data at once
+	memmove(src->buffer, src->buffer + offset, src->buffer_offset - offset);
+	src->buffer_offset -= offset;
+
+	//a full buffer that can not be framed would stall the source forever
+	if(src->buffer_offset == sizeof(src->buffer)){
+		LOG(log_peer, log_warn, "Broadcast source buffer exceeded without a complete message\n");
+		broadcast_fail(src, ws_close_limit, "Peer message too large");
+	}
+}
+
+/* Handle all broadcast sources with pending data */
+void broadcast_data(fd_set* fds){
+	size_t u;
+
+	for(u = 0; u < sources; u++){
+		if(source[u]->fd >= 0 && FD_ISSET(source[u]->fd, fds)){
+			broadcast_read(source[u]);
+		}
+	}
+}
+
+/* Close all sources */
+void broadcast_cleanup(){
+	size_t u;
+
+	for(u = 0; u < sources; u++){
+		broadcast_fail(source[u], ws_close_shutdown, "Shutting down");
+		free(source[u]->subscriber);
+		free(source[u]->host);
+		free(source[u]->port);
+		free(source[u]->framing_config);
+		free(source[u]);
+	}
+	free(source);
+	source = NULL;
+	sources = 0;
+}
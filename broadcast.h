@@ -0,0 +1,16 @@
+#include "websocksy.h"
+#include <sys/select.h>
+
+/* Slow subscriber handling policies */
+typedef enum {
+	broadcast_drop = 0, /* Disconnect subscribers exceeding the queue limit */
+	broadcast_skip /* Skip messages for subscribers exceeding the queue limit */
+} broadcast_policy;
+
+/* Broadcast (fan-out) peer connection handling */
+void broadcast_init(size_t queue_limit, broadcast_policy policy);
+int broadcast_attach(websocket* ws, peer_transport transport);
+void broadcast_detach(websocket* ws);
+void broadcast_fds(fd_set* fds, int* max_fd);
+void broadcast_data(fd_set* fds);
+void broadcast_cleanup();
@@ -14,9 +14,48 @@
  * where there is just one peer anyway.
  */
 
+/*
+ * Additional `route` entries select peers by request path (exact or prefix matches), optionally
+ * restricted by header or cookie values. They are compiled into a radix trie on the path at
+ * configuration time, with the peer information prepared so that lookups do not allocate.
+ */
+
+/* Header or cookie value required by a route */
+typedef struct /*_route_predicate*/ {
+	uint8_t cookie;
+	char* name;
+	char* value;
+	size_t value_length;
+} route_predicate;
+
+typedef struct /*_builtin_route*/ {
+	uint8_t prefix;
+	size_t predicates;
+	route_predicate* predicate;
+	char* protocol;
+	ws_peer_info peer;
+} builtin_route;
+
+/* Radix trie node, the path of a node is the concatenation of all labels from the root */
+typedef struct _route_node {
+	char* label;
+	size_t label_length;
+	size_t children;
+	struct _route_node** child;
+	size_t exact_routes;
+	size_t* exact;
+	size_t prefix_routes;
+	size_t* prefix;
+} route_node;
+
 /* Global data storage for the backend */
 static ws_peer_info default_peer = {0};
 static char* default_peer_proto = NULL;
+static uint8_t default_peer_configured = 0;
+
+static size_t routes = 0;
+static builtin_route* route = NULL;
+static route_node route_root = {0};
 
 /* 
  * Initialization function for the defaultpeer backend
@@ -33,6 +72,251 @@ uint64_t backend_defaultpeer_init(){
 	return WEBSOCKSY_API_VERSION;
 }
 
+/* Find the child of a node starting with a character, children are sorted by their first character */
+static route_node* route_child(route_node* node, char first, size_t* position){
+	size_t lower = 0, upper = node->children, middle;
+
+	while(lower < upper){
+		middle = (lower + upper) / 2;
+		if(node->child[middle]->label[0] == first){
+			*position = middle;
+			return node->child[middle];
+		}
+		else if((uint8_t) node->child[middle]->label[0] < (uint8_t) first){
+			lower = middle + 1;
+		}
+		else{
+			upper = middle;
+		}
+	}
+
+	*position = lower;
+	return NULL;
+}
+
+/* Create a node and insert it as child at a position */
+static route_node* route_node_insert(route_node* parent, size_t position, char* label, size_t label_length){
+	route_node* node = calloc(1, sizeof(route_node));
+	route_node** child = realloc(parent->child, (parent->children + 1) * sizeof(route_node*));
+
+	if(!node || !child){
+		fprintf(stderr, "Failed to allocate memory\n");
+		free(node);
+		parent->child = child ? child : parent->child;
+		return NULL;
+	}
+	parent->child = child;
+
+	node->label = strndup(label, label_length);
+	node->label_length = label_length;
+	if(!node->label){
+		fprintf(stderr, "Failed to allocate memory\n");
+		free(node);
+		return NULL;
+	}
+
+	memmove(parent->child + position + 1, parent->child + position, (parent->children - position) * sizeof(route_node*));
+	parent->child[position] = node;
+	parent->children++;
+	return node;
+}
+
+/* Find or create the trie node for a path */
+static route_node* route_node_find(char* path, size_t length){
+	route_node* node = &route_root, *child = NULL, *split = NULL;
+	size_t position, common;
+	char* label = NULL;
+
+	while(length){
+		child = route_child(node, path[0], &position);
+		if(!child){
+			return route_node_insert(node, position, path, length);
+		}
+
+		for(common = 0; common < child->label_length && common < length && child->label[common] == path[common]; common++){
+		}
+
+		if(common < child->label_length){
+			//split the edge at the first differing character
+			label = strdup(child->label + common);
+			if(!label){
+				fprintf(stderr, "Failed to allocate memory\n");
+				return NULL;
+			}
+			node->children--;
+			memmove(node->child + position, node->child + position + 1, (node->children - position) * sizeof(route_node*));
+			split = route_node_insert(node, position, path, common);
+			if(!split){
+				free(label);
+				return NULL;
+			}
+
+			free(child->label);
+			child->label = label;
+			child->label_length -= common;
+			split->child = malloc(sizeof(route_node*));
+			if(!split->child){
+				fprintf(stderr, "Failed to allocate memory\n");
+				return NULL;
+			}
+			split->child[0] = child;
+			split->children = 1;
+			child = split;
+		}
+
+		node = child;
+		path += common;
+		length -= common;
+	}
+
+	return node;
+}
+
+/* Append a route index to a node's exact or prefix list */
+static int route_node_add(route_node* node, uint8_t prefix, size_t index){
+	size_t** list = prefix ? &(node->prefix) : &(node->exact);
+	size_t* count = prefix ? &(node->prefix_routes) : &(node->exact_routes);
+	size_t* resized = realloc(*list, (*count + 1) * sizeof(size_t));
+
+	if(!resized){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	*list = resized;
+	(*list)[*count] = index;
+	(*count)++;
+	return 0;
+}
+
+/* Parse a `<name>=<value>` predicate */
+static int route_predicate_add(builtin_route* target, uint8_t cookie, char* spec){
+	char* value = strchr(spec, '=');
+	route_predicate* predicate = NULL;
+
+	if(!value || value == spec){
+		fprintf(stderr, "Invalid route predicate %s\n", spec);
+		return 1;
+	}
+
+	predicate = realloc(target->predicate, (target->predicates + 1) * sizeof(route_predicate));
+	if(!predicate){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	target->predicate = predicate;
+	predicate += target->predicates;
+
+	predicate->cookie = cookie;
+	predicate->name = strndup(spec, value - spec);
+	predicate->value = strdup(value + 1);
+	predicate->value_length = strlen(value + 1);
+	target->predicates++;
+	if(!predicate->name || !predicate->value){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	//the result of a query now depends on this value
+	return cookie ? core_cache_cookie(predicate->name) : core_cache_header(predicate->name);
+}
+
+/*
+ * Compile a `route` configuration entry of the form
+ * `<path>[*] <peer> [protocol=<p>] [framing=<f>] [port=<port>] [header:<tag>=<value>] [cookie:<name>=<value>] [framing-config=<rest of line>]`
+ */
+static int backend_defaultpeer_route(char* spec){
+	char* path = NULL, *token = NULL, *save = NULL, *framing_config = NULL;
+	size_t path_length;
+	builtin_route* entry = NULL;
+	route_node* node = NULL;
+
+	//framing configuration may contain spaces and extends to the end of the line
+	framing_config = strstr(spec, " framing-config=");
+	if(framing_config){
+		*framing_config = 0;
+		framing_config += 16;
+	}
+
+	path = strtok_r(spec, " ", &save);
+	token = strtok_r(NULL, " ", &save);
+	if(!path || !token){
+		fprintf(stderr, "Route entries require a path and a peer\n");
+		return 1;
+	}
+
+	entry = realloc(route, (routes + 1) * sizeof(builtin_route));
+	if(!entry){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	route = entry;
+	entry = route + routes;
+	memset(entry, 0, sizeof(builtin_route));
+	routes++;
+
+	path_length = strlen(path);
+	if(path_length && path[path_length - 1] == '*'){
+		entry->prefix = 1;
+		path_length--;
+	}
+
+	entry->peer.persistent = 1;
+	entry->peer.host = strdup(token);
+	entry->peer.framing_config = framing_config ? strdup(framing_config) : NULL;
+	if(!entry->peer.host || (framing_config && !entry->peer.framing_config)){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	for(token = strtok_r(NULL, " ", &save); token; token = strtok_r(NULL, " ", &save)){
+		if(!strncmp(token, "protocol=", 9)){
+			free(entry->protocol);
+			entry->protocol = strdup(token + 9);
+		}
+		else if(!strncmp(token, "framing=", 8)){
+			entry->peer.framing = plugin_framing(token + 8);
+			if(!entry->peer.framing){
+				fprintf(stderr, "Unknown framing function %s in route\n", token + 8);
+				return 1;
+			}
+		}
+		else if(!strncmp(token, "port=", 5)){
+			free(entry->peer.port);
+			entry->peer.port = strdup(token + 5);
+		}
+		else if(!strncmp(token, "header:", 7)){
+			if(route_predicate_add(entry, 0, token + 7)){
+				return 1;
+			}
+		}
+		else if(!strncmp(token, "cookie:", 7)){
+			if(route_predicate_add(entry, 1, token + 7)){
+				return 1;
+			}
+		}
+		else{
+			fprintf(stderr, "Unknown route option %s\n", token);
+			return 1;
+		}
+	}
+
+	//resolve the address options, transport and port once, so the core does not need to modify the peer data
+	if(client_peer_options(&(entry->peer))){
+		return 1;
+	}
+	entry->peer.transport = client_detect_transport(entry->peer.host);
+	if((entry->peer.transport == peer_tcp_client || entry->peer.transport == peer_udp_client) && !entry->peer.port){
+		entry->peer.port = client_detect_port(entry->peer.host);
+		if(!entry->peer.port){
+			fprintf(stderr, "Route peer %s requires a port\n", entry->peer.host);
+			return 1;
+		}
+	}
+
+	node = route_node_find(path, path_length);
+	return node ? route_node_add(node, entry->prefix, routes - 1) : 1;
+}
+
 /*
  * Configuration function for the defaultpeer backend
  */
@@ -41,6 +325,7 @@ uint64_t backend_defaultpeer_configure(char* key, char* value){
 		free(default_peer.host);
 		default_peer.host = strdup(value);
 		default_peer.transport = peer_transport_detect;
+		default_peer_configured = 1;
 		return 0;
 	}
 	else if(!strcmp(key, "port")){
@@ -62,9 +347,89 @@ uint64_t backend_defaultpeer_configure(char* key, char* value){
 		default_peer.framing_config = strdup(value);
 		return 0;
 	}
+	else if(!strcmp(key, "route")){
+		return backend_defaultpeer_route(value);
+	}
+	return 1;
+}
+
+/* Check whether a route's predicates and subprotocol match a request, and select the subprotocol */
+static int route_matches(builtin_route* entry, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws, size_t* selected){
+	size_t u, p, value_length = 0;
+	char* value;
+
+	for(u = 0; u < entry->predicates; u++){
+		value = NULL;
+		if(entry->predicate[u].cookie){
+			value = client_cookie(ws, entry->predicate[u].name, &value_length);
+		}
+		else{
+			for(p = 0; p < headers; p++){
+				if(!strcasecmp(header[p].tag, entry->predicate[u].name)){
+					value = header[p].value;
+					value_length = strlen(value);
+					break;
+				}
+			}
+		}
+
+		if(!value || !*value
+				|| value_length != entry->predicate[u].value_length
+				|| strncmp(value, entry->predicate[u].value, value_length)){
+			return 0;
+		}
+	}
+
+	//announce no subprotocol if none configured, the first one for '*'
+	*selected = protocols;
+	if(entry->protocol && !strcmp(entry->protocol, "*")){
+		*selected = 0;
+	}
+	else if(entry->protocol){
+		for(p = 0; p < protocols; p++){
+			if(!strcasecmp(protocol[p], entry->protocol)){
+				*selected = p;
+				break;
+			}
+		}
+
+		//the route requires a subprotocol the client did not indicate
+		if(protocols && *selected == protocols){
+			return 0;
+		}
+	}
 	return 1;
 }
 
+/* Find the best matching route below a node. Deeper (longer) matches take precedence. */
+static builtin_route* route_match(route_node* node, char* path, size_t length, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws, size_t* selected){
+	size_t u, position;
+	route_node* child = length ? route_child(node, path[0], &position) : NULL;
+	builtin_route* match = NULL;
+
+	if(child && child->label_length <= length && !memcmp(child->label, path, child->label_length)){
+		match = route_match(child, path + child->label_length, length - child->label_length, protocols, protocol, headers, header, ws, selected);
+		if(match){
+			return match;
+		}
+	}
+
+	if(!length){
+		for(u = 0; u < node->exact_routes; u++){
+			if(route_matches(route + node->exact[u], protocols, protocol, headers, header, ws, selected)){
+				return route + node->exact[u];
+			}
+		}
+	}
+
+	for(u = 0; u < node->prefix_routes; u++){
+		if(route_matches(route + node->prefix[u], protocols, protocol, headers, header, ws, selected)){
+			return route + node->prefix[u];
+		}
+	}
+	return NULL;
+}
+
 /*
  * defaultpeer backend core
  * Returns the configured default peer for any incoming request and selects either
@@ -72,8 +437,27 @@ uint64_t backend_defaultpeer_configure(char* key, char* value){
  */
 ws_peer_info backend_defaultpeer_query(char* endpoint, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws){
 	size_t p;
+	builtin_route* match = NULL;
+	ws_peer_info peer = {
+		.transport = peer_transport_detect,
+		.protocol = protocols
+	};
+
+	//routes share their prepared peer data with the core, the query string is not part of the matched path
+	if(routes){
+		match = route_match(&route_root, endpoint, strcspn(endpoint, "?"), protocols, protocol, headers, header, ws, &p);
+		if(match){
+			peer = match->peer;
+			peer.protocol = p;
+			return peer;
+		}
+		else if(!default_peer_configured){
+			return peer;
+		}
+	}
+
 	//return a copy of the default peer
-	ws_peer_info peer = default_peer;
+	peer = default_peer;
 	peer.host = (default_peer.host) ? strdup(default_peer.host) : NULL;
 	peer.port = (default_peer.port) ? strdup(default_peer.port) : NULL;
 	peer.framing_config = (default_peer.framing_config) ? strdup(default_peer.framing_config) : NULL;
@@ -97,11 +481,45 @@ ws_peer_info backend_defaultpeer_query(char* endpoint, size_t protocols, char**
 	return peer;
 }
 
+/* Recursively release a trie node's children and route lists */
+static void route_node_free(route_node* node){
+	size_t u;
+
+	for(u = 0; u < node->children; u++){
+		route_node_free(node->child[u]);
+		free(node->child[u]);
+	}
+	free(node->child);
+	free(node->label);
+	free(node->exact);
+	free(node->prefix);
+	memset(node, 0, sizeof(route_node));
+}
+
 /*
  * Cleanup function for the defaultpeer backend.
  * Frees all allocated data.
  */
 void backend_defaultpeer_cleanup(){
+	size_t u, p;
+
+	for(u = 0; u < routes; u++){
+		for(p = 0; p < route[u].predicates; p++){
+			free(route[u].predicate[p].name);
+			free(route[u].predicate[p].value);
+		}
+		free(route[u].predicate);
+		free(route[u].protocol);
+		free(route[u].peer.host);
+		free(route[u].peer.port);
+		free(route[u].peer.framing_config);
+	}
+	free(route);
+	route = NULL;
+	routes = 0;
+	route_node_free(&route_root);
+	default_peer_configured = 0;
+
 	free(default_peer.host);
 	default_peer.host = NULL;
 	free(default_peer.port);
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "cache.h"
+#include "log.h"
+
+/* Maximum length of a cache key (request path, protocols and significant header values) */
+#define CACHE_KEY_LIMIT 2048
+/* Marker for empty list and chain links */
+#define CACHE_NONE ((size_t) -1)
+
+/*
+ * The route cache stores backend query results keyed on the request path, the offered
+ * subprotocols and the values of all headers and cookies the backend has declared significant
+ * via `core_cache_header`/`core_cache_cookie`. Entries expire after a fixed time and the least
+ * recently used entry is replaced when the cache is full. Backends may drop entries at any
+ * time using `core_cache_invalidate`.
+ */
+
+typedef struct /*_cache_entry*/ {
+	uint8_t used;
+	uint32_t hash;
+	size_t key_length;
+	char* key;
+	time_t expires;
+	ws_peer_info peer;
+
+	/* Hash bucket chain and LRU list links */
+	size_t bucket_next;
+	size_t lru_prev;
+	size_t lru_next;
+} cache_entry;
+
+/* Significant request data, declared by the backend */
+typedef struct /*_cache_significant*/ {
+	uint8_t cookie;
+	char* name;
+} cache_significant;
+
+static size_t cache_size = 0;
+static time_t cache_ttl = 10;
+static size_t cache_hits = 0, cache_misses = 0, cache_used = 0;
+
+static cache_entry* entry = NULL;
+static size_t buckets = 0;
+static size_t* bucket = NULL;
+static size_t lru_head = CACHE_NONE, lru_tail = CACHE_NONE;
+
+static size_t significants = 0;
+static cache_significant* significant = NULL;
+
+//the key of the last lookup is kept for a following cache_store, as the backend may modify the request data
+static char current_key[CACHE_KEY_LIMIT];
+static size_t current_key_length = 0;
+static uint32_t current_hash = 0;
+
+/* Allocate the cache, caching is disabled with a size of 0 */
+void cache_init(size_t entries, time_t ttl){
+	size_t u;
+
+	cache_size = entries;
+	cache_ttl = ttl;
+	if(!cache_size){
+		return;
+	}
+
+	//keep the load factor below 0.5
+	for(buckets = 16; buckets < cache_size * 2; buckets *= 2){
+	}
+
+	entry = calloc(cache_size, sizeof(cache_entry));
+	bucket = calloc(buckets, sizeof(size_t));
+	if(!entry || !bucket){
+		fprintf(stderr, "Failed to allocate memory\n");
+		free(entry);
+		free(bucket);
+		entry = NULL;
+		bucket = NULL;
+		cache_size = 0;
+		return;
+	}
+
+	for(u = 0; u < buckets; u++){
+		bucket[u] = CACHE_NONE;
+	}
+}
+
+/* FNV-1a */
+static uint32_t cache_hash(char* data, size_t length){
+	size_t u;
+	uint32_t hash = 2166136261u;
+
+	for(u = 0; u < length; u++){
+		hash ^= (uint8_t) data[u];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Append a key component, including its terminator */
+static int cache_key_append(char* data, size_t length){
+	if(current_key_length + length + 1 > sizeof(current_key)){
+		return 1;
+	}
+
+	memcpy(current_key + current_key_length, data, length);
+	current_key[current_key_length + length] = 0;
+	current_key_length += length + 1;
+	return 0;
+}
+
+/* Build the cache key for a request */
+static int cache_key(websocket* ws){
+	size_t u, p, length;
+	char* value;
+
+	current_key_length = 0;
+	if(cache_key_append(ws->request_path, strlen(ws->request_path))){
+		return 1;
+	}
+
+	for(u = 0; u < ws->protocols; u++){
+		if(cache_key_append(ws->protocol[u], strlen(ws->protocol[u]))){
+			return 1;
+		}
+	}
+
+	//separate protocols from significant values
+	if(cache_key_append("", 0)){
+		return 1;
+	}
+
+	for(u = 0; u < significants; u++){
+		value = NULL;
+		length = 0;
+		if(significant[u].cookie){
+			value = client_cookie(ws, significant[u].name, &length);
+		}
+		else{
+			for(p = 0; p < ws->headers; p++){
+				if(!strcasecmp(ws->header[p].tag, significant[u].name)){
+					value = ws->header[p].value;
+					length = strlen(value);
+					break;
+				}
+			}
+		}
+
+		//distinguish missing from empty values
+		if(value ? cache_key_append("=", 1) || cache_key_append(value, length) : cache_key_append("", 0)){
+			return 1;
+		}
+	}
+
+	current_hash = cache_hash(current_key, current_key_length);
+	return 0;
+}
+
+static void cache_lru_unlink(size_t index){
+	if(entry[index].lru_prev != CACHE_NONE){
+		entry[entry[index].lru_prev].lru_next = entry[index].lru_next;
+	}
+	else{
+		lru_head = entry[index].lru_next;
+	}
+
+	if(entry[index].lru_next != CACHE_NONE){
+		entry[entry[index].lru_next].lru_prev = entry[index].lru_prev;
+	}
+	else{
+		lru_tail = entry[index].lru_prev;
+	}
+}
+
+/* Move an entry to the most recently used position */
+static void cache_lru_front(size_t index){
+	entry[index].lru_prev = CACHE_NONE;
+	entry[index].lru_next = lru_head;
+	if(lru_head != CACHE_NONE){
+		entry[lru_head].lru_prev = index;
+	}
+	lru_head = index;
+	if(lru_tail == CACHE_NONE){
+		lru_tail = index;
+	}
+}
+
+/* Remove an entry from the cache and release its data */
+static void cache_remove(size_t index){
+	size_t* link = bucket + (entry[index].hash & (buckets - 1));
+
+	for(; *link != CACHE_NONE; link = &(entry[*link].bucket_next)){
+		if(*link == index){
+			*link = entry[index].bucket_next;
+			break;
+		}
+	}
+
+	cache_lru_unlink(index);
+	free(entry[index].key);
+	free(entry[index].peer.host);
+	free(entry[index].peer.port);
+	free(entry[index].peer.framing_config);
+	memset(entry + index, 0, sizeof(cache_entry));
+	cache_used--;
+}
+
+/* Copy peer information, duplicating all allocated fields */
+static int cache_peer_copy(ws_peer_info* dest, ws_peer_info* src){
+	*dest = *src;
+	dest->persistent = 0;
+	dest->host = src->host ? strdup(src->host) : NULL;
+	dest->port = src->port ? strdup(src->port) : NULL;
+	dest->framing_config = src->framing_config ? strdup(src->framing_config) : NULL;
+
+	if((src->host && !dest->host) || (src->port && !dest->port) || (src->framing_config && !dest->framing_config)){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		free(dest->host);
+		free(dest->port);
+		free(dest->framing_config);
+		return 1;
+	}
+	return 0;
+}
+
+static time_t cache_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/*
+ * Find a cached backend query result for a request.
+ * Returns 0 and fills `peer` on a hit.
+ */
+int cache_lookup(websocket* ws, ws_peer_info* peer){
+	size_t index;
+
+	current_key_length = 0;
+	if(!cache_size || cache_key(ws)){
+		return 1;
+	}
+
+	for(index = bucket[current_hash & (buckets - 1)]; index != CACHE_NONE; index = entry[index].bucket_next){
+		if(entry[index].hash == current_hash
+				&& entry[index].key_length == current_key_length
+				&& !memcmp(entry[index].key, current_key, current_key_length)){
+			break;
+		}
+	}
+
+	if(index == CACHE_NONE){
+		cache_misses++;
+		return 1;
+	}
+
+	if(entry[index].expires <= cache_now()){
+		cache_remove(index);
+		cache_misses++;
+		return 1;
+	}
+
+	if(cache_peer_copy(peer, &(entry[index].peer))){
+		return 1;
+	}
+
+	cache_lru_unlink(index);
+	cache_lru_front(index);
+	cache_hits++;
+	return 0;
+}
+
+/* Store the result of a backend query for the key of the last lookup */
+void cache_store(ws_peer_info* peer){
+	size_t index;
+
+	if(!cache_size || !current_key_length || !peer->host){
+		return;
+	}
+
+	//find a free slot or replace the least recently used entry
+	if(cache_used == cache_size){
+		index = lru_tail;
+		cache_remove(index);
+	}
+	else{
+		for(index = 0; entry[index].used; index++){
+		}
+	}
+
+	entry[index].key = malloc(current_key_length);
+	if(!entry[index].key || cache_peer_copy(&(entry[index].peer), peer)){
+		free(entry[index].key);
+		entry[index].key = NULL;
+		return;
+	}
+
+	memcpy(entry[index].key, current_key, current_key_length);
+	entry[index].key_length = current_key_length;
+	entry[index].hash = current_hash;
+	entry[index].expires = cache_now() + cache_ttl;
+	entry[index].used = 1;
+	entry[index].bucket_next = bucket[current_hash & (buckets - 1)];
+	bucket[current_hash & (buckets - 1)] = index;
+	cache_lru_front(index);
+	cache_used++;
+	current_key_length = 0;
+}
+
+/* Declare a request header or cookie as significant for backend query results */
+static int cache_significant_add(char* name, uint8_t cookie){
+	size_t u;
+
+	for(u = 0; u < significants; u++){
+		if(significant[u].cookie == cookie && !strcasecmp(significant[u].name, name)){
+			return 0;
+		}
+	}
+
+	significant = realloc(significant, (significants + 1) * sizeof(cache_significant));
+	if(!significant){
+		fprintf(stderr, "Failed to allocate memory\n");
+		significants = 0;
+		return 1;
+	}
+
+	significant[significants].cookie = cookie;
+	significant[significants].name = strdup(name);
+	if(!significant[significants].name){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	significants++;
+
+	//existing entries were stored with a different key layout
+	core_cache_invalidate(NULL);
+	return 0;
+}
+
+int core_cache_header(char* tag){
+	return cache_significant_add(tag, 0);
+}
+
+int core_cache_cookie(char* name){
+	return cache_significant_add(name, 1);
+}
+
+/* Drop all cached results for an endpoint, or the complete cache if NULL */
+void core_cache_invalidate(char* endpoint){
+	size_t u;
+
+	for(u = 0; u < cache_size; u++){
+		if(entry[u].used && (!endpoint || !strcmp(entry[u].key, endpoint))){
+			cache_remove(u);
+		}
+	}
+}
+
+void cache_stats(size_t* hits, size_t* misses, size_t* entries){
+	*hits = cache_hits;
+	*misses = cache_misses;
+	*entries = cache_used;
+}
+
+/* Release all entries and significant value declarations */
+void cache_cleanup(){
+	size_t u;
+
+	core_cache_invalidate(NULL);
+	for(u = 0; u < significants; u++){
+		free(significant[u].name);
+	}
+	free(significant);
+	significant = NULL;
+	significants = 0;
+
+	free(entry);
+	free(bucket);
+	entry = NULL;
+	bucket = NULL;
+	cache_size = 0;
+	lru_head = lru_tail = CACHE_NONE;
+}
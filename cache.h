@@ -0,0 +1,8 @@
+#include "websocksy.h"
+
+/* Backend query result (route) cache */
+void cache_init(size_t entries, time_t ttl);
+int cache_lookup(websocket* ws, ws_peer_info* peer);
+void cache_store(ws_peer_info* peer);
+void cache_stats(size_t* hits, size_t* misses, size_t* entries);
+void cache_cleanup();
@@ -5,6 +5,10 @@
 #include "websocksy.h"
 #include "config.h"
 #include "plugin.h"
+#include "cache.h"
+#include "group.h"
+#include "log.h"
+#include "exec.h"
 
 /* Configuration file parser state */
 static enum /*_config_file_section*/ {
@@ -25,8 +29,135 @@ static int config_file_line(ws_config* config, char* key, char* value, size_t li
 	else if(!strcmp(key, "ping")){
 		config->ping_interval = strtoul(value, NULL, 10);
 	}
+	else if(!strcmp(key, "handshake-timeout")){
+		config->handshake_timeout = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "accept-budget")){
+		config->accept_budget = strtoul(value, NULL, 10);
+		if(!config->accept_budget){
+			fprintf(stderr, "Accept budget must be at least 1\n");
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "max-connections")){
+		config->max_connections = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "defer-accept")){
+		config->defer_accept = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "pool-min")){
+		config->pool_min = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "pool-max")){
+		config->pool_max = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "pool-check")){
+		config->pool_check = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "mux-connections")){
+		config->mux_connections = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "broadcast-queue")){
+		config->broadcast_queue = strtoul(value, NULL, 10);
+		if(!config->broadcast_queue){
+			fprintf(stderr, "Broadcast queue limit must be at least 1\n");
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "broadcast-policy")){
+		if(!strcmp(value, "drop")){
+			config->broadcast_skip = 0;
+		}
+		else if(!strcmp(value, "skip")){
+			config->broadcast_skip = 1;
+		}
+		else{
+			fprintf(stderr, "Unknown broadcast policy %s in line %lu\n", value, line_no);
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "route-cache")){
+		config->cache_size = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "route-cache-ttl")){
+		config->cache_ttl = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "group")){
+		if(group_configure(value)){
+			fprintf(stderr, "Invalid peer group in line %lu\n", line_no);
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "group-fail-threshold")){
+		config->group_fail_threshold = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "group-eject-time")){
+		config->group_eject_time = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "breaker-threshold")){
+		config->breaker_threshold = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "breaker-interval")){
+		config->breaker_interval = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "breaker-status")){
+		free(config->breaker_status);
+		config->breaker_status = strdup(value);
+	}
+	else if(!strcmp(key, "resume-grace")){
+		config->resume_grace = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "resume-buffer")){
+		config->resume_buffer = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "resume-cookie")){
+		if(strlen(value) >= WS_RESUME_COOKIE){
+			fprintf(stderr, "Resumption cookie name %s is too long\n", value);
+			return 1;
+		}
+		free(config->resume_cookie);
+		config->resume_cookie = strdup(value);
+	}
+	else if(!strcmp(key, "exec-workers")){
+		config->exec_workers = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "exec-allow")){
+		if(exec_allow(value)){
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "io-budget")){
+		config->io_budget = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "io-messages")){
+		config->io_messages = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "log-level")){
+		if(log_configure(value)){
+			fprintf(stderr, "Invalid log level specification in line %lu\n", line_no);
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "metrics-path")){
+		free(config->metrics_path);
+		config->metrics_path = strdup(value);
+	}
+	else if(!strcmp(key, "memory-limit")){
+		config->memory_limit = strtoul(value, NULL, 10);
+	}
+	else if(!strcmp(key, "memory-pressure")){
+		config->memory_pressure = strtoul(value, NULL, 10);
+		if(config->memory_pressure > 100){
+			fprintf(stderr, "Memory pressure threshold must be a percentage\n");
+			return 1;
+		}
+	}
+	else if(!strcmp(key, "zerocopy-threshold")){
+		config->zerocopy_threshold = strtoul(value, NULL, 10);
+	}
 	else if(!strcmp(key, "backend")){
-		//clean up the previously registered backend
+		//clean up the previously registered backend, including its cache declarations
+		cache_cleanup();
 		if(config->backend.cleanup){
 			config->backend.cleanup();
 		}
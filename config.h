@@ -3,6 +3,33 @@ typedef struct /*_websocksy_config*/ {
 	char* host;
 	char* port;
 	time_t ping_interval;
+	time_t handshake_timeout;
+	size_t accept_budget;
+	size_t max_connections;
+	int defer_accept;
+	size_t pool_min;
+	size_t pool_max;
+	time_t pool_check;
+	size_t mux_connections;
+	size_t broadcast_queue;
+	int broadcast_skip;
+	size_t cache_size;
+	time_t cache_ttl;
+	size_t group_fail_threshold;
+	time_t group_eject_time;
+	size_t breaker_threshold;
+	time_t breaker_interval;
+	char* breaker_status;
+	time_t resume_grace;
+	size_t resume_buffer;
+	char* resume_cookie;
+	size_t exec_workers;
+	size_t zerocopy_threshold;
+	size_t io_budget;
+	size_t io_messages;
+	size_t memory_limit;
+	unsigned memory_pressure;
+	char* metrics_path;
 	ws_backend backend;
 } ws_config;
 
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "exec.h"
+#include "log.h"
+
+/* Maximum number of distinct commands to keep worker pools for */
+#define EXEC_MAX_COMMANDS 64
+/* Maximum number of workers started per pool and maintenance run */
+#define EXEC_SPAWN_BUDGET 4
+/* Shell used to run peer commands */
+#define EXEC_SHELL "/bin/sh"
+
+/*
+ * `exec://<command>` peers connect a WebSocket to the standard input and output of a process.
+ * To keep process startup off the upgrade path, every command has a pool of workers that were
+ * started ahead of time and wait for their first input. Pools are created on the first connection
+ * to a command and are refilled from the core loop; an upgrade finding the pool empty starts its
+ * worker on demand. Each worker serves exactly one WebSocket, as command-line tools consider
+ * the end of their input to be the end of the session. Commands whose workers terminate while
+ * idle (i.e. do not wait for input) are always started on demand instead.
+ * As peer addresses may be built from request data by the backend, only commands listed
+ * with `exec-allow` in the core configuration are ever run.
+ */
+
+typedef struct /*_exec_worker*/ {
+	pid_t pid;
+	int fd;
+} exec_worker;
+
+typedef struct /*_exec_pool*/ {
+	char* command;
+	size_t workers;
+	exec_worker* worker;
+	time_t retry;
+	/* Set for commands that terminate without waiting for input, which are not pre-forked */
+	uint8_t on_demand;
+} exec_pool;
+
+/* Processes handed to a WebSocket, tracked until they have been reaped */
+typedef struct /*_exec_child*/ {
+	pid_t pid;
+	int fd;
+	uint8_t attached;
+} exec_child;
+
+static size_t exec_workers = EXEC_WORKERS_DEFAULT;
+
+static size_t allowed = 0;
+static char** allow = NULL;
+
+static size_t pools = 0;
+static exec_pool* pool = NULL;
+
+static size_t children = 0;
+static exec_child* child = NULL;
+
+/* Configure the number of idle workers per command, 0 starts all processes on demand */
+void exec_init(size_t workers){
+	exec_workers = workers;
+}
+
+/* Add a command to the list of commands that may be run, returns 0 on success */
+int exec_allow(char* command){
+	char** list = realloc(allow, (allowed + 1) * sizeof(char*));
+	if(!list){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	allow = list;
+
+	allow[allowed] = strdup(command);
+	if(!allow[allowed]){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	allowed++;
+	return 0;
+}
+
+/* Check a command against the allowlist, which has to match exactly */
+static int exec_allowed(char* command){
+	size_t u;
+
+	for(u = 0; u < allowed; u++){
+		if(!strcmp(allow[u], command)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Find or create the worker pool for a command */
+static exec_pool* exec_find(char* command){
+	size_t u;
+	exec_pool* list = NULL;
+
+	for(u = 0; u < pools; u++){
+		if(!strcmp(pool[u].command, command)){
+			return pool + u;
+		}
+	}
+
+	if(pools == EXEC_MAX_COMMANDS){
+		return NULL;
+	}
+
+	list = realloc(pool, (pools + 1) * sizeof(exec_pool));
+	if(!list){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return NULL;
+	}
+	pool = list;
+
+	memset(pool + pools, 0, sizeof(exec_pool));
+	pool[pools].command = strdup(command);
+	pool[pools].worker = calloc(exec_workers ? exec_workers : 1, sizeof(exec_worker));
+	if(!pool[pools].command || !pool[pools].worker){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		free(pool[pools].command);
+		free(pool[pools].worker);
+		return NULL;
+	}
+	pools++;
+	return pool + pools - 1;
+}
+
+/*
+ * Start a process for a command, connected to one end of a socket pair.
+ * Returns 0 on success.
+ */
+static int exec_spawn(char* command, exec_worker* worker){
+	int fds[2];
+	pid_t pid;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)){
+		LOG(log_peer, log_error, "Failed to create process socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	pid = fork();
+	if(pid < 0){
+		LOG(log_peer, log_error, "Failed to start %s: %s\n", command, strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return 1;
+	}
+
+	if(!pid){
+		//connect stdin and stdout to the socket, keep stderr and drop all other descriptors
+		if(dup2(fds[1], 0) < 0 || dup2(fds[1], 1) < 0){
+			_exit(EXIT_FAILURE);
+		}
+		close_range(3, ~0U, 0);
+		//the core ignores broken pipes, the tools should not
+		signal(SIGPIPE, SIG_DFL);
+		execl(EXEC_SHELL, "sh", "-c", command, (char*) NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	if(fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK) < 0){
+		LOG(log_peer, log_error, "Failed to set process socket nonblocking: %s\n", strerror(errno));
+	}
+
+	worker->pid = pid;
+	worker->fd = fds[0];
+	return 0;
+}
+
+/* Check whether an idle worker is still running */
+static int exec_worker_alive(exec_worker* worker){
+	return waitpid(worker->pid, NULL, WNOHANG) == 0;
+}
+
+/* Track a process handed to a WebSocket, returns 0 on success */
+static int exec_track(exec_worker* worker){
+	exec_child* list = realloc(child, (children + 1) * sizeof(exec_child));
+
+	if(!list){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+	child = list;
+
+	child[children].pid = worker->pid;
+	child[children].fd = worker->fd;
+	child[children].attached = 1;
+	children++;
+	return 0;
+}
+
+/*
+ * Connect a WebSocket to a process running the peer command.
+ * Returns 0 on success.
+ */
+int exec_attach(websocket* ws){
+	exec_pool* command = NULL;
+	exec_worker worker = {
+		.pid = -1,
+		.fd = -1
+	};
+
+	if(!exec_allowed(ws->peer.host)){
+		LOG(log_peer, log_warn, "Peer command %s is not allowed by exec-allow\n", ws->peer.host);
+		return 1;
+	}
+	command = exec_find(ws->peer.host);
+
+	//prefer an idle worker, dropping any that have terminated in the meantime
+	while(command && command->workers){
+		worker = command->worker[--command->workers];
+		if(exec_worker_alive(&worker)){
+			break;
+		}
+		close(worker.fd);
+		worker.fd = -1;
+		command->on_demand = 1;
+	}
+
+	if(worker.fd < 0 && exec_spawn(ws->peer.host, &worker)){
+		return 1;
+	}
+
+	if(exec_track(&worker)){
+		kill(worker.pid, SIGTERM);
+		waitpid(worker.pid, NULL, 0);
+		close(worker.fd);
+		return 1;
+	}
+
+	ws->peer_fd = worker.fd;
+	return 0;
+}
+
+/* Terminate the process attached to a WebSocket being closed */
+void exec_detach(websocket* ws){
+	size_t u;
+
+	for(u = 0; u < children; u++){
+		if(child[u].attached && child[u].fd == ws->peer_fd){
+			//the process will be reaped from the core loop
+			kill(child[u].pid, SIGTERM);
+			child[u].attached = 0;
+			break;
+		}
+	}
+}
+
+/*
+ * Reap terminated processes and refill all worker pools.
+ * Returns the number of processes still needing attention (terminating or missing workers).
+ */
+size_t exec_maintain(time_t current_time){
+	size_t u, p, started, outstanding = 0;
+	exec_pool* command = NULL;
+
+	for(u = 0; u < children; u++){
+		if(waitpid(child[u].pid, NULL, WNOHANG)){
+			child[u] = child[children - 1];
+			children--;
+			u--;
+		}
+		else if(!child[u].attached){
+			outstanding++;
+		}
+	}
+
+	for(u = 0; u < pools; u++){
+		command = pool + u;
+
+		//remove workers that have terminated while idle
+		for(p = command->workers; p > 0; p--){
+			if(!exec_worker_alive(command->worker + p - 1)){
+				close(command->worker[p - 1].fd);
+				command->worker[p - 1] = command->worker[--command->workers];
+				command->on_demand = 1;
+			}
+		}
+
+		if(command->on_demand){
+			continue;
+		}
+
+		//refill the pool, backing off for a second after failures
+		for(started = 0; current_time >= command->retry
+				&& command->workers < exec_workers
+				&& started < EXEC_SPAWN_BUDGET; started++){
+			if(exec_spawn(command->command, command->worker + command->workers)){
+				command->retry = current_time + 1;
+				break;
+			}
+			command->workers++;
+		}
+
+		if(command->workers < exec_workers){
+			outstanding += exec_workers - command->workers;
+		}
+	}
+
+	return outstanding;
+}
+
+void exec_cleanup(){
+	size_t u, p;
+
+	for(u = 0; u < pools; u++){
+		for(p = 0; p < pool[u].workers; p++){
+			kill(pool[u].worker[p].pid, SIGTERM);
+			close(pool[u].worker[p].fd);
+		}
+		free(pool[u].command);
+		free(pool[u].worker);
+	}
+	free(pool);
+	pool = NULL;
+	pools = 0;
+
+	for(u = 0; u < children; u++){
+		kill(child[u].pid, SIGTERM);
+	}
+	free(child);
+	child = NULL;
+	children = 0;
+
+	for(u = 0; u < allowed; u++){
+		free(allow[u]);
+	}
+	free(allow);
+	allow = NULL;
+	allowed = 0;
+}
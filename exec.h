@@ -0,0 +1,12 @@
+#include "websocksy.h"
+
+/* Default number of idle pre-forked workers kept per command */
+#define EXEC_WORKERS_DEFAULT 2
+
+/* Pre-forked process peers */
+void exec_init(size_t workers);
+int exec_allow(char* command);
+int exec_attach(websocket* ws);
+void exec_detach(websocket* ws);
+size_t exec_maintain(time_t current_time);
+void exec_cleanup();
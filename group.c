@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "group.h"
+#include "log.h"
+
+/* Number of points on the consistent hashing ring per unit of member weight */
+#define GROUP_RING_POINTS 64
+
+/*
+ * Peer groups distribute connections to `group://<name>` addresses over a set of member
+ * addresses, selected by weighted round-robin, least outstanding connections or a consistent
+ * hash over a cookie or header value. Members failing to connect repeatedly are ejected for
+ * a configurable time, connections are retried with another member in the meantime.
+ */
+
+typedef enum /*_group_policy*/ {
+	group_rr = 0,
+	group_lc,
+	group_hash_cookie,
+	group_hash_header
+} group_policy;
+
+typedef struct _group_member {
+	peer_transport transport;
+	char* host;
+	char* port;
+	size_t weight;
+
+	/* Smooth weighted round-robin state */
+	ssize_t current;
+	/* Outstanding connections */
+	size_t active;
+	/* Passive health tracking */
+	size_t failures;
+	time_t ejected_until;
+} group_member;
+
+typedef struct /*_group_ring_point*/ {
+	uint32_t hash;
+	size_t member;
+} group_ring_point;
+
+typedef struct /*_group_entry*/ {
+	char* name;
+	group_policy policy;
+	char* key;
+	size_t members;
+	group_member* member;
+	size_t points;
+	group_ring_point* ring;
+} group_entry;
+
+static size_t fail_threshold = 3;
+static time_t eject_time = 10;
+
+static size_t groups = 0;
+static group_entry* group = NULL;
+
+void group_init(size_t threshold, time_t eject){
+	size_t u;
+
+	fail_threshold = threshold;
+	eject_time = eject;
+
+	//for hashing policies, the selected peer depends on the key value
+	for(u = 0; u < groups; u++){
+		if(group[u].policy == group_hash_cookie){
+			core_cache_cookie(group[u].key);
+		}
+		else if(group[u].policy == group_hash_header){
+			core_cache_header(group[u].key);
+		}
+	}
+}
+
+/* FNV-1a with a final avalanche, so that similar member names spread over the ring */
+static uint32_t group_hash(char* data, size_t length){
+	size_t u;
+	uint32_t hash = 2166136261u;
+
+	for(u = 0; u < length; u++){
+		hash ^= (uint8_t) data[u];
+		hash *= 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static int group_ring_compare(const void* a, const void* b){
+	const group_ring_point* point_a = a, *point_b = b;
+	return (point_a->hash > point_b->hash) - (point_a->hash < point_b->hash);
+}
+
+/* Build the consistent hashing ring for a group */
+static int group_ring(group_entry* target){
+	size_t u, p;
+	char point[BUFSIZ];
+
+	for(u = 0; u < target->members; u++){
+		target->points += target->member[u].weight * GROUP_RING_POINTS;
+	}
+
+	target->ring = calloc(target->points, sizeof(group_ring_point));
+	if(!target->ring){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	target->points = 0;
+	for(u = 0; u < target->members; u++){
+		for(p = 0; p < target->member[u].weight * GROUP_RING_POINTS; p++){
+			snprintf(point, sizeof(point), "%s:%s#%lu", target->member[u].host, target->member[u].port ? target->member[u].port : "", p);
+			target->ring[target->points].hash = group_hash(point, strlen(point));
+			target->ring[target->points].member = u;
+			target->points++;
+		}
+	}
+
+	qsort(target->ring, target->points, sizeof(group_ring_point), group_ring_compare);
+	return 0;
+}
+
+/* Parse a member address with an optional `?weight=<n>` suffix */
+static int group_member_add(group_entry* target, char* address){
+	char* options = strchr(address, '?');
+	group_member* member = realloc(target->member, (target->members + 1) * sizeof(group_member));
+
+	if(!member){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	target->member = member;
+	member += target->members;
+	memset(member, 0, sizeof(group_member));
+	target->members++;
+
+	member->weight = 1;
+	if(options){
+		*options = 0;
+		if(strncmp(options + 1, "weight=", 7) || !(member->weight = strtoul(options + 8, NULL, 10))){
+			fprintf(stderr, "Invalid group member options %s\n", options + 1);
+			return 1;
+		}
+	}
+
+	//resolve transport and port once
+	member->host = strdup(address);
+	if(!member->host){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	member->transport = client_detect_transport(member->host);
+	if(member->transport == peer_group){
+		fprintf(stderr, "Peer groups can not contain other groups\n");
+		return 1;
+	}
+	if(member->transport == peer_tcp_client || member->transport == peer_udp_client){
+		member->port = client_detect_port(member->host);
+		if(!member->port){
+			fprintf(stderr, "Group member %s requires a port\n", address);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Configure a group from a line of the form
+ * `<name> <rr|lc|hash:cookie:<name>|hash:header:<tag>> <member>[?weight=<n>] [<member> ...]`
+ */
+int group_configure(char* spec){
+	char* token = NULL, *save = NULL;
+	group_entry* target = realloc(group, (groups + 1) * sizeof(group_entry));
+
+	if(!target){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	group = target;
+	target = group + groups;
+	memset(target, 0, sizeof(group_entry));
+	groups++;
+
+	token = strtok_r(spec, " ", &save);
+	if(!token){
+		fprintf(stderr, "Missing peer group name\n");
+		return 1;
+	}
+	target->name = strdup(token);
+
+	token = strtok_r(NULL, " ", &save);
+	if(!token){
+		fprintf(stderr, "Missing policy for peer group %s\n", target->name);
+		return 1;
+	}
+	else if(!strcmp(token, "rr")){
+		target->policy = group_rr;
+	}
+	else if(!strcmp(token, "lc")){
+		target->policy = group_lc;
+	}
+	else if(!strncmp(token, "hash:cookie:", 12) && token[12]){
+		target->policy = group_hash_cookie;
+		target->key = strdup(token + 12);
+	}
+	else if(!strncmp(token, "hash:header:", 12) && token[12]){
+		target->policy = group_hash_header;
+		target->key = strdup(token + 12);
+	}
+	else{
+		fprintf(stderr, "Unknown peer group policy %s\n", token);
+		return 1;
+	}
+
+	for(token = strtok_r(NULL, " ", &save); token; token = strtok_r(NULL, " ", &save)){
+		if(group_member_add(target, token)){
+			return 1;
+		}
+	}
+
+	if(!target->members){
+		fprintf(stderr, "Peer group %s has no members\n", target->name);
+		return 1;
+	}
+
+	if(target->policy == group_hash_cookie || target->policy == group_hash_header){
+		return group_ring(target);
+	}
+	return 0;
+}
+
+static int group_member_available(group_member* member, time_t now){
+	return member->ejected_until <= now;
+}
+
+/* Smooth weighted round-robin over available members */
+static group_member* group_select_rr(group_entry* target, time_t now, int any){
+	size_t u, total = 0;
+	group_member* selected = NULL;
+
+	for(u = 0; u < target->members; u++){
+		if(any || group_member_available(target->member + u, now)){
+			target->member[u].current += target->member[u].weight;
+			total += target->member[u].weight;
+			if(!selected || target->member[u].current > selected->current){
+				selected = target->member + u;
+			}
+		}
+	}
+
+	if(selected){
+		selected->current -= total;
+	}
+	return selected;
+}
+
+/* Least outstanding connections relative to the member weight */
+static group_member* group_select_lc(group_entry* target, time_t now, int any){
+	size_t u;
+	group_member* selected = NULL;
+
+	for(u = 0; u < target->members; u++){
+		if((any || group_member_available(target->member + u, now))
+				&& (!selected || target->member[u].active * selected->weight < selected->active * target->member[u].weight)){
+			selected = target->member + u;
+		}
+	}
+	return selected;
+}
+
+/* Find the key value for hashing policies */
+static char* group_key(group_entry* target, websocket* ws, size_t* length){
+	size_t u;
+
+	if(target->policy == group_hash_cookie){
+		return client_cookie(ws, target->key, length);
+	}
+
+	for(u = 0; u < ws->headers; u++){
+		if(!strcasecmp(ws->header[u].tag, target->key)){
+			*length = strlen(ws->header[u].value);
+			return ws->header[u].value;
+		}
+	}
+	return NULL;
+}
+
+/* Walk the ring clockwise from the key hash to the first available member */
+static group_member* group_select_hash(group_entry* target, websocket* ws, time_t now, int any){
+	size_t lower = 0, upper = target->points, middle, u, length = 0;
+	char* key = group_key(target, ws, &length);
+	uint32_t hash;
+
+	//requests without a key are distributed evenly
+	if(!key){
+		return group_select_rr(target, now, any);
+	}
+
+	hash = group_hash(key, length);
+	while(lower < upper){
+		middle = (lower + upper) / 2;
+		if(target->ring[middle].hash < hash){
+			lower = middle + 1;
+		}
+		else{
+			upper = middle;
+		}
+	}
+
+	for(u = 0; u < target->points; u++){
+		middle = target->ring[(lower + u) % target->points].member;
+		if(any || group_member_available(target->member + middle, now)){
+			return target->member + middle;
+		}
+	}
+	return NULL;
+}
+
+static group_member* group_select(group_entry* target, websocket* ws, time_t now, int any){
+	switch(target->policy){
+		case group_rr:
+			return group_select_rr(target, now, any);
+		case group_lc:
+			return group_select_lc(target, now, any);
+		case group_hash_cookie:
+		case group_hash_header:
+			return group_select_hash(target, ws, now, any);
+	}
+	return NULL;
+}
+
+/* Record a failed connection attempt, ejecting the member if it failed too often */
+static void group_fail(group_entry* target, group_member* member, time_t now){
+	member->failures++;
+	if(fail_threshold && member->failures >= fail_threshold && group_member_available(member, now)){
+		LOG(log_peer, log_warn, "Ejecting member %s%s%s of peer group %s for %lu seconds\n", member->host,
+				member->port ? ":" : "", member->port ? member->port : "", target->name, eject_time);
+		member->ejected_until = now + eject_time;
+		member->failures = 0;
+	}
+}
+
+/*
+ * Connect a WebSocket to a member of the group named in its peer address,
+ * trying other members when the connection fails.
+ * Returns 0 on success
+ */
+int group_connect(websocket* ws){
+	size_t u, attempt;
+	int status = 1;
+	group_entry* target = NULL;
+	group_member* member = NULL;
+	struct timespec now;
+	char* framing_config = NULL;
+
+	for(u = 0; u < groups; u++){
+		if(!strcmp(group[u].name, ws->peer.host)){
+			target = group + u;
+			break;
+		}
+	}
+
+	if(!target){
+		LOG(log_peer, log_warn, "Unknown peer group %s\n", ws->peer.host);
+		return 1;
+	}
+
+	//the peer address is replaced by the member address, so the peer data must be owned by the connection
+	if(ws->peer.persistent){
+		framing_config = ws->peer.framing_config;
+		ws->peer.framing_config = framing_config ? strdup(framing_config) : NULL;
+		ws->peer.persistent = 0;
+	}
+	else{
+		free(ws->peer.host);
+		free(ws->peer.port);
+	}
+	ws->peer.host = NULL;
+	ws->peer.port = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	for(attempt = 0; attempt < target->members; attempt++){
+		//once all members are ejected, try them anyway
+		member = group_select(target, ws, now.tv_sec, 0);
+		member = member ? member : group_select(target, ws, now.tv_sec, 1);
+
+		ws->peer.transport = member->transport;
+		ws->peer.host = strdup(member->host);
+		ws->peer.port = member->port ? strdup(member->port) : NULL;
+		if(!ws->peer.host || (member->port && !ws->peer.port)){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return 1;
+		}
+
+		status = client_connect_peer(ws);
+		if(!status){
+			member->failures = 0;
+			member->active++;
+			ws->peer_member = member;
+			return 0;
+		}
+
+		group_fail(target, member, now.tv_sec);
+		free(ws->peer.host);
+		free(ws->peer.port);
+		ws->peer.host = NULL;
+		ws->peer.port = NULL;
+	}
+
+	return status;
+}
+
+/* Release the member connection count held by a WebSocket */
+void group_release(websocket* ws){
+	group_member_release(ws->peer_member);
+	ws->peer_member = NULL;
+}
+
+/* Release a member connection count held outside of a WebSocket */
+void group_member_release(struct _group_member* member){
+	if(member){
+		member->active--;
+	}
+}
+
+void group_cleanup(){
+	size_t u, p;
+
+	for(u = 0; u < groups; u++){
+		for(p = 0; p < group[u].members; p++){
+			free(group[u].member[p].host);
+			free(group[u].member[p].port);
+		}
+		free(group[u].member);
+		free(group[u].ring);
+		free(group[u].name);
+		free(group[u].key);
+	}
+	free(group);
+	group = NULL;
+	groups = 0;
+}
@@ -0,0 +1,9 @@
+#include "websocksy.h"
+
+/* Peer group (load balancing) handling */
+int group_configure(char* spec);
+void group_init(size_t fail_threshold, time_t eject_time);
+int group_connect(websocket* ws);
+void group_release(websocket* ws);
+void group_member_release(struct _group_member* member);
+void group_cleanup();
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+/* Maximum number of records written per system call */
+#define LOG_WRITE_BATCH 64
+
+/*
+ * Log records are formatted by the core loop directly into a single-producer, single-consumer
+ * ring and written to stderr by a background thread, so logging never blocks the core loop on
+ * a slow stderr. Records for levels above the threshold of their category are skipped before
+ * their arguments are evaluated. If the ring is full, records are dropped and counted, and the
+ * writer reports the number of lost records with the next batch.
+ * Before the writer is started (and after it was stopped), records are written synchronously.
+ * All records must be logged from the core loop thread.
+ */
+
+typedef struct /*_log_record*/ {
+	size_t length;
+	char data[LOG_RECORD_MAX];
+} log_record;
+
+log_level log_threshold[log_categories] = {
+	log_info,
+	log_info,
+	log_info,
+	log_info
+};
+
+static char* level_name[] = {
+	"error",
+	"warn",
+	"info",
+	"debug"
+};
+
+static char* category_name[] = {
+	"core",
+	"http",
+	"frames",
+	"peer"
+};
+
+static log_record ring[LOG_RING_SLOTS];
+/* Next slot to be written by the core loop / to be read by the writer */
+static size_t head = 0;
+static size_t tail = 0;
+/* Records dropped since the last report / since startup */
+static size_t dropped = 0;
+static size_t dropped_total = 0;
+
+static pthread_t writer;
+static int writer_running = 0;
+static int writer_waiting = 0;
+static int writer_stop = 0;
+static int notify_fd = -1;
+
+/* Find a level by name, returns 0 on success */
+static int log_level_parse(char* name, log_level* level){
+	size_t u;
+
+	for(u = 0; u < sizeof(level_name) / sizeof(level_name[0]); u++){
+		if(!strcmp(name, level_name[u])){
+			*level = u;
+			return 0;
+		}
+	}
+	fprintf(stderr, "Unknown log level %s\n", name);
+	return 1;
+}
+
+/*
+ * Configure the log thresholds from a comma-separated list of a default level and
+ * `<category>=<level>` overrides, e.g. `warn,frames=debug`. Returns 0 on success.
+ */
+int log_configure(char* spec){
+	char* token = NULL, *level = NULL;
+	log_level parsed;
+	size_t u;
+
+	for(token = strtok(spec, ","); token; token = strtok(NULL, ",")){
+		level = strchr(token, '=');
+		if(!level){
+			if(log_level_parse(token, &parsed)){
+				return 1;
+			}
+			for(u = 0; u < log_categories; u++){
+				log_threshold[u] = parsed;
+			}
+			continue;
+		}
+
+		*level++ = 0;
+		for(u = 0; u < log_categories; u++){
+			if(!strcmp(token, category_name[u])){
+				break;
+			}
+		}
+
+		if(u == log_categories){
+			fprintf(stderr, "Unknown log category %s\n", token);
+			return 1;
+		}
+
+		if(log_level_parse(level, &parsed)){
+			return 1;
+		}
+		log_threshold[u] = parsed;
+	}
+	return 0;
+}
+
+/* Write a buffer to stderr completely, retrying short writes */
+static void log_output(char* data, size_t length){
+	ssize_t written;
+
+	while(length){
+		written = write(STDERR_FILENO, data, length);
+		if(written < 0 && errno == EINTR){
+			continue;
+		}
+		if(written <= 0){
+			return;
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+/* Drain the ring into stderr until asked to stop */
+static void* log_writer(void* unused){
+	struct iovec iov[LOG_WRITE_BATCH];
+	char notice[LOG_RECORD_MAX];
+	size_t u, available, start, lost;
+	ssize_t written;
+	uint64_t value;
+
+	while(1){
+		start = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		available = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - start;
+
+		if(!available){
+			if(__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)){
+				break;
+			}
+
+			//announce that we are about to sleep, then check again before doing so
+			__atomic_store_n(&writer_waiting, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&head, __ATOMIC_RELAXED) == start && !__atomic_load_n(&writer_stop, __ATOMIC_RELAXED)){
+				if(read(notify_fd, &value, sizeof(value)) < 0 && errno != EINTR && errno != EAGAIN){
+					break;
+				}
+			}
+			__atomic_store_n(&writer_waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if(available > LOG_WRITE_BATCH){
+			available = LOG_WRITE_BATCH;
+		}
+
+		for(u = 0; u < available; u++){
+			iov[u].iov_base = ring[(start + u) % LOG_RING_SLOTS].data;
+			iov[u].iov_len = ring[(start + u) % LOG_RING_SLOTS].length;
+		}
+
+		written = writev(STDERR_FILENO, iov, available);
+		if(written < 0 && errno == EINTR){
+			continue;
+		}
+
+		//short writes are rare for stderr, finish them record by record
+		for(u = 0; written >= 0 && u < available; u++){
+			if(written >= iov[u].iov_len){
+				written -= iov[u].iov_len;
+				continue;
+			}
+			log_output((char*) iov[u].iov_base + written, iov[u].iov_len - written);
+			written = 0;
+		}
+		__atomic_store_n(&tail, start + available, __ATOMIC_RELEASE);
+
+		lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+		if(lost){
+			log_output(notice, snprintf(notice, sizeof(notice), "Log ring full, dropped %lu records\n", lost));
+		}
+	}
+	return NULL;
+}
+
+/* Start the background writer, returns 0 on success */
+int log_init(){
+	sigset_t signals, previous;
+
+	notify_fd = eventfd(0, EFD_CLOEXEC);
+	if(notify_fd < 0){
+		fprintf(stderr, "Failed to create log notification: %s\n", strerror(errno));
+		return 1;
+	}
+
+	//signals are handled by the core loop thread
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	writer_running = !pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	if(!writer_running){
+		fprintf(stderr, "Failed to start log writer\n");
+		close(notify_fd);
+		notify_fd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+void log_write(log_category category, log_level level, const char* format, ...){
+	size_t position = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	uint64_t value = 1;
+	log_record* record = NULL;
+	char buffer[LOG_RECORD_MAX];
+	va_list args;
+	int length;
+
+	if(writer_running && position - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS){
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		dropped_total++;
+		return;
+	}
+
+	va_start(args, format);
+	length = vsnprintf(writer_running ? ring[position % LOG_RING_SLOTS].data : buffer, LOG_RECORD_MAX, format, args);
+	va_end(args);
+
+	if(length < 0){
+		return;
+	}
+
+	if(!writer_running){
+		log_output(buffer, (length < LOG_RECORD_MAX) ? length : LOG_RECORD_MAX - 1);
+		return;
+	}
+
+	record = ring + position % LOG_RING_SLOTS;
+	record->length = length;
+	if(length >= LOG_RECORD_MAX){
+		//keep truncated records on their own line
+		record->length = LOG_RECORD_MAX - 1;
+		record->data[LOG_RECORD_MAX - 2] = '\n';
+	}
+	__atomic_store_n(&head, position + 1, __ATOMIC_RELEASE);
+
+	//only wake up the writer if it sleeps
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&writer_waiting, __ATOMIC_RELAXED)){
+		if(write(notify_fd, &value, sizeof(value)) < 0){
+			__atomic_store_n(&writer_waiting, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Number of records dropped since startup */
+size_t log_dropped(){
+	return dropped_total;
+}
+
+/* Write all pending records and stop the writer */
+void log_cleanup(){
+	uint64_t value = 1;
+
+	if(!writer_running){
+		return;
+	}
+
+	__atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+	if(write(notify_fd, &value, sizeof(value)) < 0){
+		fprintf(stderr, "Failed to stop log writer: %s\n", strerror(errno));
+	}
+	pthread_join(writer, NULL);
+	writer_running = 0;
+	close(notify_fd);
+	notify_fd = -1;
+}
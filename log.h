@@ -0,0 +1,41 @@
+#include <stddef.h>
+
+/* Number of records the log ring holds before dropping, must be a power of two */
+#define LOG_RING_SLOTS 1024
+/* Maximum length of a single log record, longer records are truncated */
+#define LOG_RECORD_MAX 256
+
+typedef enum {
+	log_error = 0,
+	log_warn,
+	log_info,
+	log_debug
+} log_level;
+
+typedef enum {
+	/* Core loop and resource handling */
+	log_core = 0,
+	/* HTTP request parsing and the upgrade handshake */
+	log_http,
+	/* Per-message traffic between WebSockets and peers */
+	log_frames,
+	/* Peer connections */
+	log_peer,
+	log_categories
+} log_category;
+
+/* Most verbose level logged per category, checked before any arguments are evaluated */
+extern log_level log_threshold[log_categories];
+
+#define LOG(category, level, ...) do { \
+		if((level) <= log_threshold[(category)]){ \
+			log_write((category), (level), __VA_ARGS__); \
+		} \
+	} while(0)
+
+/* Leveled asynchronous logging */
+int log_configure(char* spec);
+int log_init();
+void log_write(log_category category, log_level level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+size_t log_dropped();
+void log_cleanup();
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "memory.h"
+#include "log.h"
+
+/* System-wide pressure stall information, used if the cgroup does not provide its own */
+#define MEMORY_PRESSURE_SYSTEM "/proc/pressure/memory"
+#define MEMORY_CGROUP_ROOT "/sys/fs/cgroup"
+
+/*
+ * All larger allocations made by the core are accounted to a subsystem, and connections
+ * can be weighed by the memory they currently hold. Once the total reaches configured fractions
+ * of the memory limit, the core loop responds in steps: buffers of idle connections and unused
+ * registry slots are released, new connections are refused, and finally the connections holding
+ * the most memory are closed with status 1013 (Try again later).
+ * Optionally, the memory pressure stall information of the cgroup (or the system) is read once per
+ * second: stalls of some tasks above the threshold refuse new connections, stalls of all tasks
+ * additionally shed one connection per reading.
+ */
+
+static size_t memory_limit = 0;
+static size_t accounted[memory_subsystems] = {0};
+static size_t total = 0;
+
+static unsigned pressure_threshold = 0;
+static char pressure_path[PATH_MAX] = "";
+static time_t pressure_checked = 0;
+static unsigned long long pressure_stalled = 0;
+static memory_level pressure_level = memory_normal;
+
+static memory_level reported = memory_normal;
+static char* level_name[] = {
+	"normal",
+	"releasing idle buffers",
+	"refusing new connections",
+	"shedding connections"
+};
+
+/* Find the pressure stall information of the cgroup we are running in, falling back to the system-wide values */
+static int memory_pressure_locate(){
+	char line[PATH_MAX] = "";
+	FILE* file = fopen("/proc/self/cgroup", "r");
+
+	//the unified hierarchy is listed as `0::<path>`
+	while(file && fgets(line, sizeof(line), file)){
+		if(!strncmp(line, "0::", 3)){
+			line[strcspn(line, "\n")] = 0;
+			snprintf(pressure_path, sizeof(pressure_path), "%s%s/memory.pressure", MEMORY_CGROUP_ROOT, (strcmp(line + 3, "/")) ? line + 3 : "");
+			break;
+		}
+	}
+	if(file){
+		fclose(file);
+	}
+
+	file = pressure_path[0] ? fopen(pressure_path, "r") : NULL;
+	if(!file){
+		strncpy(pressure_path, MEMORY_PRESSURE_SYSTEM, sizeof(pressure_path));
+		file = fopen(pressure_path, "r");
+	}
+
+	if(!file){
+		fprintf(stderr, "Memory pressure information is not available\n");
+		return 1;
+	}
+	fclose(file);
+	return 0;
+}
+
+/* Read the current memory pressure and map it to a response level */
+static memory_level memory_pressure(){
+	FILE* file = fopen(pressure_path, "r");
+	memory_level level = memory_normal;
+	unsigned long long stalled;
+	char kind[8];
+	double average;
+
+	if(!file){
+		LOG(log_core, log_warn, "Failed to read memory pressure from %s\n", pressure_path);
+		return memory_normal;
+	}
+
+	//lines read `<some|full> avg10=<percent> avg60=<percent> avg300=<percent> total=<microseconds>`
+	while(fscanf(file, "%7s avg10=%lf avg60=%*f avg300=%*f total=%llu", kind, &average, &stalled) == 3){
+		if(!strcmp(kind, "some") && average >= pressure_threshold && level < memory_refuse){
+			level = memory_refuse;
+		}
+		else if(!strcmp(kind, "full")){
+			//the averages decay slowly, only shed while all tasks are still stalling
+			if(average >= pressure_threshold && stalled > pressure_stalled){
+				level = memory_shed;
+			}
+			pressure_stalled = stalled;
+		}
+	}
+
+	fclose(file);
+	return level;
+}
+
+/*
+ * Configure the memory limit in bytes and the pressure stall threshold in percent,
+ * 0 disables either. Returns 0 on success.
+ */
+int memory_init(size_t limit, unsigned pressure){
+	memory_limit = limit;
+	pressure_threshold = pressure;
+
+	if(pressure_threshold){
+		if(memory_pressure_locate()){
+			return 1;
+		}
+		//take the initial stall counters as the baseline
+		memory_pressure();
+	}
+	return 0;
+}
+
+/* Account allocated (positive) or released (negative) bytes to a subsystem */
+void memory_account(memory_subsystem subsystem, ssize_t bytes){
+	accounted[subsystem] += bytes;
+	total += bytes;
+}
+
+size_t memory_usage(memory_subsystem subsystem){
+	return accounted[subsystem];
+}
+
+size_t memory_total(){
+	return total;
+}
+
+/* Memory currently held by a connection, beyond its registry slot */
+size_t memory_connection(websocket* ws){
+	size_t u, bytes = ws->queue_bytes + ws->queue_alloc * sizeof(ws_buffer*) + ws->peer_replay_length + ws->peer_backlog.length;
+
+	if(ws->http_arena){
+		bytes += WS_HTTP_ARENA;
+	}
+
+	//buffers waiting for zero-copy completion are no longer part of the queue
+	for(u = 0; u < ws->zerocopy_entries; u++){
+		if(ws->zerocopy_buffer[u]){
+			bytes += ws->zerocopy_buffer[u]->length;
+		}
+	}
+	return bytes;
+}
+
+/* Response level for the accounted memory, pressure readings only refuse new connections here */
+memory_level memory_level_current(){
+	memory_level level = memory_normal;
+
+	if(memory_limit){
+		if(total >= memory_limit){
+			level = memory_shed;
+		}
+		else if(total >= memory_limit / 100 * MEMORY_REFUSE_PERCENT){
+			level = memory_refuse;
+		}
+		else if(total >= memory_limit / 100 * MEMORY_SHRINK_PERCENT){
+			level = memory_shrink;
+		}
+	}
+
+	if(level < memory_refuse && pressure_level >= memory_refuse){
+		level = memory_refuse;
+	}
+	return level;
+}
+
+/* Update the memory pressure reading and return the response level for this loop turn */
+memory_level memory_maintain(time_t current_time){
+	memory_level level;
+
+	if(pressure_threshold && current_time != pressure_checked){
+		pressure_checked = current_time;
+		pressure_level = memory_pressure();
+	}
+	else if(pressure_level == memory_shed){
+		//shed at most once per reading
+		pressure_level = memory_refuse;
+	}
+
+	level = memory_level_current();
+	if(pressure_level > level){
+		level = pressure_level;
+	}
+
+	if(level != reported){
+		LOG(log_core, log_warn, "Memory response changed to %s, %lu bytes accounted\n", level_name[level], total);
+		reported = level;
+	}
+	return level;
+}
@@ -0,0 +1,43 @@
+#include <sys/types.h>
+#include "websocksy.h"
+
+/* Fraction of the memory limit (in percent) at which idle buffers are released and new connections refused */
+#define MEMORY_SHRINK_PERCENT 75
+#define MEMORY_REFUSE_PERCENT 90
+/* Maximum number of connections shed per loop turn */
+#define MEMORY_SHED_BUDGET 16
+
+/* Subsystems memory is accounted to */
+typedef enum {
+	/* Client registry slots */
+	memory_clients = 0,
+	/* HTTP request data arenas */
+	memory_requests,
+	/* Outbound frame buffers */
+	memory_frames,
+	/* Client data buffered while reconnecting a peer */
+	memory_replay,
+	/* Peer data buffered for parked sessions */
+	memory_sessions,
+	memory_subsystems
+} memory_subsystem;
+
+/* Graduated responses to memory pressure, each level includes the ones before it */
+typedef enum {
+	memory_normal = 0,
+	/* Release buffers of idle connections and unused slots */
+	memory_shrink,
+	/* Stop accepting new connections */
+	memory_refuse,
+	/* Close the connections holding the most memory */
+	memory_shed
+} memory_level;
+
+/* Memory accounting and pressure handling */
+int memory_init(size_t limit, unsigned pressure);
+void memory_account(memory_subsystem subsystem, ssize_t bytes);
+size_t memory_usage(memory_subsystem subsystem);
+size_t memory_total();
+size_t memory_connection(websocket* ws);
+memory_level memory_level_current();
+memory_level memory_maintain(time_t current_time);
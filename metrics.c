@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "metrics.h"
+#include "websocket.h"
+#include "cache.h"
+#include "pool.h"
+#include "breaker.h"
+#include "memory.h"
+#include "log.h"
+
+/* Number of buckets needed to cover all 64 bit nanosecond values */
+#define METRICS_BUCKETS (64 << METRICS_SUB_BUCKET_BITS)
+
+#define METRICS_HTTP_HEADER "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\nContent-Length: %lu\r\n\r\n"
+
+/*
+ * Counters are plain integers updated from the core loop, the only thread touching them.
+ * Latencies are recorded in nanoseconds into log-linear (HDR-style) histograms: values are
+ * bucketed by their power of two, which is again split into 2^METRICS_SUB_BUCKET_BITS linear
+ * sub-buckets, bounding the relative error independent of the magnitude.
+ * Traffic is counted per peer address, which is selected by the backend and not by the client,
+ * the first index collects all peers beyond METRICS_PEERS. When no metrics path is configured, no
+ * timestamps are taken.
+ */
+
+typedef struct /*_metrics_peer*/ {
+	char* address;
+	size_t connections;
+	size_t messages[metrics_directions];
+	size_t bytes[metrics_directions];
+} metrics_peer;
+
+typedef struct /*_metrics_latency*/ {
+	uint64_t bucket[METRICS_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+} metrics_latency;
+
+static char* metrics_path = NULL;
+
+static size_t peers = 1;
+static metrics_peer peer[METRICS_PEERS + 1] = {
+	{.address = "other"}
+};
+
+static metrics_latency latency[metrics_histograms];
+
+static size_t accepted = 0;
+static size_t upgraded = 0;
+/* Failed handshakes by HTTP status, 0 for connections closed without response */
+static size_t handshake_failures[600];
+
+static char* direction_name[] = {
+	"peer",
+	"client"
+};
+
+static char* histogram_name[] = {
+	"websocksy_backend_query_seconds",
+	"websocksy_peer_connect_seconds",
+	"websocksy_framing_seconds",
+	"websocksy_forward_seconds"
+};
+
+static char* histogram_help[] = {
+	"Backend query time for requests not answered from the route cache",
+	"Time to connect a peer",
+	"Time spent in framing functions per call",
+	"Time from reading peer data to forwarding the resulting frame"
+};
+
+static char* state_name[] = {
+	"new",
+	"http",
+	"open",
+	"closed"
+};
+
+static char* subsystem_name[] = {
+	"clients",
+	"requests",
+	"frames",
+	"replay",
+	"sessions"
+};
+
+/* Serve metrics on requests for `path`, NULL disables metrics */
+void metrics_init(char* path){
+	metrics_path = path;
+}
+
+/* Check whether a request is to be answered with the metrics instead of an upgrade */
+int metrics_requested(websocket* ws){
+	return metrics_path && ws->request_path && !strcmp(ws->request_path, metrics_path);
+}
+
+void metrics_accepted(){
+	accepted++;
+}
+
+/* Count an upgraded connection against its peer */
+void metrics_upgraded(websocket* ws){
+	char address[WS_MAX_LINE];
+	size_t u;
+
+	snprintf(address, sizeof(address), "%s%s%s", ws->peer.host ? ws->peer.host : "", ws->peer.port ? ":" : "", ws->peer.port ? ws->peer.port : "");
+
+	upgraded++;
+	ws->metrics_peer = 0;
+	for(u = 1; u < peers; u++){
+		if(!strcmp(peer[u].address, address)){
+			ws->metrics_peer = u;
+			break;
+		}
+	}
+
+	if(u == peers && peers <= METRICS_PEERS){
+		peer[peers].address = strdup(address);
+		if(peer[peers].address){
+			ws->metrics_peer = peers++;
+		}
+	}
+	peer[ws->metrics_peer].connections++;
+}
+
+/* Count a handshake that was answered with an HTTP error status (or none, if NULL) */
+void metrics_handshake_failed(char* status){
+	size_t code = status ? strtoul(status, NULL, 10) : 0;
+
+	handshake_failures[(code < sizeof(handshake_failures) / sizeof(handshake_failures[0])) ? code : 0]++;
+}
+
+void metrics_traffic(websocket* ws, metrics_direction direction, size_t bytes){
+	peer[ws->metrics_peer].messages[direction]++;
+	peer[ws->metrics_peer].bytes[direction] += bytes;
+}
+
+/* Current monotonic time in nanoseconds, 0 if metrics are disabled */
+uint64_t metrics_now(){
+	struct timespec now;
+
+	if(!metrics_path){
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Bucket index for a value in nanoseconds */
+static size_t metrics_bucket(uint64_t value){
+	unsigned magnitude;
+
+	if(value < (1 << METRICS_SUB_BUCKET_BITS)){
+		return value;
+	}
+
+	magnitude = 63 - __builtin_clzll(value);
+	return ((magnitude - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS)
+		+ ((value >> (magnitude - METRICS_SUB_BUCKET_BITS)) & ((1 << METRICS_SUB_BUCKET_BITS) - 1));
+}
+
+/* Largest value (in nanoseconds) falling into a bucket */
+static uint64_t metrics_bucket_limit(size_t bucket){
+	size_t magnitude = (bucket >> METRICS_SUB_BUCKET_BITS);
+
+	if(!magnitude){
+		return bucket;
+	}
+	return (((bucket & ((1 << METRICS_SUB_BUCKET_BITS) - 1)) + (1 << METRICS_SUB_BUCKET_BITS) + 1) << (magnitude - 1)) - 1;
+}
+
+/* Record the time passed since `start` (taken with metrics_now) */
+void metrics_observe(metrics_histogram histogram, uint64_t start){
+	uint64_t elapsed;
+
+	if(!start){
+		return;
+	}
+
+	elapsed = metrics_now() - start;
+	latency[histogram].bucket[metrics_bucket(elapsed)]++;
+	latency[histogram].count++;
+	latency[histogram].sum += elapsed;
+}
+
+/* Write a label value, escaped as required by the exposition format */
+static void metrics_label(FILE* out, char* value){
+	for(; *value; value++){
+		if(*value == '\\' || *value == '"'){
+			fputc('\\', out);
+		}
+		if(*value == '\n'){
+			fputs("\\n", out);
+			continue;
+		}
+		fputc(*value, out);
+	}
+}
+
+static void metrics_write_histograms(FILE* out){
+	size_t h, u, first = METRICS_EXPORT_MIN << METRICS_SUB_BUCKET_BITS, last = (METRICS_EXPORT_MAX + 1) << METRICS_SUB_BUCKET_BITS;
+	uint64_t cumulative;
+
+	for(h = 0; h < metrics_histograms; h++){
+		fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", histogram_name[h], histogram_help[h], histogram_name[h]);
+
+		//all values below the first exported bucket are part of it
+		cumulative = 0;
+		for(u = 0; u < first; u++){
+			cumulative += latency[h].bucket[u];
+		}
+
+		for(u = first; u < last; u++){
+			cumulative += latency[h].bucket[u];
+			fprintf(out, "%s_bucket{le=\"%.9f\"} %lu\n", histogram_name[h], metrics_bucket_limit(u) / 1e9, cumulative);
+		}
+		fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", histogram_name[h], latency[h].count);
+		fprintf(out, "%s_sum %.9f\n", histogram_name[h], latency[h].sum / 1e9);
+		fprintf(out, "%s_count %lu\n", histogram_name[h], latency[h].count);
+	}
+}
+
+static void metrics_write(FILE* out){
+	size_t u, d, state[sizeof(state_name) / sizeof(state_name[0])] = {0};
+	size_t hits, misses, entries, open;
+	websocket* ws = NULL;
+
+	for(u = 0; u < client_slots(); u++){
+		ws = client_get(u);
+		if(ws){
+			state[ws->state]++;
+		}
+	}
+
+	fprintf(out, "# HELP websocksy_connections Current client connections by state\n# TYPE websocksy_connections gauge\n");
+	for(u = 0; u < sizeof(state) / sizeof(state[0]); u++){
+		fprintf(out, "websocksy_connections{state=\"%s\"} %lu\n", state_name[u], state[u]);
+	}
+	fprintf(out, "# HELP websocksy_accepted_total Accepted client connections\n# TYPE websocksy_accepted_total counter\n");
+	fprintf(out, "websocksy_accepted_total %lu\n", accepted);
+	fprintf(out, "# HELP websocksy_upgraded_total Connections upgraded to WebSockets\n# TYPE websocksy_upgraded_total counter\n");
+	fprintf(out, "websocksy_upgraded_total %lu\n", upgraded);
+
+	fprintf(out, "# HELP websocksy_handshake_failures_total Failed handshakes by HTTP response status, 0 if none was sent\n# TYPE websocksy_handshake_failures_total counter\n");
+	for(u = 0; u < sizeof(handshake_failures) / sizeof(handshake_failures[0]); u++){
+		if(handshake_failures[u]){
+			fprintf(out, "websocksy_handshake_failures_total{status=\"%lu\"} %lu\n", u, handshake_failures[u]);
+		}
+	}
+
+	fprintf(out, "# HELP websocksy_peer_connections_total Upgraded connections by peer\n# TYPE websocksy_peer_connections_total counter\n");
+	for(u = 0; u < peers; u++){
+		fprintf(out, "websocksy_peer_connections_total{peer=\"");
+		metrics_label(out, peer[u].address);
+		fprintf(out, "\"} %lu\n", peer[u].connections);
+	}
+
+	fprintf(out, "# HELP websocksy_messages_total Messages forwarded by peer and destination\n# TYPE websocksy_messages_total counter\n");
+	for(u = 0; u < peers; u++){
+		for(d = 0; d < metrics_directions; d++){
+			fprintf(out, "websocksy_messages_total{peer=\"");
+			metrics_label(out, peer[u].address);
+			fprintf(out, "\",to=\"%s\"} %lu\n", direction_name[d], peer[u].messages[d]);
+		}
+	}
+
+	fprintf(out, "# HELP websocksy_bytes_total Payload bytes forwarded by peer and destination\n# TYPE websocksy_bytes_total counter\n");
+	for(u = 0; u < peers; u++){
+		for(d = 0; d < metrics_directions; d++){
+			fprintf(out, "websocksy_bytes_total{peer=\"");
+			metrics_label(out, peer[u].address);
+			fprintf(out, "\",to=\"%s\"} %lu\n", direction_name[d], peer[u].bytes[d]);
+		}
+	}
+
+	metrics_write_histograms(out);
+
+	cache_stats(&hits, &misses, &entries);
+	fprintf(out, "# HELP websocksy_route_cache_lookups_total Route cache lookups by result\n# TYPE websocksy_route_cache_lookups_total counter\n");
+	fprintf(out, "websocksy_route_cache_lookups_total{result=\"hit\"} %lu\nwebsocksy_route_cache_lookups_total{result=\"miss\"} %lu\n", hits, misses);
+	fprintf(out, "# HELP websocksy_route_cache_entries Cached backend query results\n# TYPE websocksy_route_cache_entries gauge\n");
+	fprintf(out, "websocksy_route_cache_entries %lu\n", entries);
+
+	pool_stats(&hits, &misses);
+	fprintf(out, "# HELP websocksy_pool_takes_total Peer connections requested from the pool by result\n# TYPE websocksy_pool_takes_total counter\n");
+	fprintf(out, "websocksy_pool_takes_total{result=\"hit\"} %lu\nwebsocksy_pool_takes_total{result=\"miss\"} %lu\n", hits, misses);
+
+	breaker_stats(&open, &hits, &misses);
+	fprintf(out, "# HELP websocksy_breakers_open Peer addresses with an open circuit breaker\n# TYPE websocksy_breakers_open gauge\n");
+	fprintf(out, "websocksy_breakers_open %lu\n", open);
+	fprintf(out, "# HELP websocksy_breaker_rejected_total Connections rejected by circuit breakers\n# TYPE websocksy_breaker_rejected_total counter\n");
+	fprintf(out, "websocksy_breaker_rejected_total %lu\n", hits);
+	fprintf(out, "# HELP websocksy_breaker_probes_total Probe connections to unavailable peers\n# TYPE websocksy_breaker_probes_total counter\n");
+	fprintf(out, "websocksy_breaker_probes_total %lu\n", misses);
+
+	fprintf(out, "# HELP websocksy_memory_bytes Memory accounted by subsystem\n# TYPE websocksy_memory_bytes gauge\n");
+	for(u = 0; u < memory_subsystems; u++){
+		fprintf(out, "websocksy_memory_bytes{subsystem=\"%s\"} %lu\n", subsystem_name[u], memory_usage(u));
+	}
+
+	fprintf(out, "# HELP websocksy_log_dropped_total Log records dropped because the log ring was full\n# TYPE websocksy_log_dropped_total counter\n");
+	fprintf(out, "websocksy_log_dropped_total %lu\n", log_dropped());
+}
+
+/*
+ * Answer a metrics request once its headers have been read. The connection is closed afterwards.
+ * Returns 0 on success.
+ */
+int metrics_respond(websocket* ws){
+	char header[sizeof(METRICS_HTTP_HEADER) + 20];
+	char* body = NULL;
+	size_t length = 0;
+	int rv;
+	FILE* out = open_memstream(&body, &length);
+	struct iovec iov[2];
+
+	if(!out){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	metrics_write(out);
+	fclose(out);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = snprintf(header, sizeof(header), METRICS_HTTP_HEADER, length);
+	iov[1].iov_base = body;
+	iov[1].iov_len = length;
+	rv = ws_send(ws, iov, 2);
+	free(body);
+	return rv;
+}
+
+void metrics_cleanup(){
+	size_t u;
+
+	for(u = 1; u < peers; u++){
+		free(peer[u].address);
+	}
+	peers = 1;
+}
@@ -0,0 +1,35 @@
+#include "websocksy.h"
+
+/* Maximum number of distinct peers counted separately, further peers are counted as `other` */
+#define METRICS_PEERS 64
+/* Latency histogram resolution: each power of two is split into 2^METRICS_SUB_BUCKET_BITS buckets */
+#define METRICS_SUB_BUCKET_BITS 1
+/* Range of latency histogram buckets exported, in powers of two nanoseconds (~1us to ~68s) */
+#define METRICS_EXPORT_MIN 10
+#define METRICS_EXPORT_MAX 35
+
+typedef enum {
+	metrics_to_peer = 0,
+	metrics_to_client,
+	metrics_directions
+} metrics_direction;
+
+typedef enum {
+	metrics_backend_query = 0,
+	metrics_peer_connect,
+	metrics_framing,
+	metrics_forward,
+	metrics_histograms
+} metrics_histogram;
+
+/* Runtime metrics in Prometheus text format */
+void metrics_init(char* path);
+int metrics_requested(websocket* ws);
+int metrics_respond(websocket* ws);
+void metrics_accepted();
+void metrics_upgraded(websocket* ws);
+void metrics_handshake_failed(char* status);
+void metrics_traffic(websocket* ws, metrics_direction direction, size_t bytes);
+uint64_t metrics_now();
+void metrics_observe(metrics_histogram histogram, uint64_t start);
+void metrics_cleanup();
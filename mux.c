@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "mux.h"
+#include "network.h"
+#include "websocket.h"
+#include "log.h"
+
+/* Maximum number of concurrently open channels per peer connection */
+#define MUX_MAX_CHANNELS 65536
+
+/*
+ * Channel ids consist of the slot within the channel table and a per-connection generation
+ * counter, so that late messages for a closed channel are never delivered to its successor.
+ */
+#define MUX_CHANNEL_ID(generation, slot) ((((uint32_t) (generation)) << 16) | (slot))
+#define MUX_CHANNEL_SLOT(id) ((id) & 0xFFFF)
+
+typedef struct /*_mux_channel*/ {
+	uint32_t id;
+	size_t client;
+	int64_t credit;
+	size_t consumed;
+} mux_channel;
+
+typedef struct /*_mux_connection*/ {
+	peer_transport transport;
+	char* host;
+	char* port;
+	int fd;
+	network_backlog backlog;
+	uint8_t buffer[MUX_BUFFER_SIZE];
+	size_t buffer_offset;
+	/* Bytes of a rejected oversized message still to be skipped */
+	size_t discard;
+	uint16_t generation;
+	size_t active;
+	size_t channels;
+	mux_channel* channel;
+} mux_connection;
+
+static size_t connections = 0;
+static mux_connection** connection = NULL;
+
+/* Send a message with header on a peer connection */
+static int mux_message_send(mux_connection* conn, uint32_t channel, mux_message type, uint8_t* data, size_t length){
+	uint8_t header[MUX_HEADER_LENGTH] = {
+		channel >> 24, channel >> 16, channel >> 8, channel,
+		type,
+		length >> 16, length >> 8, length
+	};
+	struct iovec iov[2] = {
+		{.iov_base = header, .iov_len = sizeof(header)},
+		{.iov_base = data, .iov_len = length}
+	};
+
+	return network_sendv(conn->fd, &(conn->backlog), iov, length ? 2 : 1);
+}
+
+/* Tear down a peer connection and all WebSockets using it */
+static void mux_fail(mux_connection* conn){
+	size_t u;
+	websocket* ws = NULL;
+
+	close(conn->fd);
+	conn->fd = -1;
+	conn->buffer_offset = 0;
+	conn->discard = 0;
+	network_backlog_clear(&(conn->backlog));
+
+	for(u = 0; u < conn->channels; u++){
+		if(conn->channel[u].id){
+			ws = client_get(conn->channel[u].client);
+			conn->channel[u].id = 0;
+			if(ws){
+				ws_close(ws, ws_close_unexpected, "Peer connection failed");
+			}
+		}
+	}
+	conn->active = 0;
+}
+
+/* Find an open channel by websocket */
+static mux_channel* mux_channel_find(websocket* ws){
+	mux_connection* conn = NULL;
+	mux_channel* chan = NULL;
+
+	if(ws->peer.transport != peer_mux || !ws->peer_channel || ws->peer_shared >= connections){
+		return NULL;
+	}
+
+	conn = connection[ws->peer_shared];
+	if(MUX_CHANNEL_SLOT(ws->peer_channel) >= conn->channels){
+		return NULL;
+	}
+
+	chan = conn->channel + MUX_CHANNEL_SLOT(ws->peer_channel);
+	return (chan->id == ws->peer_channel) ? chan : NULL;
+}
+
+/* Select a connection for a new channel, opening new connections up to the configured number */
+static mux_connection* mux_connection_select(peer_transport transport, char* host, char* port, size_t max_connections, size_t* index){
+	size_t u, open = 0, free_slot = connections;
+	mux_connection* existing = NULL, *conn = NULL, **resized = NULL;
+
+	for(u = 0; u < connections; u++){
+		if(connection[u]->fd < 0){
+			free_slot = (free_slot == connections) ? u : free_slot;
+			continue;
+		}
+
+		if(connection[u]->transport == transport
+				&& !strcmp(connection[u]->host, host)
+				&& ((!connection[u]->port && !port) || (connection[u]->port && port && !strcmp(connection[u]->port, port)))){
+			open++;
+			if(!existing || connection[u]->active < existing->active){
+				existing = connection[u];
+				*index = u;
+			}
+		}
+	}
+
+	//use the least loaded connection if it is idle or the limit is reached
+	if(existing && (!existing->active || open >= max_connections)){
+		return existing;
+	}
+
+	if(free_slot == connections){
+		resized = realloc(connection, (connections + 1) * sizeof(mux_connection*));
+		if(!resized){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return existing;
+		}
+		connection = resized;
+		connection[connections] = calloc(1, sizeof(mux_connection));
+		if(!connection[connections]){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return existing;
+		}
+		connection[connections]->fd = -1;
+		connections++;
+	}
+
+	conn = connection[free_slot];
+	switch(transport){
+		case peer_tcp_client:
+			conn->fd = network_socket(host, port, SOCK_STREAM, 0);
+			break;
+		case peer_unix_stream:
+			conn->fd = network_socket_unix(host, SOCK_STREAM, 0);
+			break;
+		default:
+			LOG(log_peer, log_error, "Multiplexing is only supported over stream transports\n");
+			break;
+	}
+
+	//fall back to an existing connection
+	if(conn->fd < 0){
+		return existing;
+	}
+
+	free(conn->host);
+	free(conn->port);
+	conn->host = strdup(host);
+	conn->port = port ? strdup(port) : NULL;
+	conn->transport = transport;
+	conn->active = 0;
+	conn->buffer_offset = 0;
+	conn->discard = 0;
+
+	*index = free_slot;
+	return conn;
+}
+
+/*
+ * Attach a WebSocket to a new channel on a multiplexed peer connection for the
+ * given underlying transport and address.
+ * Returns 0 on success
+ */
+int mux_attach(websocket* ws, peer_transport transport, size_t max_connections){
+	size_t u, index = 0;
+	mux_connection* conn = mux_connection_select(transport, ws->peer.host, ws->peer.port, max_connections ? max_connections : 1, &index);
+
+	if(!conn){
+		return 1;
+	}
+
+	//find a free channel slot
+	for(u = 0; u < conn->channels; u++){
+		if(!conn->channel[u].id){
+			break;
+		}
+	}
+
+	if(u == conn->channels){
+		if(conn->channels == MUX_MAX_CHANNELS){
+			LOG(log_peer, log_warn, "Channel limit on multiplexed peer connection reached\n");
+			return 1;
+		}
+
+		conn->channel = realloc(conn->channel, (conn->channels + 1) * sizeof(mux_channel));
+		if(!conn->channel){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			conn->channels = 0;
+			mux_fail(conn);
+			return 1;
+		}
+		conn->channels++;
+	}
+
+	//skip the reserved channel id 0
+	conn->generation++;
+	if(!conn->generation && !u){
+		conn->generation++;
+	}
+
+	conn->channel[u].id = MUX_CHANNEL_ID(conn->generation, u);
+	conn->channel[u].client = client_index(ws);
+	conn->channel[u].credit = MUX_WINDOW_INITIAL;
+	conn->channel[u].consumed = 0;
+	conn->active++;
+
+	ws->peer_shared = index;
+	ws->peer_channel = conn->channel[u].id;
+
+	if(mux_message_send(conn, ws->peer_channel, mux_open, (uint8_t*) ws->request_path, strlen(ws->request_path))){
+		mux_fail(conn);
+		return 1;
+	}
+	return 0;
+}
+
+/* Close the channel used by a WebSocket */
+void mux_detach(websocket* ws){
+	mux_channel* chan = mux_channel_find(ws);
+	mux_connection* conn = NULL;
+
+	if(chan){
+		conn = connection[ws->peer_shared];
+		chan->id = 0;
+		conn->active--;
+		if(mux_message_send(conn, ws->peer_channel, mux_close, NULL, 0)){
+			mux_fail(conn);
+		}
+	}
+	ws->peer_channel = 0;
+}
+
+/*
+ * Forward a WebSocket message on the channel used by a WebSocket.
+ * Returns 0 on success
+ */
+int mux_send(websocket* ws, ws_operation opcode, uint8_t* data, size_t length){
+	mux_channel* chan = mux_channel_find(ws);
+
+	if(!chan){
+		return 1;
+	}
+
+	if(length >= (1 << 24)){
+		LOG(log_peer, log_warn, "Message exceeds multiplexing limit\n");
+		return 1;
+	}
+
+	chan->credit -= length;
+	if(mux_message_send(connection[ws->peer_shared], ws->peer_channel, (opcode == ws_frame_text) ? mux_text : mux_binary, data, length)){
+		mux_fail(connection[ws->peer_shared]);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Check whether the peer is ready to accept data on the channel used by a WebSocket,
+ * i.e. the channel has credit left and the connection is not congested
+ */
+int mux_ready(websocket* ws){
+	mux_channel* chan = mux_channel_find(ws);
+	return chan && chan->credit > 0 && connection[ws->peer_shared]->backlog.length < MUX_BUFFER_SIZE;
+}
+
+/* Add all multiplexed peer connections to the select sets, waiting for writability while data is pending */
+void mux_fds(fd_set* read_fds, fd_set* write_fds, int* max_fd){
+	size_t u;
+
+	for(u = 0; u < connections; u++){
+		if(connection[u]->fd >= 0){
+			FD_SET(connection[u]->fd, read_fds);
+			if(connection[u]->backlog.length){
+				FD_SET(connection[u]->fd, write_fds);
+			}
+			if(*max_fd < connection[u]->fd){
+				*max_fd = connection[u]->fd;
+			}
+		}
+	}
+}
+
+/*
+ * Return window credit for data the client socket has accepted, once half the window is available.
+ * Data still waiting in the outbound queue of the WebSocket is not credited, so a slow client
+ * throttles the peer instead of growing the queue.
+ */
+static int mux_credit(mux_connection* conn, mux_channel* chan, websocket* ws){
+	size_t written = (chan->consumed > ws->queue_bytes) ? chan->consumed - ws->queue_bytes : 0;
+	uint8_t increment[4] = {
+		written >> 24, written >> 16, written >> 8, written
+	};
+
+	if(written < MUX_WINDOW_INITIAL / 2){
+		return 0;
+	}
+
+	chan->consumed -= written;
+	return mux_message_send(conn, chan->id, mux_window, increment, sizeof(increment));
+}
+
+/* Called after data was written to a WebSocket, returning credit for it to the peer */
+void mux_written(websocket* ws){
+	mux_channel* chan = mux_channel_find(ws);
+
+	if(chan && mux_credit(connection[ws->peer_shared], chan, ws)){
+		mux_fail(connection[ws->peer_shared]);
+	}
+}
+
+/* Handle a single message received from a peer connection */
+static int mux_message_handle(mux_connection* conn, uint32_t id, mux_message type, uint8_t* data, size_t length){
+	mux_channel* chan = conn->channel + MUX_CHANNEL_SLOT(id);
+	websocket* ws = NULL;
+
+	//ignore messages for channels that have since been closed
+	if(MUX_CHANNEL_SLOT(id) >= conn->channels || chan->id != id){
+		return 0;
+	}
+
+	ws = client_get(chan->client);
+	if(!ws){
+		chan->id = 0;
+		conn->active--;
+		return 0;
+	}
+
+	switch(type){
+		case mux_close:
+			chan->id = 0;
+			conn->active--;
+			ws_close(ws, ws_close_normal, "Peer closed connection");
+			break;
+		case mux_binary:
+		case mux_text:
+			if(ws_send_frame(ws, (type == mux_text) ? ws_frame_text : ws_frame_binary, data, length)){
+				ws_close(ws, ws_close_unexpected, NULL);
+				break;
+			}
+
+			chan->consumed += length;
+			return mux_credit(conn, chan, ws);
+		case mux_window:
+			if(length == 4){
+				chan->credit += (((uint32_t) data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+			}
+			break;
+		default:
+			LOG(log_peer, log_warn, "Unknown message type %02X from multiplexed peer\n", type);
+			break;
+	}
+	return 0;
+}
+
+/* Close the channel an oversized message was sent on, leaving all other channels on the connection open */
+static void mux_reject(mux_connection* conn, uint32_t id){
+	mux_channel* chan = conn->channel + MUX_CHANNEL_SLOT(id);
+	websocket* ws = NULL;
+
+	LOG(log_peer, log_warn, "Message from multiplexed peer %s exceeds buffer size, closing channel\n", conn->host);
+	if(MUX_CHANNEL_SLOT(id) >= conn->channels || chan->id != id){
+		return;
+	}
+
+	//closing the WebSocket also closes the channel towards the peer
+	ws = client_get(chan->client);
+	if(ws){
+		ws_close(ws, ws_close_limit, "Message too large");
+	}
+	else{
+		chan->id = 0;
+		conn->active--;
+	}
+}
+
+/* Handle incoming data on a peer connection */
+static void mux_read(mux_connection* conn){
+	ssize_t bytes_read;
+	size_t offset = 0, length;
+	uint8_t* header = NULL;
+
+	bytes_read = recv(conn->fd, conn->buffer + conn->buffer_offset, sizeof(conn->buffer) - conn->buffer_offset, 0);
+	if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return;
+	}
+	else if(bytes_read <= 0){
+		LOG(log_peer, log_warn, "Multiplexed peer connection to %s closed\n", conn->host);
+		mux_fail(conn);
+		return;
+	}
+	conn->buffer_offset += bytes_read;
+
+	//skip the remainder of a rejected message
+	if(conn->discard){
+		offset = (conn->discard < conn->buffer_offset) ? conn->discard : conn->buffer_offset;
+		conn->discard -= offset;
+	}
+
+	//handle all complete messages
+	while(conn->buffer_offset - offset >= MUX_HEADER_LENGTH){
+		header = conn->buffer + offset;
+		length = (header[5] << 16) | (header[6] << 8) | header[7];
+		if(length > sizeof(conn->buffer) - MUX_HEADER_LENGTH){
+			mux_reject(conn, (((uint32_t) header[0]) << 24) | (header[1] << 16) | (header[2] << 8) | header[3]);
+			if(conn->fd < 0){
+				return;
+			}
+
+			//drop the message as it arrives
+			length += MUX_HEADER_LENGTH;
+			if(conn->buffer_offset - offset < length){
+				conn->discard = length - (conn->buffer_offset - offset);
+				offset = conn->buffer_offset;
+				break;
+			}
+			offset += length;
+			continue;
+		}
+
+		if(conn->buffer_offset - offset < MUX_HEADER_LENGTH + length){
+			break;
+		}
+
+		if(mux_message_handle(conn, (((uint32_t) header[0]) << 24) | (header[1] << 16) | (header[2] << 8) | header[3],
+					header[4], header + MUX_HEADER_LENGTH, length)){
+			mux_fail(conn);
+			return;
+		}
+		//closing a client may have failed the connection
+		if(conn->fd < 0){
+			return;
+		}
+		offset += MUX_HEADER_LENGTH + length;
+	}
+
+	//remove handled messages at once
+	if(offset){
+		memmove(conn->buffer, conn->buffer + offset, conn->buffer_offset - offset);
+		conn->buffer_offset -= offset;
+	}
+}
+
+/* Handle all peer connections with pending data or pending writes */
+void mux_data(fd_set* read_fds, fd_set* write_fds){
+	size_t u;
+
+	for(u = 0; u < connections; u++){
+		if(connection[u]->fd >= 0 && FD_ISSET(connection[u]->fd, write_fds)
+				&& network_flush(connection[u]->fd, &(connection[u]->backlog))){
+			LOG(log_peer, log_warn, "Multiplexed peer connection to %s failed\n", connection[u]->host);
+			mux_fail(connection[u]);
+		}
+
+		if(connection[u]->fd >= 0 && FD_ISSET(connection[u]->fd, read_fds)){
+			mux_read(connection[u]);
+		}
+	}
+}
+
+/* Close all peer connections */
+void mux_cleanup(){
+	size_t u;
+
+	for(u = 0; u < connections; u++){
+		if(connection[u]->fd >= 0){
+			close(connection[u]->fd);
+		}
+		network_backlog_clear(&(connection[u]->backlog));
+		free(connection[u]->channel);
+		free(connection[u]->host);
+		free(connection[u]->port);
+		free(connection[u]);
+	}
+	free(connection);
+	connection = NULL;
+	connections = 0;
+}
@@ -0,0 +1,37 @@
+#include "websocksy.h"
+#include <sys/select.h>
+
+/*
+ * Multiplexed peer wire format
+ *
+ * All messages exchanged with a `mux://` peer carry an 8 byte header:
+ * 	* channel: 32 bit channel id, big endian
+ * 	* type: 8 bit message type (mux_message)
+ * 	* length: 24 bit payload length, big endian
+ *
+ * Channels are opened by websocksy with an `open` message carrying the request endpoint and
+ * closed by either side with a `close` message. Data messages map to exactly one WebSocket frame.
+ * Each side may send MUX_WINDOW_INITIAL payload bytes per channel before it has to wait for
+ * `window` messages (payload: 32 bit big endian increment) from the other side.
+ */
+#define MUX_HEADER_LENGTH 8
+#define MUX_WINDOW_INITIAL 65536
+#define MUX_BUFFER_SIZE 65536
+
+typedef enum {
+	mux_open = 1,
+	mux_close = 2,
+	mux_binary = 3,
+	mux_text = 4,
+	mux_window = 5
+} mux_message;
+
+/* Multiplexed peer connection handling */
+int mux_attach(websocket* ws, peer_transport transport, size_t connections);
+void mux_detach(websocket* ws);
+int mux_send(websocket* ws, ws_operation opcode, uint8_t* data, size_t length);
+int mux_ready(websocket* ws);
+void mux_written(websocket* ws);
+void mux_fds(fd_set* read_fds, fd_set* write_fds, int* max_fd);
+void mux_data(fd_set* read_fds, fd_set* write_fds);
+void mux_cleanup();
@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include "network.h"
+#include "memory.h"
+#include "log.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -9,11 +12,19 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+
+/* Maximum number of datagrams passed to a single sendmmsg call */
+#define NETWORK_DATAGRAM_BATCH 64
+
+/* Descriptor held in reserve to be able to shed connections when running out of descriptors */
+static int reserve_fd = -1;
 
 /*
  * Create a file descriptor connected to a network socket peer.
  * Client sockets will be connected, listening sockets will be bound/listened.
- * Returns -1 in case of failure, a valid fd otherwise.
+ * Returns -1 in case of failure, a valid nonblocking, close-on-exec fd otherwise.
  */
 int network_socket(char* host, char* port, int socktype, int listener){
 	int fd = -1, status, yes = 1, flags;
@@ -26,13 +37,13 @@ int network_socket(char* host, char* port, int socktype, int listener){
 
 	status = getaddrinfo(host, port, &hints, &info);
 	if(status){
-		fprintf(stderr, "Failed to parse address %s port %s: %s\n", host, port, gai_strerror(status));
+		LOG(log_core, log_error, "Failed to parse address %s port %s: %s\n", host, port, gai_strerror(status));
 		return -1;
 	}
 
 	//traverse the result list
 	for(addr_it = info; addr_it; addr_it = addr_it->ai_next){
-		fd = socket(addr_it->ai_family, addr_it->ai_socktype, addr_it->ai_protocol);
+		fd = socket(addr_it->ai_family, addr_it->ai_socktype | SOCK_CLOEXEC, addr_it->ai_protocol);
 		if(fd < 0){
 			continue;
 		}
@@ -40,12 +51,12 @@ int network_socket(char* host, char* port, int socktype, int listener){
 		//set required socket options
 		yes = 1;
 		if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(yes)) < 0){
-			fprintf(stderr, "Failed to enable SO_REUSEADDR on socket: %s\n", strerror(errno));
+			LOG(log_core, log_error, "Failed to enable SO_REUSEADDR on socket: %s\n", strerror(errno));
 		}
 
 		yes = 0;
 		if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&yes, sizeof(yes)) < 0){
-			fprintf(stderr, "Failed to unset IPV6_V6ONLY on socket: %s\n", strerror(errno));
+			LOG(log_core, log_error, "Failed to unset IPV6_V6ONLY on socket: %s\n", strerror(errno));
 		}
 
 		//TODO loop, bcast for udp
@@ -70,14 +81,14 @@ int network_socket(char* host, char* port, int socktype, int listener){
 	freeaddrinfo(info);
 
 	if(!addr_it){
-		fprintf(stderr, "Failed to create socket for %s port %s\n", host, port);
+		LOG(log_core, log_error, "Failed to create socket for %s port %s\n", host, port);
 		return -1;
 	}
 
 	//set nonblocking
 	flags = fcntl(fd, F_GETFL, 0);
 	if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
-		fprintf(stderr, "Failed to set socket nonblocking: %s\n", strerror(errno));
+		LOG(log_core, log_error, "Failed to set socket nonblocking: %s\n", strerror(errno));
 		close(fd);
 		return -1;
 	}
@@ -89,7 +100,7 @@ int network_socket(char* host, char* port, int socktype, int listener){
 	if(socktype == SOCK_STREAM){
 		status = listen(fd, SOMAXCONN);
 		if(status < 0){
-			fprintf(stderr, "Failed to listen on socket: %s\n", strerror(errno));
+			LOG(log_core, log_error, "Failed to listen on socket: %s\n", strerror(errno));
 			close(fd);
 			return -1;
 		}
@@ -98,27 +109,85 @@ int network_socket(char* host, char* port, int socktype, int listener){
 	return fd;
 }
 
+/*
+ * Start a nonblocking connection to a network peer. The descriptor becomes writable
+ * once the connection attempt completes, which can be checked with `network_connect_done`.
+ * Returns -1 in case of immediate failure, a valid fd otherwise.
+ */
+int network_connect_start(char* host, char* port, int socktype){
+	int fd = -1, status, yes = 0;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = socktype
+	};
+	struct addrinfo *info, *addr_it;
+
+	status = getaddrinfo(host, port, &hints, &info);
+	if(status){
+		LOG(log_peer, log_error, "Failed to parse address %s port %s: %s\n", host, port, gai_strerror(status));
+		return -1;
+	}
+
+	for(addr_it = info; addr_it; addr_it = addr_it->ai_next){
+		fd = socket(addr_it->ai_family, addr_it->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr_it->ai_protocol);
+		if(fd < 0){
+			continue;
+		}
+
+		yes = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&yes, sizeof(yes));
+
+		status = connect(fd, addr_it->ai_addr, addr_it->ai_addrlen);
+		if(status < 0 && errno != EINPROGRESS){
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		break;
+	}
+	freeaddrinfo(info);
+
+	if(fd < 0){
+		LOG(log_peer, log_error, "Failed to start connection to %s port %s\n", host, port);
+	}
+	return fd;
+}
+
+/*
+ * Check the state of a connection started with `network_connect_start`.
+ * Returns 0 if the connection is established, 1 if it is still pending and -1 if it failed.
+ */
+int network_connect_done(int fd){
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+	struct pollfd wait_fd = {
+		.fd = fd,
+		.events = POLLOUT
+	};
+
+	if(poll(&wait_fd, 1, 0) == 0){
+		return 1;
+	}
+
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) || error){
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Create a file descriptor connected to a unix socket peer.
  * Client sockets will be connected, listening sockets will be bound.
- * Returns -1 in case of failure, a valid fd otherwise.
+ * Returns -1 in case of failure, a valid nonblocking, close-on-exec fd otherwise.
  */
 int network_socket_unix(char* path, int socktype, int listener){
 	struct sockaddr_un addr = {
 		.sun_family = AF_UNIX,
 	};
-	int fd = socket(AF_UNIX, socktype, 0), flags;
+	int fd = socket(AF_UNIX, socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
 	if(fd < 0){
-		fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
-		return -1;
-	}
-
-	//set nonblocking
-	flags = fcntl(fd, F_GETFL, 0);
-	if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
-		fprintf(stderr, "Failed to set socket nonblocking: %s\n", strerror(errno));
-		close(fd);
+		LOG(log_core, log_error, "Failed to create socket: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -127,13 +196,13 @@ int network_socket_unix(char* path, int socktype, int listener){
 	if(listener){
 		unlink(path);
 		if(bind(fd, (struct sockaddr*) &addr, sizeof(addr))){
-			fprintf(stderr, "Failed to bind %s: %s\n", path, strerror(errno));
+			LOG(log_core, log_error, "Failed to bind %s: %s\n", path, strerror(errno));
 			close(fd);
 			return -1;
 		}
 
 		if(listen(fd, SOMAXCONN)){
-			fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+			LOG(log_core, log_error, "Failed to listen on %s: %s\n", path, strerror(errno));
 			close(fd);
 			return -1;
 		}
@@ -143,7 +212,7 @@ int network_socket_unix(char* path, int socktype, int listener){
 
 	//connect clients
 	if(connect(fd, (struct sockaddr*) &addr, sizeof(addr))){
-		fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+		LOG(log_peer, log_error, "Failed to connect to %s: %s\n", path, strerror(errno));
 		close(fd);
 		return -1;
 	}
@@ -152,16 +221,19 @@ int network_socket_unix(char* path, int socktype, int listener){
 }
 
 /*
- * Send arbitrary data over multiple writes if necessary.
- * Returns 0 on success
+ * Send data without blocking. Data the socket does not accept is not sent.
+ * Returns 0 if all data was accepted by the socket
  */
 int network_send(int fd, uint8_t* data, size_t length){
-	//TODO probably should introduce send buffering at some point
 	ssize_t total = 0, sent;
+
 	while(total < length){
-		sent = send(fd, data + total, length - total, 0);
+		sent = send(fd, data + total, length - total, MSG_NOSIGNAL);
 		if(sent < 0){
-			fprintf(stderr, "Failed to send: %s\n", strerror(errno));
+			if(errno == EINTR){
+				continue;
+			}
+			LOG(log_core, log_warn, "Failed to send: %s\n", strerror(errno));
 			return 1;
 		}
 		total += sent;
@@ -170,9 +242,214 @@ int network_send(int fd, uint8_t* data, size_t length){
 }
 
 /*
- * Send string data over multiple writes if necessary.
+ * Write a list of buffers until all are written or the socket stops accepting data.
+ * The list is advanced past all data written.
+ * Returns 0 on success (including a partial write)
+ */
+static int network_writev(int fd, struct iovec** iov, size_t* count){
+	ssize_t sent;
+
+	while(*count){
+		sent = writev(fd, *iov, (*count > IOV_MAX) ? IOV_MAX : *count);
+		if(sent < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			else if(errno == EAGAIN || errno == EWOULDBLOCK){
+				return 0;
+			}
+			LOG(log_core, log_warn, "Failed to send: %s\n", strerror(errno));
+			return 1;
+		}
+
+		//skip completely written buffers
+		for(; *count && sent >= (*iov)->iov_len; (*count)--, (*iov)++){
+			sent -= (*iov)->iov_len;
+		}
+
+		//adjust partially written buffer
+		if(*count){
+			(*iov)->iov_base = (uint8_t*) (*iov)->iov_base + sent;
+			(*iov)->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+/* Append a list of buffers to a send backlog, returns 0 on success */
+static int network_backlog_append(network_backlog* backlog, struct iovec* iov, size_t count){
+	size_t u, length = 0;
+	uint8_t* data = NULL;
+
+	for(u = 0; u < count; u++){
+		length += iov[u].iov_len;
+	}
+
+	data = realloc(backlog->data, backlog->length + length);
+	if(!data){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+	backlog->data = data;
+
+	for(u = 0; u < count; u++){
+		memcpy(backlog->data + backlog->length, iov[u].iov_base, iov[u].iov_len);
+		backlog->length += iov[u].iov_len;
+	}
+	memory_account(memory_frames, length);
+	return 0;
+}
+
+/*
+ * Send a list of buffers without blocking, keeping anything the socket does not accept
+ * in the backlog until `network_flush` is called on a writable socket. Data is only
+ * written directly while the backlog is empty, so the order is preserved.
+ * The iovec array is modified to track partial writes.
+ * Returns 0 on success (including data kept in the backlog)
+ */
+int network_sendv(int fd, network_backlog* backlog, struct iovec* iov, size_t count){
+	if(network_flush(fd, backlog)){
+		return 1;
+	}
+
+	if(!backlog->length && network_writev(fd, &iov, &count)){
+		return 1;
+	}
+
+	return count ? network_backlog_append(backlog, iov, count) : 0;
+}
+
+/*
+ * Write as much of a send backlog as the socket accepts without blocking.
+ * Returns 0 on success (including a partial write)
+ */
+int network_flush(int fd, network_backlog* backlog){
+	struct iovec data = {
+		.iov_base = backlog->data,
+		.iov_len = backlog->length
+	};
+	struct iovec* iov = &data;
+	size_t count = 1, sent;
+
+	if(!backlog->length){
+		return 0;
+	}
+
+	if(network_writev(fd, &iov, &count)){
+		return 1;
+	}
+
+	sent = backlog->length - (count ? data.iov_len : 0);
+	memmove(backlog->data, backlog->data + sent, backlog->length - sent);
+	backlog->length -= sent;
+	memory_account(memory_frames, -(ssize_t) sent);
+
+	if(!backlog->length){
+		network_backlog_clear(backlog);
+	}
+	return 0;
+}
+
+/* Discard all data in a send backlog */
+void network_backlog_clear(network_backlog* backlog){
+	memory_account(memory_frames, -(ssize_t) backlog->length);
+	free(backlog->data);
+	backlog->data = NULL;
+	backlog->length = 0;
+}
+
+/*
+ * Send each buffer as a separate datagram, batching as many as possible per system call.
+ * Datagrams the socket does not accept without blocking are dropped, as with any congested datagram receiver.
+ * Returns 0 on success
+ */
+int network_send_datagrams(int fd, struct iovec* iov, size_t count){
+	struct mmsghdr batch[NETWORK_DATAGRAM_BATCH];
+	size_t u, chunk;
+	int sent;
+
+	while(count){
+		chunk = (count > NETWORK_DATAGRAM_BATCH) ? NETWORK_DATAGRAM_BATCH : count;
+		memset(batch, 0, chunk * sizeof(struct mmsghdr));
+		for(u = 0; u < chunk; u++){
+			batch[u].msg_hdr.msg_iov = iov + u;
+			batch[u].msg_hdr.msg_iovlen = 1;
+		}
+
+		sent = sendmmsg(fd, batch, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			else if(errno == EAGAIN || errno == EWOULDBLOCK){
+				LOG(log_peer, log_warn, "Peer congested, dropped %lu datagrams\n", count);
+				return 0;
+			}
+			LOG(log_peer, log_warn, "Failed to send datagram: %s\n", strerror(errno));
+			return 1;
+		}
+
+		//datagrams are sent completely or not at all
+		iov += sent;
+		count -= sent;
+	}
+	return 0;
+}
+
+/*
+ * Send string data without blocking.
  * Returns 0 on success
  */
 int network_send_str(int fd, char* data){
 	return network_send(fd, (uint8_t*) data, strlen(data));
 }
+
+/*
+ * Accept a connection from a listening socket as nonblocking descriptor.
+ * When running out of descriptors, the reserve descriptor is used to accept and immediately
+ * close the pending connection, so the listening socket does not stay readable forever.
+ * Returns -1 if no further connections can be accepted right now.
+ */
+int network_accept(int listen_fd){
+	int fd = -1;
+
+	//acquire the reserve descriptor while there are plenty available
+	if(reserve_fd < 0){
+		reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+
+	for(;;){
+		fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd >= 0){
+			return fd;
+		}
+
+		switch(errno){
+			case EINTR:
+			case ECONNABORTED:
+			case EPROTO:
+				//transient, try the next connection
+				continue;
+			case EMFILE:
+			case ENFILE:
+				LOG(log_core, log_warn, "Out of descriptors, shedding incoming connection\n");
+				if(reserve_fd >= 0){
+					close(reserve_fd);
+					fd = accept(listen_fd, NULL, NULL);
+					if(fd >= 0){
+						close(fd);
+					}
+					reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				}
+				return -1;
+			case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+			case EWOULDBLOCK:
+#endif
+				return -1;
+			default:
+				LOG(log_core, log_warn, "Failed to accept connection: %s\n", strerror(errno));
+				return -1;
+		}
+	}
+}
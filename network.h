@@ -1,8 +1,17 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+#include "websocksy.h"
 
 /* Socket interface convenience functions */
 int network_socket(char* host, char* port, int socktype, int listener);
 int network_socket_unix(char* path, int socktype, int listener);
 int network_send(int fd, uint8_t* data, size_t length);
 int network_send_str(int fd, char* data);
+int network_sendv(int fd, network_backlog* backlog, struct iovec* iov, size_t count);
+int network_flush(int fd, network_backlog* backlog);
+void network_backlog_clear(network_backlog* backlog);
+int network_send_datagrams(int fd, struct iovec* iov, size_t count);
+int network_accept(int listen_fd);
+int network_connect_start(char* host, char* port, int socktype);
+int network_connect_done(int fd);
@@ -1,15 +1,70 @@
+#define _GNU_SOURCE
 #include "backend_file.h"
+#include "expression.h"
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
 //FIXME allocated this statically because i dont want to do it properly right now tbh
 #define BACKEND_FILE_MAX_PATH 8192
+/* Route files larger than this are not indexed */
+#define BACKEND_FILE_MAX_SIZE (1024 * 1024)
+/* Events watched on all directories below the base path */
+#define BACKEND_FILE_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+/*
+ * All files below the base path are read into an in-memory index on the first query and
+ * kept current using inotify, so resolving a peer does not touch the filesystem.
+ */
+
+/* A single `<network peer> <subprotocol> [<framing>] [<framing-config>]` line */
+typedef struct /*_route_line*/ {
+	char* host;
+	char* protocol;
+	char* framing;
+	char* framing_config;
+} route_line;
+
+/* Indexed file, deleted files are kept without lines */
+typedef struct /*_route_file*/ {
+	char* name;
+	size_t name_length;
+	uint32_t hash;
+	size_t next;
+	char* data;
+	size_t lines;
+	route_line* line;
+} route_file;
+
+/* Watched directory, relative to the base path */
+typedef struct /*_route_directory*/ {
+	int wd;
+	char* name;
+} route_directory;
 
 static char* backend_path = NULL;
 
 size_t expressions = 0;
-static char** expression = NULL;
+static expression_template* expression = NULL;
+
+static size_t index_depth = 0;
+static int index_loaded = 0;
+static int index_notify = -1;
+static time_t index_checked = 0;
+static size_t files = 0, files_alloc = 0;
+static route_file* file = NULL;
+static size_t buckets = 0;
+static size_t* bucket = NULL;
+static size_t directories = 0;
+static route_directory* directory = NULL;
 
 uint64_t init(){
 	//initialize the backend path to empty to be able to use it without problems later
@@ -22,7 +77,30 @@ uint64_t init(){
 	return WEBSOCKSY_API_VERSION;
 }
 
+/*
+ * Check that an expression only refers to files below the base path, as no other files are indexed.
+ * Variable values never contain slashes, so only the literal parts need to be checked.
+ */
+static int expression_check(char* value){
+	char* component = NULL, *end = NULL;
+	size_t length;
+
+	for(component = value; component; component = end ? end + 1 : NULL){
+		end = strchr(component, '/');
+		length = end ? end - component : strlen(component);
+		if(!length
+				|| (length == 1 && component[0] == '.')
+				|| (length == 2 && !strncmp(component, "..", 2))){
+			fprintf(stderr, "Expression %s must be relative to the path and may not contain empty, . or .. components\n", value);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 uint64_t configure(char* key, char* value){
+	size_t u, depth;
+
 	if(!strcmp(key, "path")){
 		free(backend_path);
 		backend_path = strdup(value);
@@ -37,230 +115,467 @@ uint64_t configure(char* key, char* value){
 		return 0;
 	}
 	else if(!strcmp(key, "expression")){
-		expression = realloc(expression, (expressions + 1) * sizeof(char*));
-		if(!expression){
-			fprintf(stderr, "Failed to allocate memory\n");
+		if(expression_check(value)){
 			return 1;
 		}
-		expression[expressions] = strdup(value);
-		if(!expression[expressions]){
+
+		//variable values never contain slashes, so only literals select subdirectories
+		for(u = 0, depth = 0; value[u]; u++){
+			depth += (value[u] == '/') ? 1 : 0;
+		}
+		index_depth = (depth > index_depth) ? depth : index_depth;
+
+		expression = realloc(expression, (expressions + 1) * sizeof(expression_template));
+		if(!expression){
 			fprintf(stderr, "Failed to allocate memory\n");
+			expressions = 0;
 			return 1;
 		}
+		memset(expression + expressions, 0, sizeof(expression_template));
 		expressions++;
-		return 0;
+		return expression_compile(expression + expressions - 1, value);
 	}
 
 	fprintf(stderr, "Unknown backend configuration option %s\n", key);
 	return 1;
 }
 
-static int expression_replace(char* buffer, size_t buffer_length, size_t variable_length, char* content, size_t content_length){
+/* FNV-1a */
+static uint32_t index_hash(char* data, size_t length){
 	size_t u;
+	uint32_t hash = 2166136261u;
 
-	//check whether the replacement fits
-	if(variable_length < content_length && strlen(buffer) + (content_length - variable_length) >= buffer_length){
-		fprintf(stderr, "Expression replacement buffer overrun: replacing %lu bytes with %lu bytes, current buffer used %lu, max %lu\n", variable_length, content_length, strlen(buffer), buffer_length);
-		return 1;
+	for(u = 0; u < length; u++){
+		hash ^= (uint8_t) data[u];
+		hash *= 16777619u;
 	}
+	return hash;
+}
 
-	//move data after the replacement
-	memmove(buffer + content_length, buffer + variable_length, strlen(buffer) - variable_length + 1);
+/* Find an indexed file by its name relative to the base path */
+static route_file* index_find(char* name, size_t length){
+	size_t index;
+	uint32_t hash;
 
-	//insert replacement
-	memcpy(buffer, content, content_length);
+	if(!buckets){
+		return NULL;
+	}
 
-	//sanitize replacement
-	for(u = 0; u < content_length; u++){
-		if(buffer[u] == '/'){
-			buffer[u] = '_';
+	hash = index_hash(name, length);
+	for(index = bucket[hash & (buckets - 1)]; index != SIZE_MAX; index = file[index].next){
+		if(file[index].hash == hash
+				&& file[index].name_length == length
+				&& !memcmp(file[index].name, name, length)){
+			return file + index;
 		}
 	}
+	return NULL;
+}
+
+/* Grow the bucket array, keeping the load factor below 1 */
+static int index_rehash(){
+	size_t u, slot;
+
+	buckets = buckets ? buckets * 2 : 1024;
+	free(bucket);
+	bucket = malloc(buckets * sizeof(size_t));
+	if(!bucket){
+		fprintf(stderr, "Failed to allocate memory\n");
+		buckets = 0;
+		return 1;
+	}
+
+	for(u = 0; u < buckets; u++){
+		bucket[u] = SIZE_MAX;
+	}
+	for(u = 0; u < files; u++){
+		slot = file[u].hash & (buckets - 1);
+		file[u].next = bucket[slot];
+		bucket[slot] = u;
+	}
 	return 0;
 }
 
-static int expression_resolve(char* template, size_t length, char* endpoint, size_t headers, ws_http_header* header){
-	size_t u, index_len, p, value_len, variable_len;
-	char* index, *value;
-
-	for(u = 0; template[u]; u++){
-		index_len = 0;
-		variable_len = 0;
-		value = NULL;
-		if(template[u] == '%'){
-			if(!strncmp(template + u, "%endpoint%", 10)){
-				if(strlen(endpoint) < 1){
-					return 1;
-				}
+/* Release the parsed lines of an indexed file */
+static void index_file_clear(route_file* entry){
+	//all line components point into the file data
+	free(entry->data);
+	entry->data = NULL;
+	free(entry->line);
+	entry->line = NULL;
+	entry->lines = 0;
+}
+
+/* Parse a file's content into route lines */
+static int index_file_parse(route_file* entry, char* data, size_t length){
+	size_t u, line_start, line_end;
+	char* components[3];
+	route_line* line = NULL;
+
+	for(line_start = 0; line_start < length; line_start = line_end + 1){
+		for(line_end = line_start; line_end < length && data[line_end] != '\n'; line_end++){
+		}
+
+		//rtrim line
+		data[line_end] = 0;
+		for(u = line_end; u > line_start && !isprint(data[u]); u--){
+			data[u] = 0;
+		}
+		if(!data[line_start]){
+			continue;
+		}
+
+		//read lines of host subproto framing framing-config
+		memset(components, 0, sizeof(components));
+		components[0] = strchr(data + line_start, ' ');
+		if(components[0]){
+			components[0][0] = 0;
+			components[0]++;
 
-				//rtrim slash so test and test/ are the same file
-				if(strlen(endpoint) >= 2 && endpoint[strlen(endpoint) - 1] == '/'){
-					endpoint[strlen(endpoint) - 1] = 0;
+			components[1] = strchr(components[0], ' ');
+			if(components[1]){
+				components[1][0] = 0;
+				components[1]++;
+
+				components[2] = strchr(components[1], ' ');
+				if(components[2]){
+					components[2][0] = 0;
+					components[2]++;
 				}
+			}
+		}
+
+		line = realloc(entry->line, (entry->lines + 1) * sizeof(route_line));
+		if(!line){
+			fprintf(stderr, "Failed to allocate memory\n");
+			return 1;
+		}
+		entry->line = line;
+		entry->line[entry->lines].host = data + line_start;
+		entry->line[entry->lines].protocol = components[0];
+		entry->line[entry->lines].framing = components[1];
+		entry->line[entry->lines].framing_config = components[2];
+		entry->lines++;
+	}
+	return 0;
+}
 
-				value = endpoint + 1;
-				value_len = strlen(value);
-				variable_len = 10;
+/* (Re-)Read a file into the index, creating the entry if required */
+static int index_load(char* name){
+	size_t length = strlen(name);
+	route_file* entry = index_find(name, length);
+	char path[BACKEND_FILE_MAX_PATH];
+	char* data = NULL;
+	struct stat info;
+	ssize_t bytes;
+	int fd;
+
+	if(!entry){
+		if(files + 1 >= files_alloc){
+			file = realloc(file, (files_alloc ? files_alloc * 2 : 1024) * sizeof(route_file));
+			if(!file){
+				fprintf(stderr, "Failed to allocate memory\n");
+				files = files_alloc = 0;
+				return 1;
 			}
-			else if(!strncmp(template + u, "%cookie:", 8)){
-				//scan cookie values
-				index = template + u + 8;
-				for(; index[index_len] && index[index_len] != '%'; index_len++){
-				}
-				if(!index[index_len]){
-					fprintf(stderr, "Unterminated expression variable: %s\n", index);
-					return 1;
-				}
+			files_alloc = files_alloc ? files_alloc * 2 : 1024;
+		}
 
-				//find the cookie header
-				for(p = 0; p < headers; p++){
-					if(!strcmp(header[p].tag, "Cookie")){
-						value = header[p].value;
-						break;
-					}
-				}
+		entry = file + files;
+		memset(entry, 0, sizeof(route_file));
+		entry->name = strdup(name);
+		if(!entry->name){
+			fprintf(stderr, "Failed to allocate memory\n");
+			return 1;
+		}
+		entry->name_length = length;
+		entry->hash = index_hash(name, length);
+		files++;
 
-				//no cookie header, fail the expression
-				if(p == headers){
-					return 1;
-				}
+		if(files > buckets){
+			if(index_rehash()){
+				return 1;
+			}
+		}
+		else{
+			entry->next = bucket[entry->hash & (buckets - 1)];
+			bucket[entry->hash & (buckets - 1)] = entry - file;
+		}
+	}
 
-				do{
-					//ensure min length of cookie name
-					if(strlen(value) < index_len + 1){
-						return 1;
-					}
-					//check if cookie found
-					if(value[index_len] == '='
-							&& !strncmp(value, index, index_len)){
-						value += index_len + 1;
-						for(value_len = 0; value[value_len] && value[value_len] != ';'; value_len++){
-						}
-						break;
-					}
-					//skip to next cookie
-					for(; *value && strncmp(value, "; ", 2); value++){
-					}
-					if(*value){
-						value += 2;
-					}
-				} while(*value);
-
-				if(!*value){
-					return 1;
-				}
+	index_file_clear(entry);
+
+	snprintf(path, sizeof(path), "%s/%s", backend_path, name);
+	//do not block on special files, which are skipped below
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if(fd < 0){
+		//the file was removed, keep the empty entry
+		return 0;
+	}
+
+	if(fstat(fd, &info) || !S_ISREG(info.st_mode)){
+		close(fd);
+		return 0;
+	}
+
+	if(info.st_size > BACKEND_FILE_MAX_SIZE){
+		fprintf(stderr, "Route file %s exceeds %d bytes, skipping it\n", path, BACKEND_FILE_MAX_SIZE);
+		close(fd);
+		return 0;
+	}
+
+	data = malloc(info.st_size + 1);
+	if(!data){
+		fprintf(stderr, "Failed to allocate memory\n");
+		close(fd);
+		return 1;
+	}
+
+	bytes = read(fd, data, info.st_size);
+	close(fd);
+	if(bytes < 0){
+		fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+		free(data);
+		return 0;
+	}
+
+	entry->data = data;
+	if(index_file_parse(entry, data, bytes)){
+		index_file_clear(entry);
+	}
+	return 0;
+}
+
+/*
+ * Read all files within a directory (relative to the base path) and watch it for changes.
+ * Subdirectories are only descended into as deep as any expression may reach.
+ */
+static int index_scan(char* name, size_t depth){
+	char path[BACKEND_FILE_MAX_PATH], child[BACKEND_FILE_MAX_PATH];
+	route_directory* watched = NULL;
+	struct dirent* dirent = NULL;
+	struct stat info;
+	DIR* dir = NULL;
+	int rv = 0;
+
+	snprintf(path, sizeof(path), "%s%s%s", backend_path, strlen(name) ? "/" : "", name);
+	dir = opendir(path);
+	if(!dir){
+		fprintf(stderr, "Failed to open route directory %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	if(index_notify >= 0){
+		watched = realloc(directory, (directories + 1) * sizeof(route_directory));
+		if(!watched){
+			fprintf(stderr, "Failed to allocate memory\n");
+			closedir(dir);
+			return 1;
+		}
+		directory = watched;
+		directory[directories].name = strdup(name);
+		directory[directories].wd = inotify_add_watch(index_notify, path, BACKEND_FILE_EVENTS);
+		if(directory[directories].wd < 0){
+			fprintf(stderr, "Failed to watch %s, changes will not be picked up: %s\n", path, strerror(errno));
+			free(directory[directories].name);
+		}
+		else{
+			directories++;
+		}
+	}
+
+	for(dirent = readdir(dir); dirent && !rv; dirent = readdir(dir)){
+		if(!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")){
+			continue;
+		}
 
-				variable_len = 8 + index_len + 1;
+		snprintf(child, sizeof(child), "%s%s%s", name, strlen(name) ? "/" : "", dirent->d_name);
+		if(dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK){
+			if(fstatat(dirfd(dir), dirent->d_name, &info, 0)){
+				continue;
 			}
-			else if(!strncmp(template + u, "%header:", 8)){
-				//scan headers
-				index = template + u + 8;
-				for(; index[index_len] && index[index_len] != '%'; index_len++){
-				}
-				if(!index[index_len]){
-					fprintf(stderr, "Unterminated expression variable: %s\n", index);
-					return 1;
-				}
-				//find the correct header
-				for(p = 0; p < headers; p++){
-					if(strlen(header[p].tag) == index_len
-							&& !strncmp(header[p].tag, index, index_len)){
-						break;
-					}
-				}
+			dirent->d_type = S_ISDIR(info.st_mode) ? DT_DIR : (S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN);
+		}
 
-				//no such header -> fail the expression
-				if(p == headers){
-					return 1;
-				}
+		if(dirent->d_type == DT_DIR){
+			if(depth){
+				rv = index_scan(child, depth - 1);
+			}
+		}
+		else if(dirent->d_type == DT_REG){
+			rv = index_load(child);
+		}
+	}
+
+	closedir(dir);
+	return rv;
+}
+
+/* Check whether a name (relative to the base path) is at or below a directory */
+static int index_below(char* name, char* prefix, size_t length){
+	return !length || (!strncmp(name, prefix, length) && (!name[length] || name[length] == '/'));
+}
+
+/* Drop all files and watches at or below a directory that was removed or moved away */
+static void index_forget(char* prefix){
+	size_t u, length = strlen(prefix);
+
+	//entries are kept without lines, as for deleted files
+	for(u = 0; u < files; u++){
+		if(index_below(file[u].name, prefix, length)){
+			index_file_clear(file + u);
+		}
+	}
+
+	for(u = 0; u < directories; u++){
+		if(index_below(directory[u].name, prefix, length)){
+			//the watch may already be gone, which is not an error here
+			inotify_rm_watch(index_notify, directory[u].wd);
+			free(directory[u].name);
+			directory[u] = directory[directories - 1];
+			directories--;
+			u--;
+		}
+	}
+}
 
-				value = header[p].value;
-				value_len = strlen(value);
-				variable_len = 8 + index_len + 1;
+/* Apply pending change notifications to the index */
+static void index_update(){
+	uint8_t events[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char name[BACKEND_FILE_MAX_PATH];
+	struct inotify_event* event = NULL;
+	ssize_t bytes, offset;
+	size_t u, depth;
+	char* p = NULL;
+	int changed = 0;
+
+	for(bytes = read(index_notify, events, sizeof(events)); bytes > 0; bytes = read(index_notify, events, sizeof(events))){
+		for(offset = 0; offset < bytes; offset += sizeof(struct inotify_event) + event->len){
+			event = (struct inotify_event*) (events + offset);
+
+			if(event->mask & IN_Q_OVERFLOW){
+				fprintf(stderr, "Route change notification overflow, rescanning %s\n", backend_path);
+				//start over, so removed files are dropped and no directory is watched twice
+				index_forget("");
+				index_scan("", index_depth);
+				changed = 1;
+				continue;
 			}
 
-			//perform replacement
-			if(value && expression_replace(template + u, length - u, variable_len, value, value_len)){
-				fprintf(stderr, "Expression replacement failed\n");
-				return 1;
+			for(u = 0; u < directories && directory[u].wd != event->wd; u++){
+			}
+			if(u == directories){
+				continue;
+			}
+
+			//a watched directory was moved or its watch removed, its contents are no longer known under its name
+			if(event->mask & (IN_MOVE_SELF | IN_IGNORED)){
+				snprintf(name, sizeof(name), "%s", directory[u].name);
+				index_forget(name);
+				changed = 1;
+				continue;
 			}
-			if(value){
-				//skip the inserted value
-				u += value_len - 1;
+
+			if(!event->len){
+				continue;
 			}
+
+			snprintf(name, sizeof(name), "%s%s%s", directory[u].name, strlen(directory[u].name) ? "/" : "", event->name);
+			if(event->mask & IN_ISDIR){
+				depth = 1;
+				for(p = name; *p; p++){
+					depth += (*p == '/') ? 1 : 0;
+				}
+				if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
+					index_forget(name);
+				}
+				else if((event->mask & (IN_CREATE | IN_MOVED_TO)) && depth <= index_depth){
+					index_scan(name, index_depth - depth);
+				}
+			}
+			else{
+				index_load(name);
+			}
+			changed = 1;
 		}
 	}
 
-	return 0;
+	//results computed from the previous data may be cached by the core
+	if(changed){
+		core_cache_invalidate(NULL);
+	}
+}
+
+/* Build the index on first use, and keep it current at most once per second */
+static void index_refresh(){
+	struct timespec now;
+
+	if(!index_loaded){
+		index_loaded = 1;
+		if(!strlen(backend_path)){
+			fprintf(stderr, "No route file path configured, no routes will be found\n");
+			return;
+		}
+
+		index_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(index_notify < 0){
+			fprintf(stderr, "Failed to initialize inotify, route file changes will not be picked up: %s\n", strerror(errno));
+		}
+		index_scan("", index_depth);
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		index_checked = now.tv_sec;
+		return;
+	}
+
+	if(index_notify >= 0){
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if(now.tv_sec != index_checked){
+			index_checked = now.tv_sec;
+			index_update();
+		}
+	}
 }
 
 ws_peer_info query(char* endpoint, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws){
-	size_t u, p, line_alloc = 0;
-	ssize_t line_length = 0;
-	char* line = NULL, *components[3];
-	FILE* input = NULL;
-	char target_path[BACKEND_FILE_MAX_PATH];
+	size_t u, l, p, endpoint_length = strlen(endpoint), name_length;
+	char target_name[BACKEND_FILE_MAX_PATH];
+	route_file* entry = NULL;
+	route_line* line = NULL;
 	ws_peer_info peer = {
 		.transport = peer_transport_detect,
 		.protocol = protocols
 	};
 
+	index_refresh();
+
 	for(u = 0; u < expressions; u++){
-		//evaluate the current expression to find a path
-		snprintf(target_path, sizeof(target_path), "%s/%s", backend_path, expression[u]);
-		if(expression_resolve(target_path + strlen(backend_path) + 1, sizeof(target_path) - strlen(backend_path) - 1, endpoint, headers, header)){
+		//evaluate the current expression to find a file
+		name_length = expression_resolve(expression + u, target_name, sizeof(target_name), 1, endpoint, endpoint_length, headers, header, ws);
+		if(!name_length){
 			continue;
 		}
 
-		//check whether the file exists
-		input = fopen(target_path, "r");
-		if(!input){
+		entry = index_find(target_name, name_length);
+		if(!entry){
 			continue;
 		}
 
-		//read it
-		for(line_length = getline(&line, &line_alloc, input); line_length >= 0; line_length = getline(&line, &line_alloc, input)){
-			memset(components, 0, sizeof(components));
-			//rtrim line
-			p = strlen(line);
-			for(; p > 0 && !isprint(line[p]); p--){
-				line[p] = 0;
-			}
-
-			//read lines of host subproto framing framing-config
-			components[0] = strchr(line, ' ');
-			if(protocols && !components[0]){
+		for(l = 0; l < entry->lines; l++){
+			line = entry->line + l;
+			if(protocols && !line->protocol){
 				continue;
 			}
 
-			//terminate host
-			components[0][0] = 0;
-			components[0]++;
-
-			//find framing, terminate subprotocol
-			components[1] = strchr(components[0], ' ');
-			if(components[1]){
-				components[1][0] = 0;
-				components[1]++;
-
-				//find find framing config, terminate framing
-				components[2] = strchr(components[1], ' ');
-				if(components[2]){
-					components[2][0] = 0;
-					components[2]++;
-				}
-			}
-
 			//find a match for any indicated protocol
 			for(p = 0; p < protocols; p++){
-				if(!strcmp(components[0], protocol[p])){
+				if(!strcmp(line->protocol, protocol[p])){
 					peer.protocol = p;
 					break;
 				}
 			}
 
 			//for '*' use the first available protocol
-			if(components[0] && !strcmp(components[0], "*")){
+			if(line->protocol && !strcmp(line->protocol, "*")){
 				peer.protocol = 0;
 			}
 
@@ -270,12 +585,11 @@ ws_peer_info query(char* endpoint, size_t protocols, char** protocol, size_t hea
 			}
 
 			//copy data to peer info structure
-			peer.host = strdup(line);
-			peer.framing = core_framing(components[1]);
-			peer.framing_config = components[2] ? strdup(components[2]) : NULL;
+			peer.host = strdup(line->host);
+			peer.framing = core_framing(line->framing);
+			peer.framing_config = line->framing_config ? strdup(line->framing_config) : NULL;
 			break;
 		}
-		fclose(input);
 
 		//if peer found, break
 		if(peer.host){
@@ -283,7 +597,6 @@ ws_peer_info query(char* endpoint, size_t protocols, char** protocol, size_t hea
 		}
 	}
 
-	free(line);
 	return peer;
 }
 
@@ -291,12 +604,37 @@ void cleanup(){
 	size_t u;
 
 	for(u = 0; u < expressions; u++){
-		free(expression[u]);
+		expression_free(expression + u);
 	}
 	free(expression);
 	expression = NULL;
 	expressions = 0;
 
+	for(u = 0; u < files; u++){
+		index_file_clear(file + u);
+		free(file[u].name);
+	}
+	free(file);
+	file = NULL;
+	files = files_alloc = 0;
+	free(bucket);
+	bucket = NULL;
+	buckets = 0;
+
+	for(u = 0; u < directories; u++){
+		free(directory[u].name);
+	}
+	free(directory);
+	directory = NULL;
+	directories = 0;
+
+	if(index_notify >= 0){
+		close(index_notify);
+		index_notify = -1;
+	}
+	index_loaded = 0;
+	index_depth = 0;
+
 	free(backend_path);
 	backend_path = NULL;
 }
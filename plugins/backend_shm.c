@@ -0,0 +1,226 @@
+#include "backend_shm.h"
+#include "expression.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Maximum number of attempts to read a consistent route while the table is being written */
+#define BACKEND_SHM_RETRIES 64
+
+/*
+ * The shm backend looks up peers in a routing table kept in a shared memory segment, which
+ * is maintained by an external process (for example using the `shm_routes` tool). Lookups
+ * are done on the mapped segment without system calls or locks, readers detect concurrent
+ * modifications by checking the table sequence counter and retry.
+ */
+
+static char* shm_name = NULL;
+static shm_routes_header* table = NULL;
+static size_t table_size = 0;
+//validated once when mapping, the copy in the segment is not trusted afterwards
+static uint64_t table_slots = 0;
+
+static size_t expressions = 0;
+static expression_template* expression = NULL;
+
+uint64_t init(){
+	shm_name = strdup("/websocksy");
+	if(!shm_name){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 0;
+	}
+	return WEBSOCKSY_API_VERSION;
+}
+
+uint64_t configure(char* key, char* value){
+	if(!strcmp(key, "name")){
+		free(shm_name);
+		shm_name = strdup(value);
+		if(!shm_name){
+			fprintf(stderr, "Failed to allocate memory\n");
+			return 1;
+		}
+		return 0;
+	}
+	else if(!strcmp(key, "expression")){
+		expression = realloc(expression, (expressions + 1) * sizeof(expression_template));
+		if(!expression){
+			fprintf(stderr, "Failed to allocate memory\n");
+			expressions = 0;
+			return 1;
+		}
+		memset(expression + expressions, 0, sizeof(expression_template));
+		expressions++;
+		return expression_compile(expression + expressions - 1, value);
+	}
+
+	fprintf(stderr, "Unknown backend configuration option %s\n", key);
+	return 1;
+}
+
+/* Map the routing table, the segment may be created after startup or replaced */
+static int table_map(){
+	struct stat info;
+	int fd = shm_open(shm_name, O_RDONLY | O_CLOEXEC, 0);
+
+	if(fd < 0){
+		return 1;
+	}
+
+	if(fstat(fd, &info) || info.st_size < sizeof(shm_routes_header)){
+		close(fd);
+		return 1;
+	}
+
+	table = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(table == MAP_FAILED){
+		fprintf(stderr, "Failed to map routing table %s: %s\n", shm_name, strerror(errno));
+		table = NULL;
+		return 1;
+	}
+	table_size = info.st_size;
+	//read the slot count once, checking the size without overflowing
+	table_slots = table->slots;
+
+	if(table->magic != SHM_ROUTES_MAGIC
+			|| table->version != SHM_ROUTES_VERSION
+			|| table_slots > (table_size - sizeof(shm_routes_header)) / (2 * sizeof(shm_route))){
+		fprintf(stderr, "Shared memory segment %s does not contain a valid routing table\n", shm_name);
+		munmap(table, table_size);
+		table = NULL;
+		table_slots = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the route for a key from the active table.
+ * Returns 0 if a consistent route was found
+ */
+static int table_lookup(char* key, size_t key_length, shm_route* route){
+	size_t u, slot, retry;
+	uint64_t sequence;
+	uint32_t active, hash = shm_route_hash(key, key_length);
+	shm_route* entries = NULL;
+	int found;
+
+	for(retry = 0; retry < BACKEND_SHM_RETRIES; retry++){
+		active = __atomic_load_n(&(table->active), __ATOMIC_ACQUIRE) & 1;
+		sequence = __atomic_load_n(table->sequence + active, __ATOMIC_ACQUIRE);
+		if(sequence & 1){
+			continue;
+		}
+
+		entries = SHM_ROUTES_TABLE(table, table_slots, active);
+		found = 0;
+		for(u = 0; u < table_slots; u++){
+			slot = (hash + u) % table_slots;
+			if(entries[slot].state == shm_route_empty){
+				break;
+			}
+
+			if(entries[slot].state == shm_route_used
+					&& entries[slot].hash == hash
+					&& !strncmp(entries[slot].key, key, SHM_ROUTE_KEY)){
+				memcpy(route, entries + slot, sizeof(shm_route));
+				found = 1;
+				break;
+			}
+		}
+
+		//the copy is only valid if the table was not modified in the meantime
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(table->sequence + active, __ATOMIC_RELAXED) == sequence){
+			if(found){
+				//the writer may have left the fields unterminated
+				route->host[SHM_ROUTE_HOST - 1] = 0;
+				route->protocol[SHM_ROUTE_PROTOCOL - 1] = 0;
+				route->framing[SHM_ROUTE_FRAMING - 1] = 0;
+				route->framing_config[SHM_ROUTE_FRAMING_CONFIG - 1] = 0;
+			}
+			return found ? 0 : 1;
+		}
+	}
+
+	fprintf(stderr, "Failed to read a consistent route for %s\n", key);
+	return 1;
+}
+
+ws_peer_info query(char* endpoint, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws){
+	size_t u, p, endpoint_length = strlen(endpoint), key_length;
+	char key[SHM_ROUTE_KEY];
+	shm_route route;
+	ws_peer_info peer = {
+		.transport = peer_transport_detect,
+		.protocol = protocols
+	};
+
+	//a retired table was removed, its replacement is mapped instead
+	if(table && __atomic_load_n(&(table->retired), __ATOMIC_ACQUIRE)){
+		munmap(table, table_size);
+		table = NULL;
+	}
+
+	if(!table && table_map()){
+		fprintf(stderr, "Routing table %s not available\n", shm_name);
+		return peer;
+	}
+
+	for(u = 0; u < expressions; u++){
+		key_length = expression_resolve(expression + u, key, sizeof(key), 0, endpoint, endpoint_length, headers, header, ws);
+		if(!key_length || table_lookup(key, key_length, &route)){
+			continue;
+		}
+
+		//find a match for any indicated protocol, '*' selects the first one
+		if(!strcmp(route.protocol, "*")){
+			peer.protocol = 0;
+		}
+		else{
+			for(p = 0; p < protocols; p++){
+				if(!strcmp(route.protocol, protocol[p])){
+					peer.protocol = p;
+					break;
+				}
+			}
+		}
+
+		//the route does not match any indicated protocols
+		if(protocols && peer.protocol == protocols){
+			continue;
+		}
+
+		peer.host = strdup(route.host);
+		peer.framing = route.framing[0] ? core_framing(route.framing) : NULL;
+		peer.framing_config = route.framing_config[0] ? strdup(route.framing_config) : NULL;
+		break;
+	}
+
+	return peer;
+}
+
+void cleanup(){
+	size_t u;
+
+	for(u = 0; u < expressions; u++){
+		expression_free(expression + u);
+	}
+	free(expression);
+	expression = NULL;
+	expressions = 0;
+
+	if(table){
+		munmap(table, table_size);
+		table = NULL;
+	}
+
+	free(shm_name);
+	shm_name = NULL;
+}
@@ -0,0 +1,64 @@
+#include "../websocksy.h"
+
+/* Shared memory routing table layout, shared with the `shm_routes` writer tool */
+#define SHM_ROUTES_MAGIC 0x52595357
+#define SHM_ROUTES_VERSION 1
+
+#define SHM_ROUTE_KEY 256
+#define SHM_ROUTE_HOST 256
+#define SHM_ROUTE_PROTOCOL 64
+#define SHM_ROUTE_FRAMING 64
+#define SHM_ROUTE_FRAMING_CONFIG 256
+
+typedef enum /*_shm_route_state*/ {
+	shm_route_empty = 0,
+	shm_route_used,
+	shm_route_deleted
+} shm_route_state;
+
+/* Single route, the key is the evaluated expression */
+typedef struct /*_shm_route*/ {
+	uint32_t state;
+	uint32_t hash;
+	char key[SHM_ROUTE_KEY];
+	char host[SHM_ROUTE_HOST];
+	char protocol[SHM_ROUTE_PROTOCOL];
+	char framing[SHM_ROUTE_FRAMING];
+	char framing_config[SHM_ROUTE_FRAMING_CONFIG];
+} shm_route;
+
+/*
+ * The segment starts with this header, followed by two open-addressed hash tables of `slots` routes each.
+ * Readers use the table selected by `active`, which is only modified while its `sequence` is odd.
+ * The writer applies every change to the inactive table, switches `active` and then repeats the
+ * change on the other table. `retired` is set before the segment is removed, so readers can map
+ * its replacement.
+ */
+typedef struct /*_shm_routes_header*/ {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t slots;
+	uint32_t active;
+	uint32_t retired;
+	uint64_t sequence[2];
+} shm_routes_header;
+
+#define SHM_ROUTES_TABLE(header, slots, index) ((shm_route*) (((uint8_t*) (header)) + sizeof(shm_routes_header)) + (index) * (slots))
+#define SHM_ROUTES_SIZE(slots) (sizeof(shm_routes_header) + 2 * (slots) * sizeof(shm_route))
+
+/* FNV-1a hash of a route key */
+static inline uint32_t shm_route_hash(const char* key, size_t length){
+	size_t u;
+	uint32_t hash = 2166136261u;
+
+	for(u = 0; u < length; u++){
+		hash ^= (uint8_t) key[u];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint64_t init();
+uint64_t configure(char* key, char* value);
+ws_peer_info query(char* endpoint, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws);
+void cleanup();
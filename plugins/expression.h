@@ -0,0 +1,179 @@
+#include "../websocksy.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+/*
+ * Route expression templates shared by the backends.
+ * Expressions are split into literal and variable segments (`%endpoint%`, `%cookie:<name>%`
+ * and `%header:<tag>%`) at configuration time and evaluated for each query.
+ */
+
+typedef enum /*_template_segment_type*/ {
+	segment_literal,
+	segment_endpoint,
+	segment_cookie,
+	segment_header
+} template_segment_type;
+
+typedef struct /*_template_segment*/ {
+	template_segment_type type;
+	char* text;
+	size_t length;
+} template_segment;
+
+typedef struct /*_expression_template*/ {
+	size_t segments;
+	template_segment* segment;
+} expression_template;
+
+/* Append a segment to an expression template */
+static int expression_segment(expression_template* template, template_segment_type type, char* text, size_t length){
+	template_segment* segment = realloc(template->segment, (template->segments + 1) * sizeof(template_segment));
+	if(!segment){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	template->segment = segment;
+
+	template->segment[template->segments].type = type;
+	template->segment[template->segments].length = length;
+	template->segment[template->segments].text = strndup(text, length);
+	if(!template->segment[template->segments].text){
+		fprintf(stderr, "Failed to allocate memory\n");
+		return 1;
+	}
+	template->segments++;
+	return 0;
+}
+
+/* Split an expression into literal and variable segments, declaring all used headers and cookies to the core */
+static int expression_compile(expression_template* template, char* value){
+	size_t u, literal = 0, index_len;
+	template_segment_type type;
+
+	for(u = 0; value[u]; u++){
+		if(value[u] != '%'){
+			continue;
+		}
+
+		if(!strncmp(value + u, "%endpoint%", 10)){
+			type = segment_endpoint;
+			index_len = 0;
+		}
+		else if(!strncmp(value + u, "%cookie:", 8) || !strncmp(value + u, "%header:", 8)){
+			type = (value[u + 1] == 'c') ? segment_cookie : segment_header;
+			for(index_len = 0; value[u + 8 + index_len] && value[u + 8 + index_len] != '%'; index_len++){
+			}
+			if(!value[u + 8 + index_len]){
+				fprintf(stderr, "Unterminated expression variable: %s\n", value + u);
+				return 1;
+			}
+		}
+		else{
+			//not a variable, keep as literal
+			continue;
+		}
+
+		if(u > literal && expression_segment(template, segment_literal, value + literal, u - literal)){
+			return 1;
+		}
+
+		if(type == segment_endpoint){
+			if(expression_segment(template, type, "", 0)){
+				return 1;
+			}
+			u += 9;
+		}
+		else{
+			if(expression_segment(template, type, value + u + 8, index_len)){
+				return 1;
+			}
+			if((type == segment_header) ? core_cache_header(template->segment[template->segments - 1].text)
+					: core_cache_cookie(template->segment[template->segments - 1].text)){
+				return 1;
+			}
+			u += 8 + index_len;
+		}
+		literal = u + 1;
+	}
+
+	if(u > literal && expression_segment(template, segment_literal, value + literal, u - literal)){
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Evaluate a compiled expression into a buffer. If `sanitize` is set, slashes in variable values
+ * are replaced by underscores. Returns the result length, or 0 if it can not be resolved or
+ * does not fit the buffer.
+ */
+static size_t expression_resolve(expression_template* template, char* buffer, size_t buffer_length, uint8_t sanitize, char* endpoint, size_t endpoint_length, size_t headers, ws_http_header* header, websocket* ws){
+	size_t u, p, value_len, offset = 0;
+	char* value;
+
+	for(u = 0; u < template->segments; u++){
+		value = NULL;
+		value_len = 0;
+		switch(template->segment[u].type){
+			case segment_literal:
+				value = template->segment[u].text;
+				value_len = template->segment[u].length;
+				break;
+			case segment_endpoint:
+				if(endpoint_length < 1){
+					return 0;
+				}
+				value = endpoint + 1;
+				value_len = endpoint_length - 1;
+				//strip a trailing slash so test and test/ resolve the same
+				if(endpoint_length >= 2 && endpoint[endpoint_length - 1] == '/'){
+					value_len--;
+				}
+				break;
+			case segment_cookie:
+				value = client_cookie(ws, template->segment[u].text, &value_len);
+				break;
+			case segment_header:
+				for(p = 0; p < headers; p++){
+					if(!strcasecmp(header[p].tag, template->segment[u].text)){
+						value = header[p].value;
+						value_len = strlen(value);
+						break;
+					}
+				}
+				break;
+		}
+
+		//missing variables fail the expression
+		if(!value || offset + value_len >= buffer_length){
+			return 0;
+		}
+
+		memcpy(buffer + offset, value, value_len);
+		if(sanitize && template->segment[u].type != segment_literal){
+			for(p = offset; p < offset + value_len; p++){
+				if(buffer[p] == '/'){
+					buffer[p] = '_';
+				}
+			}
+		}
+		offset += value_len;
+	}
+
+	buffer[offset] = 0;
+	return offset;
+}
+
+/* Release all segments of an expression template */
+static void expression_free(expression_template* template){
+	size_t u;
+
+	for(u = 0; u < template->segments; u++){
+		free(template->segment[u].text);
+	}
+	free(template->segment);
+	template->segment = NULL;
+	template->segments = 0;
+}
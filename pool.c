@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+#include "network.h"
+#include "log.h"
+
+/* Maximum number of distinct peer addresses to keep pools for */
+#define POOL_MAX_PEERS 64
+/* Maximum number of new connections started per pool and maintenance run */
+#define POOL_REFILL_BUDGET 4
+
+/*
+ * The peer pool keeps a number of idle, pre-connected sockets per peer address, so that
+ * upgrading WebSockets do not pay the connection round trip. Pools are created on the first
+ * connection to an address and are refilled from the core loop. Each pool starts out with
+ * the configured minimum size as target, which grows towards the maximum when upgrades find
+ * the pool empty and decays back when the pool is not used.
+ */
+
+typedef struct /*_pool_member*/ {
+	int fd;
+	uint8_t pending;
+} pool_member;
+
+typedef struct /*_peer_pool*/ {
+	peer_transport transport;
+	char* host;
+	char* port;
+	size_t target;
+	size_t members;
+	pool_member* member;
+	size_t takes;
+	time_t last_check;
+	time_t retry;
+} peer_pool;
+
+static size_t pool_min = 0, pool_max = 0;
+static time_t pool_check_interval = 5;
+static size_t pool_hits = 0, pool_misses = 0;
+
+static size_t pools = 0;
+static peer_pool* pool = NULL;
+
+/* Configure pool sizes, pooling is disabled with a maximum size of 0 */
+void pool_init(size_t min, size_t max, time_t check_interval){
+	if(min > max){
+		fprintf(stderr, "Pool minimum size %lu exceeds the maximum of %lu, limiting it\n", min, max);
+		min = max;
+	}
+
+	pool_min = min;
+	pool_max = max;
+	pool_check_interval = check_interval;
+}
+
+/* Find or create the pool for a peer address */
+static peer_pool* pool_find(peer_transport transport, char* host, char* port){
+	size_t u;
+	peer_pool* resized = NULL;
+	peer_pool empty = {
+		.transport = transport
+	};
+
+	for(u = 0; u < pools; u++){
+		if(pool[u].transport == transport
+				&& !strcmp(pool[u].host, host)
+				&& ((!pool[u].port && !port) || (pool[u].port && port && !strcmp(pool[u].port, port)))){
+			return pool + u;
+		}
+	}
+
+	if(pools == POOL_MAX_PEERS){
+		return NULL;
+	}
+
+	resized = realloc(pool, (pools + 1) * sizeof(peer_pool));
+	if(!resized){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return NULL;
+	}
+	pool = resized;
+
+	empty.host = strdup(host);
+	empty.port = port ? strdup(port) : NULL;
+	empty.target = pool_min;
+	empty.member = calloc(pool_max, sizeof(pool_member));
+	if(!empty.host || !empty.member){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		free(empty.host);
+		free(empty.port);
+		free(empty.member);
+		return NULL;
+	}
+
+	pool[pools] = empty;
+	pools++;
+	return pool + pools - 1;
+}
+
+/* Check an idle member for a peer-side close without consuming any data */
+static int pool_member_alive(int fd){
+	uint8_t probe;
+	ssize_t bytes = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	//data may legitimately be waiting (eg. protocol banners) and belongs to the later session
+	return bytes > 0 || (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/* Remove a member from a pool, closing it if requested */
+static void pool_member_remove(peer_pool* peer, size_t index, int close_fd){
+	if(close_fd){
+		close(peer->member[index].fd);
+	}
+	peer->members--;
+	peer->member[index] = peer->member[peer->members];
+}
+
+/*
+ * Take a connected socket for a peer address from the pool.
+ * Returns -1 if pooling is disabled or no healthy idle member is available.
+ */
+int pool_take(peer_transport transport, char* host, char* port){
+	size_t u;
+	int fd = -1;
+	peer_pool* peer = NULL;
+
+	if(!pool_max || (transport != peer_tcp_client && transport != peer_unix_stream)){
+		return -1;
+	}
+
+	peer = pool_find(transport, host, port);
+	if(!peer){
+		return -1;
+	}
+
+	peer->takes++;
+	for(u = peer->members; u > 0; u--){
+		if(peer->member[u - 1].pending){
+			continue;
+		}
+
+		if(pool_member_alive(peer->member[u - 1].fd)){
+			fd = peer->member[u - 1].fd;
+			pool_member_remove(peer, u - 1, 0);
+			pool_hits++;
+			return fd;
+		}
+		pool_member_remove(peer, u - 1, 1);
+	}
+
+	//demand exceeds the pool size, grow the target
+	if(peer->target < pool_max){
+		peer->target++;
+	}
+	pool_misses++;
+	return -1;
+}
+
+/* Complete a pending connection, backing off for a second on failure. Returns 1 while still pending */
+static int pool_member_connect(peer_pool* peer, size_t index, time_t current_time){
+	switch(network_connect_done(peer->member[index].fd)){
+		case 0:
+			peer->member[index].pending = 0;
+			return 0;
+		case 1:
+			return 1;
+		default:
+			pool_member_remove(peer, index, 1);
+			peer->retry = current_time + 1;
+			return 0;
+	}
+}
+
+/* Add the sockets of pending connections to a select set, they become writable once established */
+void pool_fds(fd_set* fds, int* max_fd){
+	size_t u, p;
+
+	for(u = 0; u < pools; u++){
+		for(p = 0; p < pool[u].members; p++){
+			if(pool[u].member[p].pending){
+				FD_SET(pool[u].member[p].fd, fds);
+				if(*max_fd < pool[u].member[p].fd){
+					*max_fd = pool[u].member[p].fd;
+				}
+			}
+		}
+	}
+}
+
+/* Complete all pending connections whose sockets became writable */
+void pool_data(fd_set* fds, time_t current_time){
+	size_t u, p;
+
+	for(u = 0; u < pools; u++){
+		for(p = pool[u].members; p > 0; p--){
+			if(pool[u].member[p - 1].pending && FD_ISSET(pool[u].member[p - 1].fd, fds)){
+				pool_member_connect(pool + u, p - 1, current_time);
+			}
+		}
+	}
+}
+
+/*
+ * Complete pending connections, check idle members and refill all pools to their target size.
+ * Returns the number of members that still need attention (pending or missing).
+ */
+size_t pool_maintain(time_t current_time){
+	size_t u, p, started, outstanding = 0;
+	peer_pool* peer = NULL;
+
+	for(u = 0; u < pools; u++){
+		peer = pool + u;
+
+		//complete pending connections, check idle members
+		for(p = peer->members; p > 0; p--){
+			if(peer->member[p - 1].pending){
+				outstanding += pool_member_connect(peer, p - 1, current_time);
+			}
+			else if(current_time - peer->last_check >= pool_check_interval
+					&& !pool_member_alive(peer->member[p - 1].fd)){
+				pool_member_remove(peer, p - 1, 1);
+			}
+		}
+
+		if(current_time - peer->last_check >= pool_check_interval){
+			//shrink the target of pools that have not been used recently
+			if(peer->target > pool_min && !peer->takes){
+				peer->target--;
+			}
+			peer->last_check = current_time;
+			peer->takes = 0;
+		}
+
+		//refill the pool, backing off for a second after failures
+		for(started = 0; current_time >= peer->retry
+				&& peer->members < peer->target
+				&& started < POOL_REFILL_BUDGET; started++){
+			if(peer->transport == peer_unix_stream){
+				peer->member[peer->members].fd = network_socket_unix(peer->host, SOCK_STREAM, 0);
+				peer->member[peer->members].pending = 0;
+			}
+			else{
+				peer->member[peer->members].fd = network_connect_start(peer->host, peer->port, SOCK_STREAM);
+				peer->member[peer->members].pending = 1;
+			}
+
+			if(peer->member[peer->members].fd < 0){
+				peer->retry = current_time + 1;
+				break;
+			}
+			peer->members++;
+		}
+
+		outstanding += peer->target - peer->members;
+	}
+
+	return outstanding;
+}
+
+/* Query pool usage counters */
+void pool_stats(size_t* hits, size_t* misses){
+	*hits = pool_hits;
+	*misses = pool_misses;
+}
+
+/* Close all idle members and release all pools */
+void pool_cleanup(){
+	size_t u, p;
+
+	for(u = 0; u < pools; u++){
+		for(p = 0; p < pool[u].members; p++){
+			close(pool[u].member[p].fd);
+		}
+		free(pool[u].member);
+		free(pool[u].host);
+		free(pool[u].port);
+	}
+	free(pool);
+	pool = NULL;
+	pools = 0;
+}
@@ -0,0 +1,11 @@
+#include "websocksy.h"
+#include <sys/select.h>
+
+/* Pre-connected peer socket pool */
+void pool_init(size_t min, size_t max, time_t check_interval);
+int pool_take(peer_transport transport, char* host, char* port);
+void pool_fds(fd_set* fds, int* max_fd);
+void pool_data(fd_set* fds, time_t current_time);
+size_t pool_maintain(time_t current_time);
+void pool_stats(size_t* hits, size_t* misses);
+void pool_cleanup();
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "reconnect.h"
+#include "websocket.h"
+#include "network.h"
+#include "memory.h"
+#include "breaker.h"
+#include "pool.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Peers with a reconnection policy (`?reconnect=<seconds>` in the peer address) that close
+ * their connection do not take the WebSocket down with them. Instead, the peer is reconnected
+ * from the core loop with exponential backoff and some jitter, so a restarting peer is not hit
+ * by all of its clients at once. Client data arriving in the meantime is buffered up to the
+ * configured limit and replayed in order once the peer is back.
+ * Attempts connect nonblocking and are completed once the socket becomes writable; an attempt
+ * still pending when the next one is due counts as failed.
+ */
+
+/* Connection waiting for its peer, with the socket of the current attempt */
+typedef struct /*_reconnect_entry*/ {
+	size_t index;
+	int fd;
+} reconnect_entry;
+
+/* All connections currently waiting for their peer */
+static size_t pending = 0;
+static size_t pending_alloc = 0;
+static reconnect_entry* pending_entry = NULL;
+
+static time_t reconnect_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/* Schedule the next attempt, doubling the delay with every failure and spreading clients over the interval */
+static void reconnect_schedule(websocket* ws, time_t current_time){
+	time_t delay = 1 << ((ws->peer_retries < 4) ? ws->peer_retries : 4);
+
+	delay = (delay > RECONNECT_BACKOFF_MAX) ? RECONNECT_BACKOFF_MAX : delay;
+	ws->peer_retry = current_time + delay + (rand() % (delay + 1));
+}
+
+/*
+ * Drop the peer connection and framing state, keeping the peer address.
+ * Client data the peer did not accept yet is discarded with the connection, as it may start in the
+ * middle of a message, just like the data already accepted by the socket.
+ */
+static void reconnect_disconnect(websocket* ws){
+	network_backlog_clear(&(ws->peer_backlog));
+	if(ws->peer_fd >= 0){
+		close(ws->peer_fd);
+		ws->peer_fd = -1;
+	}
+
+	if(ws->peer_framing_data){
+		ws->peer.framing(NULL, 0, 0, NULL, &(ws->peer_framing_data), ws->peer.framing_config);
+		ws->peer_framing_data = NULL;
+	}
+	ws->peer_buffer_offset = 0;
+}
+
+/*
+ * Handle the loss of a peer connection.
+ * Returns 0 if the connection will be reconnected, 1 if it should be closed.
+ */
+int reconnect_start(websocket* ws){
+	size_t u, index = client_index(ws);
+	reconnect_entry* pending_new = NULL;
+
+	//only direct stream connections can be re-established transparently
+	if(!ws->peer.reconnect
+			|| ws->state != ws_open
+			|| (ws->peer.transport != peer_tcp_client && ws->peer.transport != peer_unix_stream)){
+		return 1;
+	}
+
+	reconnect_disconnect(ws);
+	if(ws->peer_lost){
+		//already waiting for this peer
+		return 0;
+	}
+
+	//the slot may still be listed from a previous connection
+	for(u = 0; u < pending; u++){
+		if(pending_entry[u].index == index){
+			break;
+		}
+	}
+
+	if(u == pending){
+		if(pending == pending_alloc){
+			pending_new = realloc(pending_entry, (pending_alloc ? pending_alloc * 2 : 16) * sizeof(reconnect_entry));
+			if(!pending_new){
+				LOG(log_core, log_error, "Failed to allocate memory\n");
+				return 1;
+			}
+			pending_entry = pending_new;
+			pending_alloc = pending_alloc ? pending_alloc * 2 : 16;
+		}
+		pending_entry[pending].index = index;
+		pending_entry[pending].fd = -1;
+		pending++;
+	}
+
+	LOG(log_peer, log_warn, "Lost peer %s, reconnecting for up to %lu seconds\n", ws->peer.host, ws->peer.reconnect);
+	ws->peer_lost = reconnect_now();
+	ws->peer_retries = 0;
+	reconnect_schedule(ws, ws->peer_lost);
+	return 0;
+}
+
+/*
+ * Buffer client data for a connection waiting for its peer.
+ * Returns 1 if the buffer limit is exceeded.
+ */
+int reconnect_buffer(websocket* ws, uint8_t* data, size_t length){
+	uint8_t* replay = NULL;
+
+	if(ws->peer_replay_length + length > ws->peer.reconnect_buffer){
+		return 1;
+	}
+
+	replay = realloc(ws->peer_replay, ws->peer_replay_length + length);
+	if(!replay && length){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+	ws->peer_replay = replay;
+
+	memcpy(ws->peer_replay + ws->peer_replay_length, data, length);
+	ws->peer_replay_length += length;
+	memory_account(memory_replay, length);
+	return 0;
+}
+
+/* Take over an established peer connection and replay the buffered data */
+static int reconnect_complete(websocket* ws, int fd){
+	struct iovec replay = {
+		.iov_base = ws->peer_replay,
+		.iov_len = ws->peer_replay_length
+	};
+
+	ws->peer_fd = fd;
+	breaker_result(ws->peer.transport, ws->peer.host, ws->peer.port, 1);
+	TRACE(peer_connect, ws->id, ws->peer.transport, 0);
+
+	//anything the peer does not accept right away is written from the core loop
+	if(ws->peer_replay_length && network_sendv(ws->peer_fd, &(ws->peer_backlog), &replay, 1)){
+		reconnect_disconnect(ws);
+		return 1;
+	}
+
+	LOG(log_peer, log_info, "Reconnected peer %s after %u attempts, replayed %lu bytes\n", ws->peer.host, ws->peer_retries + 1, ws->peer_replay_length);
+	memory_account(memory_replay, -(ssize_t) ws->peer_replay_length);
+	free(ws->peer_replay);
+	ws->peer_replay = NULL;
+	ws->peer_replay_length = 0;
+	ws->peer_lost = 0;
+	return 0;
+}
+
+/* Count a failed attempt and schedule the next one */
+static void reconnect_failed(websocket* ws, reconnect_entry* entry, time_t current_time){
+	if(entry->fd >= 0){
+		close(entry->fd);
+		entry->fd = -1;
+		breaker_result(ws->peer.transport, ws->peer.host, ws->peer.port, 0);
+	}
+	ws->peer_retries++;
+	reconnect_schedule(ws, current_time);
+}
+
+/*
+ * Start a connection attempt. Pooled and unix socket connections complete immediately,
+ * TCP connections are completed by `reconnect_check`. Returns 1 if the attempt failed.
+ */
+static int reconnect_attempt(websocket* ws, reconnect_entry* entry){
+	int fd = -1;
+
+	if(breaker_open(ws->peer.transport, ws->peer.host, ws->peer.port)){
+		return 1;
+	}
+
+	fd = pool_take(ws->peer.transport, ws->peer.host, (ws->peer.transport == peer_tcp_client) ? ws->peer.port : NULL);
+	if(fd < 0 && ws->peer.transport == peer_tcp_client){
+		entry->fd = network_connect_start(ws->peer.host, ws->peer.port, SOCK_STREAM);
+		if(entry->fd >= 0){
+			return 0;
+		}
+	}
+	else if(fd < 0){
+		fd = network_socket_unix(ws->peer.host, SOCK_STREAM, 0);
+	}
+
+	if(fd < 0){
+		breaker_result(ws->peer.transport, ws->peer.host, ws->peer.port, 0);
+		return 1;
+	}
+	return reconnect_complete(ws, fd);
+}
+
+/* Check a pending attempt, completing the reconnection once established */
+static void reconnect_check(websocket* ws, reconnect_entry* entry, time_t current_time){
+	int fd = entry->fd;
+
+	switch(network_connect_done(fd)){
+		case 0:
+			entry->fd = -1;
+			if(reconnect_complete(ws, fd)){
+				ws->peer_retries++;
+				reconnect_schedule(ws, current_time);
+			}
+			return;
+		case 1:
+			return;
+		default:
+			reconnect_failed(ws, entry, current_time);
+	}
+}
+
+/* Add the sockets of pending attempts to a select set, they become writable once established */
+void reconnect_fds(fd_set* fds, int* max_fd){
+	size_t u;
+
+	for(u = 0; u < pending; u++){
+		if(pending_entry[u].fd >= 0){
+			FD_SET(pending_entry[u].fd, fds);
+			if(*max_fd < pending_entry[u].fd){
+				*max_fd = pending_entry[u].fd;
+			}
+		}
+	}
+}
+
+/* Complete all pending attempts whose sockets became writable */
+void reconnect_data(fd_set* fds, time_t current_time){
+	size_t u;
+	websocket* ws = NULL;
+
+	for(u = 0; u < pending; u++){
+		if(pending_entry[u].fd >= 0 && FD_ISSET(pending_entry[u].fd, fds)){
+			ws = client_get(pending_entry[u].index);
+			if(ws && ws->peer_lost){
+				reconnect_check(ws, pending_entry + u, current_time);
+			}
+		}
+	}
+}
+
+/*
+ * Start due reconnection attempts, fail attempts that did not complete in time and
+ * close connections whose peer did not return in time.
+ * Returns the number of connections still waiting for their peer.
+ */
+size_t reconnect_maintain(time_t current_time){
+	size_t u;
+	websocket* ws = NULL;
+
+	for(u = 0; u < pending; u++){
+		ws = client_get(pending_entry[u].index);
+		if(ws && ws->peer_lost){
+			if(current_time - ws->peer_lost >= ws->peer.reconnect){
+				LOG(log_peer, log_warn, "Peer %s did not return within %lu seconds\n", ws->peer.host, ws->peer.reconnect);
+				ws_close(ws, ws_close_again, "Peer unavailable");
+			}
+			else{
+				if(pending_entry[u].fd >= 0){
+					reconnect_check(ws, pending_entry + u, current_time);
+					//an attempt still pending when the next one is due has failed
+					if(pending_entry[u].fd >= 0 && current_time >= ws->peer_retry){
+						reconnect_failed(ws, pending_entry + u, current_time);
+					}
+				}
+
+				//start the next attempt once due, it has until the following one to complete
+				if(ws->peer_lost && pending_entry[u].fd < 0 && current_time >= ws->peer_retry){
+					if(reconnect_attempt(ws, pending_entry + u)){
+						reconnect_failed(ws, pending_entry + u, current_time);
+					}
+					else if(pending_entry[u].fd >= 0){
+						reconnect_schedule(ws, current_time);
+					}
+				}
+
+				if(ws->peer_lost){
+					continue;
+				}
+			}
+		}
+
+		//no longer waiting, remove from the list
+		if(pending_entry[u].fd >= 0){
+			close(pending_entry[u].fd);
+		}
+		pending_entry[u] = pending_entry[pending - 1];
+		pending--;
+		u--;
+	}
+
+	return pending;
+}
+
+/* Release the reconnection state of a connection being closed */
+void reconnect_release(websocket* ws){
+	size_t u, index;
+
+	//abort a pending attempt, the entry itself is removed by the next maintenance run
+	if(ws->peer_lost){
+		index = client_index(ws);
+		for(u = 0; u < pending; u++){
+			if(pending_entry[u].index == index && pending_entry[u].fd >= 0){
+				close(pending_entry[u].fd);
+				pending_entry[u].fd = -1;
+			}
+		}
+	}
+
+	memory_account(memory_replay, -(ssize_t) ws->peer_replay_length);
+	free(ws->peer_replay);
+	ws->peer_replay = NULL;
+	ws->peer_replay_length = 0;
+	ws->peer_lost = 0;
+}
+
+void reconnect_cleanup(){
+	size_t u;
+
+	for(u = 0; u < pending; u++){
+		if(pending_entry[u].fd >= 0){
+			close(pending_entry[u].fd);
+		}
+	}
+	free(pending_entry);
+	pending_entry = NULL;
+	pending = pending_alloc = 0;
+}
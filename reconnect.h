@@ -0,0 +1,16 @@
+#include "websocksy.h"
+#include <sys/select.h>
+
+/* Default limit of client data buffered while reconnecting, in bytes */
+#define RECONNECT_BUFFER_DEFAULT (64 * 1024)
+/* Upper bound for the delay between reconnection attempts, in seconds */
+#define RECONNECT_BACKOFF_MAX 16
+
+/* Transparent peer reconnection */
+int reconnect_start(websocket* ws);
+int reconnect_buffer(websocket* ws, uint8_t* data, size_t length);
+void reconnect_fds(fd_set* fds, int* max_fd);
+void reconnect_data(fd_set* fds, time_t current_time);
+size_t reconnect_maintain(time_t current_time);
+void reconnect_release(websocket* ws);
+void reconnect_cleanup();
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include "resume.h"
+#include "group.h"
+#include "network.h"
+#include "memory.h"
+#include "log.h"
+
+/*
+ * Connections to stream peers are handed a random resumption token in a cookie
+ * with the upgrade response. When the client connection is lost (without a close frame), the
+ * peer connection is parked for the grace period instead of being closed, and data arriving
+ * from the peer is buffered. A new WebSocket presenting the token for the same endpoint within
+ * the grace period takes over the parked peer connection, skipping the backend query and
+ * peer connection setup, and receives the buffered data after the upgrade.
+ */
+
+typedef struct /*_resume_session*/ {
+	char token[WS_RESUME_TOKEN + 1];
+	char* path;
+	char* protocol;
+	time_t parked;
+
+	ws_peer_info peer;
+	int peer_fd;
+	void* framing_data;
+	struct _group_member* member;
+	/* Unsent tail of client data the peer has partially received */
+	network_backlog backlog;
+
+	/* Raw peer data, starting with the unframed contents of the peer buffer */
+	uint8_t* data;
+	size_t length;
+	size_t partial;
+} resume_session;
+
+static time_t resume_grace = 0;
+static size_t resume_limit = RESUME_BUFFER_DEFAULT;
+static char* resume_name = RESUME_COOKIE_DEFAULT;
+
+static size_t sessions = 0;
+static resume_session* session = NULL;
+
+/* Peer data of the last adopted session, delivered after the upgrade response */
+static uint8_t* adopted_data = NULL;
+static size_t adopted_offset = 0;
+static size_t adopted_length = 0;
+
+/* Configure session resumption, a grace period of 0 disables it */
+void resume_init(time_t grace, size_t buffer, char* cookie){
+	resume_grace = grace;
+	resume_limit = buffer;
+	resume_name = cookie ? cookie : RESUME_COOKIE_DEFAULT;
+}
+
+char* resume_cookie(){
+	return resume_name;
+}
+
+/*
+ * Length of the request path the resumption cookie is scoped to, excluding any query.
+ * Returns 0 if the path is too long or can not be used as cookie attribute.
+ */
+size_t resume_path(char* path){
+	size_t u;
+
+	for(u = 0; path[u] && path[u] != '?'; u++){
+		if(u == WS_RESUME_PATH
+				|| (uint8_t) path[u] <= ' '
+				|| (uint8_t) path[u] >= 0x7F
+				|| path[u] == ';'
+				|| path[u] == ','
+				|| path[u] == '"'
+				|| path[u] == '\\'){
+			return 0;
+		}
+	}
+	return (path[0] == '/') ? u : 0;
+}
+
+/* Compare two resumption tokens in constant time */
+static int resume_token_equal(char* a, char* b){
+	size_t u;
+	uint8_t difference = 0;
+
+	for(u = 0; u < WS_RESUME_TOKEN; u++){
+		difference |= a[u] ^ b[u];
+	}
+	return !difference;
+}
+
+/* Generate a resumption token for a newly connected WebSocket */
+void resume_issue(websocket* ws){
+	uint8_t token[WS_RESUME_TOKEN / 2];
+	size_t u;
+
+	ws->resume_token[0] = 0;
+	//only connections owning a stream peer connection can be parked, buffered datagrams would lose their boundaries
+	if(!resume_grace || ws->peer_fd < 0 || PEER_DATAGRAM(ws->peer.transport)){
+		return;
+	}
+
+	//the cookie is scoped to the request path, which has to fit into the attribute
+	if(!resume_path(ws->request_path)){
+		return;
+	}
+
+	if(getrandom(token, sizeof(token), 0) != sizeof(token)){
+		LOG(log_core, log_error, "Failed to generate resumption token: %s\n", strerror(errno));
+		return;
+	}
+
+	for(u = 0; u < sizeof(token); u++){
+		snprintf(ws->resume_token + 2 * u, 3, "%02x", token[u]);
+	}
+}
+
+/* Close a parked peer connection and release all session data */
+static void resume_drop(size_t index){
+	resume_session* s = session + index;
+
+	close(s->peer_fd);
+	network_backlog_clear(&(s->backlog));
+	if(s->framing_data){
+		s->peer.framing(NULL, 0, 0, NULL, &(s->framing_data), s->peer.framing_config);
+	}
+	group_member_release(s->member);
+
+	if(!s->peer.persistent){
+		free(s->peer.host);
+		free(s->peer.port);
+		free(s->peer.framing_config);
+	}
+	free(s->path);
+	free(s->protocol);
+	free(s->data);
+	memory_account(memory_sessions, -(ssize_t) s->length);
+
+	session[index] = session[sessions - 1];
+	sessions--;
+}
+
+/*
+ * Take over the peer connection of a WebSocket whose client was lost.
+ * Returns 0 if the connection was parked.
+ */
+int resume_park(websocket* ws){
+	resume_session* s = NULL;
+	struct timespec now;
+	ws_peer_info empty_peer = {
+		0
+	};
+	network_backlog empty_backlog = {
+		0
+	};
+
+	if(!resume_grace
+			|| ws->state != ws_open
+			|| !ws->resume_token[0]
+			|| ws->peer_fd < 0
+			|| ws->peer_lost){
+		return 1;
+	}
+
+	s = realloc(session, (sessions + 1) * sizeof(resume_session));
+	if(!s){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+	session = s;
+	s = session + sessions;
+	memset(s, 0, sizeof(resume_session));
+
+	s->path = strdup(ws->request_path);
+	s->protocol = (ws->peer.protocol < ws->protocols) ? strdup(ws->protocol[ws->peer.protocol]) : NULL;
+	s->data = ws->peer_buffer_offset ? malloc(ws->peer_buffer_offset) : NULL;
+	if(!s->path
+			|| (ws->peer.protocol < ws->protocols && !s->protocol)
+			|| (ws->peer_buffer_offset && !s->data)){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		free(s->path);
+		free(s->protocol);
+		free(s->data);
+		return 1;
+	}
+	sessions++;
+
+	//keep any partial frame already read from the peer
+	memcpy(s->data, ws->peer_buffer, ws->peer_buffer_offset);
+	s->length = s->partial = ws->peer_buffer_offset;
+	memory_account(memory_sessions, s->length);
+	memcpy(s->token, ws->resume_token, sizeof(s->token));
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	s->parked = now.tv_sec;
+
+	//move the peer connection and its unsent data out of the WebSocket, so ws_close does not release them
+	s->peer = ws->peer;
+	s->peer_fd = ws->peer_fd;
+	s->framing_data = ws->peer_framing_data;
+	s->member = ws->peer_member;
+	s->backlog = ws->peer_backlog;
+	ws->peer = empty_peer;
+	ws->peer_fd = -1;
+	ws->peer_framing_data = NULL;
+	ws->peer_member = NULL;
+	ws->peer_buffer_offset = 0;
+	ws->peer_backlog = empty_backlog;
+	return 0;
+}
+
+/*
+ * Attach a new WebSocket to a parked peer connection if it presents a valid token.
+ * Returns 0 if a session was adopted.
+ */
+int resume_adopt(websocket* ws){
+	size_t u, p, length = 0;
+	char* token = NULL;
+	resume_session* s = NULL;
+
+	if(!resume_grace || !sessions){
+		return 1;
+	}
+
+	token = client_cookie(ws, resume_name, &length);
+	if(!token || length != WS_RESUME_TOKEN){
+		return 1;
+	}
+
+	for(u = 0; u < sessions; u++){
+		if(resume_token_equal(session[u].token, token) && !strcmp(session[u].path, ws->request_path)){
+			s = session + u;
+			break;
+		}
+	}
+
+	if(!s){
+		return 1;
+	}
+
+	//the negotiated subprotocol must be offered again, its index may have changed
+	p = ws->protocols;
+	if(s->protocol){
+		for(p = 0; p < ws->protocols; p++){
+			if(!strcmp(ws->protocol[p], s->protocol)){
+				break;
+			}
+		}
+
+		if(p == ws->protocols){
+			LOG(log_core, log_warn, "Resumed session does not offer subprotocol %s\n", s->protocol);
+			return 1;
+		}
+	}
+
+	//restore the peer buffer, the framing function has already seen its contents
+	memcpy(ws->peer_buffer, s->data, s->partial);
+	ws->peer_buffer_offset = s->partial;
+
+	memory_account(memory_sessions, -(ssize_t) adopted_length);
+	free(adopted_data);
+	adopted_data = s->data;
+	adopted_offset = s->partial;
+	adopted_length = s->length;
+	s->data = NULL;
+
+	ws->peer = s->peer;
+	ws->peer.protocol = p;
+	ws->peer_fd = s->peer_fd;
+	ws->peer_framing_data = s->framing_data;
+	ws->peer_member = s->member;
+	//the rest of a partially sent client message goes out before anything new
+	ws->peer_backlog = s->backlog;
+
+	//the connection data now belongs to the WebSocket
+	free(s->path);
+	free(s->protocol);
+	session[u] = session[sessions - 1];
+	sessions--;
+	return 0;
+}
+
+/* Deliver the data buffered for an adopted session */
+void resume_flush(websocket* ws){
+	if(adopted_length > adopted_offset){
+		client_peer_input(ws, adopted_data + adopted_offset, adopted_length - adopted_offset);
+	}
+
+	memory_account(memory_sessions, -(ssize_t) adopted_length);
+	free(adopted_data);
+	adopted_data = NULL;
+	adopted_offset = adopted_length = 0;
+}
+
+void resume_fds(fd_set* fds, int* max_fd){
+	size_t u;
+
+	for(u = 0; u < sessions; u++){
+		FD_SET(session[u].peer_fd, fds);
+		if(*max_fd < session[u].peer_fd){
+			*max_fd = session[u].peer_fd;
+		}
+	}
+}
+
+/* Buffer data arriving on parked peer connections */
+void resume_data(fd_set* fds){
+	size_t u;
+	ssize_t bytes_read;
+	uint8_t buffer[PEER_BUFFER_SIZE], *data = NULL;
+
+	for(u = 0; u < sessions; u++){
+		if(!FD_ISSET(session[u].peer_fd, fds)){
+			continue;
+		}
+
+		bytes_read = recv(session[u].peer_fd, buffer, sizeof(buffer), 0);
+		if(bytes_read <= 0){
+			//the peer closed the connection, nothing left to resume
+			resume_drop(u);
+			u--;
+			continue;
+		}
+
+		if(session[u].length + bytes_read > resume_limit){
+			LOG(log_core, log_warn, "Parked session exceeded the buffer limit\n");
+			resume_drop(u);
+			u--;
+			continue;
+		}
+
+		data = realloc(session[u].data, session[u].length + bytes_read);
+		if(!data){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			resume_drop(u);
+			u--;
+			continue;
+		}
+		session[u].data = data;
+		memcpy(session[u].data + session[u].length, buffer, bytes_read);
+		session[u].length += bytes_read;
+		memory_account(memory_sessions, bytes_read);
+	}
+}
+
+/* Close parked sessions past their grace period, returns the number of sessions still parked */
+size_t resume_maintain(time_t current_time){
+	size_t u;
+
+	for(u = 0; u < sessions; u++){
+		if(current_time - session[u].parked >= resume_grace){
+			resume_drop(u);
+			u--;
+		}
+	}
+	return sessions;
+}
+
+void resume_cleanup(){
+	while(sessions){
+		resume_drop(0);
+	}
+	free(session);
+	session = NULL;
+
+	memory_account(memory_sessions, -(ssize_t) adopted_length);
+	free(adopted_data);
+	adopted_data = NULL;
+	adopted_offset = adopted_length = 0;
+}
@@ -0,0 +1,20 @@
+#include "websocksy.h"
+#include <sys/select.h>
+
+/* Default limit of peer data buffered for a parked session, in bytes */
+#define RESUME_BUFFER_DEFAULT (64 * 1024)
+/* Default name of the resumption token cookie */
+#define RESUME_COOKIE_DEFAULT "websocksy_resume"
+
+/* Client session resumption */
+void resume_init(time_t grace, size_t buffer, char* cookie);
+char* resume_cookie();
+size_t resume_path(char* path);
+void resume_issue(websocket* ws);
+int resume_park(websocket* ws);
+int resume_adopt(websocket* ws);
+void resume_flush(websocket* ws);
+void resume_fds(fd_set* fds, int* max_fd);
+void resume_data(fd_set* fds);
+size_t resume_maintain(time_t current_time);
+void resume_cleanup();
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+#include "network.h"
+#include "websocket.h"
+#include "log.h"
+
+/*
+ * Every `shm://` WebSocket owns one shared memory segment and a control socket to its peer.
+ * Client messages are appended to the outbound ring and the peer is only woken up if it is
+ * waiting for data. Inbound messages are drained from the core loop whenever the peer signals
+ * the eventfd, and while the WebSocket outbound queue is empty.
+ */
+
+typedef struct _ring_connection {
+	size_t client;
+	int socket_fd;
+	int notify_peer;
+	int notify_core;
+	ring_segment* segment;
+} ring_connection;
+
+static size_t connections = 0;
+static ring_connection** connection = NULL;
+
+/* Wake up the peer */
+static int ring_signal(ring_connection* conn){
+	uint64_t value = 1;
+
+	if(write(conn->notify_peer, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN){
+		LOG(log_peer, log_warn, "Failed to signal ring peer: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/* Pass the segment and eventfds to the peer, along with the request endpoint */
+static int ring_handshake(ring_connection* conn, int memfd, char* endpoint){
+	int fds[3] = {memfd, conn->notify_peer, conn->notify_core};
+	char control[CMSG_SPACE(sizeof(fds))] = "";
+	struct iovec iov = {
+		.iov_base = endpoint,
+		.iov_len = strlen(endpoint)
+	};
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if(sendmsg(conn->socket_fd, &message, MSG_NOSIGNAL) < 0){
+		LOG(log_peer, log_error, "Failed to pass ring to peer: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static void ring_free_connection(ring_connection* conn){
+	if(conn->segment){
+		munmap(conn->segment, RING_SEGMENT_SIZE(RING_SIZE));
+	}
+	if(conn->socket_fd >= 0){
+		close(conn->socket_fd);
+	}
+	if(conn->notify_peer >= 0){
+		close(conn->notify_peer);
+	}
+	if(conn->notify_core >= 0){
+		close(conn->notify_core);
+	}
+	free(conn);
+}
+
+/* Create and map the shared segment, returns the memfd or -1 */
+static int ring_segment_create(ring_connection* conn){
+	int memfd = memfd_create("websocksy-ring", MFD_CLOEXEC);
+
+	if(memfd < 0){
+		LOG(log_peer, log_error, "Failed to create ring segment: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(ftruncate(memfd, RING_SEGMENT_SIZE(RING_SIZE))){
+		LOG(log_peer, log_error, "Failed to size ring segment: %s\n", strerror(errno));
+		close(memfd);
+		return -1;
+	}
+
+	conn->segment = mmap(NULL, RING_SEGMENT_SIZE(RING_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(conn->segment == MAP_FAILED){
+		LOG(log_peer, log_error, "Failed to map ring segment: %s\n", strerror(errno));
+		conn->segment = NULL;
+		close(memfd);
+		return -1;
+	}
+
+	//the segment is zero-filled, the core loop always waits for inbound data
+	conn->segment->magic = RING_MAGIC;
+	conn->segment->version = RING_VERSION;
+	conn->segment->size = RING_SIZE;
+	conn->segment->ring[RING_FROM_PEER].consumer_waiting = 1;
+	return memfd;
+}
+
+/*
+ * Connect a WebSocket to a shared memory ring peer.
+ * Returns 0 on success.
+ */
+int ring_attach(websocket* ws){
+	int memfd = -1, status;
+	ring_connection* conn = calloc(1, sizeof(ring_connection));
+	ring_connection** list = NULL;
+
+	if(!conn){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+
+	conn->client = client_index(ws);
+	conn->socket_fd = network_socket_unix(ws->peer.host, SOCK_STREAM, 0);
+	conn->notify_peer = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	conn->notify_core = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(conn->socket_fd < 0 || conn->notify_peer < 0 || conn->notify_core < 0){
+		LOG(log_peer, log_error, "Failed to connect ring peer %s\n", ws->peer.host);
+		ring_free_connection(conn);
+		return 1;
+	}
+
+	memfd = ring_segment_create(conn);
+	if(memfd < 0){
+		ring_free_connection(conn);
+		return 1;
+	}
+
+	//the peer keeps the segment mapped with its own descriptor
+	status = ring_handshake(conn, memfd, ws->request_path);
+	close(memfd);
+
+	list = status ? NULL : realloc(connection, (connections + 1) * sizeof(ring_connection*));
+	if(!list){
+		if(!status){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+		}
+		ring_free_connection(conn);
+		return 1;
+	}
+	connection = list;
+	connection[connections++] = conn;
+	ws->peer_ring = conn;
+	return 0;
+}
+
+void ring_detach(websocket* ws){
+	size_t u;
+
+	for(u = 0; u < connections; u++){
+		if(connection[u] == ws->peer_ring){
+			ring_free_connection(connection[u]);
+			connection[u] = connection[connections - 1];
+			connections--;
+			break;
+		}
+	}
+	ws->peer_ring = NULL;
+}
+
+/*
+ * Check whether the outbound ring can take another client message.
+ * If not, the peer is asked to signal once it has consumed data.
+ */
+int ring_ready(websocket* ws){
+	ring_segment* segment = ws->peer_ring ? ws->peer_ring->segment : NULL;
+	//a client frame may need to be preceded by a padding record
+	uint64_t needed = 2 * RING_ALIGN(RING_RECORD_HEADER + WS_MAX_LINE);
+
+	if(!segment){
+		return 1;
+	}
+
+	if(ring_free(segment, RING_SIZE, RING_TO_PEER) >= needed){
+		__atomic_store_n(&(segment->ring[RING_TO_PEER].producer_waiting), 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	__atomic_store_n(&(segment->ring[RING_TO_PEER].producer_waiting), 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return ring_free(segment, RING_SIZE, RING_TO_PEER) >= needed;
+}
+
+/*
+ * Append a WebSocket message to the outbound ring.
+ * Returns 0 on success.
+ */
+int ring_send(websocket* ws, ws_operation opcode, uint8_t* data, size_t length){
+	ring_connection* conn = ws->peer_ring;
+
+	if(!conn){
+		return 1;
+	}
+
+	if(length > RING_MESSAGE_MAX
+			|| ring_push(conn->segment, RING_SIZE, RING_TO_PEER, (opcode == ws_frame_text) ? ring_text : ring_binary, data, length)){
+		LOG(log_peer, log_warn, "Message does not fit the peer ring\n");
+		return 1;
+	}
+
+	//only wake up the peer if it sleeps
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(conn->segment->ring[RING_TO_PEER].consumer_waiting), __ATOMIC_RELAXED)){
+		return ring_signal(conn);
+	}
+	return 0;
+}
+
+void ring_fds(fd_set* fds, int* max_fd){
+	size_t u;
+
+	for(u = 0; u < connections; u++){
+		FD_SET(connection[u]->socket_fd, fds);
+		FD_SET(connection[u]->notify_core, fds);
+		if(*max_fd < connection[u]->socket_fd){
+			*max_fd = connection[u]->socket_fd;
+		}
+		if(*max_fd < connection[u]->notify_core){
+			*max_fd = connection[u]->notify_core;
+		}
+	}
+}
+
+/*
+ * Forward messages from the inbound ring to the WebSocket until the ring is empty or
+ * the WebSocket has frames queued. Returns 0 on success.
+ */
+static int ring_drain(ring_connection* conn, websocket* ws){
+	ring_segment* segment = conn->segment;
+	ring_state* state = segment->ring + RING_FROM_PEER;
+	uint8_t* payload = NULL;
+	uint32_t type, length;
+	int status;
+
+	__atomic_store_n(&(state->consumer_waiting), 0, __ATOMIC_RELAXED);
+	while(!ws->queue_entries){
+		status = ring_peek(segment, RING_SIZE, RING_FROM_PEER, &payload, &type, &length);
+		if(status == 1){
+			//announce that we are about to wait, then check again
+			__atomic_store_n(&(state->consumer_waiting), 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			status = ring_peek(segment, RING_SIZE, RING_FROM_PEER, &payload, &type, &length);
+			if(status == 1){
+				break;
+			}
+			__atomic_store_n(&(state->consumer_waiting), 0, __ATOMIC_RELAXED);
+		}
+
+		if(status < 0 || (type != ring_text && type != ring_binary)){
+			LOG(log_peer, log_warn, "Invalid data in peer ring\n");
+			return 1;
+		}
+
+		if(ws_send_frame(ws, (type == ring_text) ? ws_frame_text : ws_frame_binary, payload, length)){
+			return 1;
+		}
+		ring_consume(segment, RING_FROM_PEER, length);
+	}
+
+	//the peer may be waiting for space
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(state->producer_waiting), __ATOMIC_RELAXED)){
+		return ring_signal(conn);
+	}
+	return 0;
+}
+
+void ring_data(fd_set* fds){
+	size_t u;
+	uint64_t value;
+	uint8_t discard[64];
+	ssize_t bytes_read;
+	ring_connection* conn = NULL;
+	websocket* ws = NULL;
+
+	for(u = 0; u < connections; u++){
+		conn = connection[u];
+		ws = client_get(conn->client);
+		if(!ws){
+			continue;
+		}
+
+		//the peer terminates the connection by closing the socket
+		if(FD_ISSET(conn->socket_fd, fds)){
+			bytes_read = recv(conn->socket_fd, discard, sizeof(discard), 0);
+			if(bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+				ws_close(ws, ws_close_normal, "Peer closed connection");
+				u--;
+				continue;
+			}
+		}
+
+		if(FD_ISSET(conn->notify_core, fds)){
+			if(read(conn->notify_core, &value, sizeof(value)) < 0 && errno != EAGAIN){
+				LOG(log_peer, log_warn, "Failed to read ring notification: %s\n", strerror(errno));
+			}
+		}
+		else if(ws->queue_entries || conn->segment->ring[RING_FROM_PEER].consumer_waiting){
+			//nothing new, and the ring was fully drained the last time
+			continue;
+		}
+
+		if(ring_drain(conn, ws)){
+			ws_close(ws, ws_close_unexpected, "Peer connection failed");
+			u--;
+		}
+	}
+}
+
+/*
+ * Called after data was written to a WebSocket. Once its queue is empty, the inbound ring is drained
+ * again, as the peer does not signal while the core is not waiting for data.
+ */
+void ring_written(websocket* ws){
+	if(!ws->peer_ring || ws->queue_entries){
+		return;
+	}
+
+	if(ring_drain(ws->peer_ring, ws)){
+		ws_close(ws, ws_close_unexpected, "Peer connection failed");
+	}
+}
+
+void ring_cleanup(){
+	size_t u;
+
+	for(u = 0; u < connections; u++){
+		ring_free_connection(connection[u]);
+	}
+	free(connection);
+	connection = NULL;
+	connections = 0;
+}
@@ -0,0 +1,165 @@
+#include "websocksy.h"
+#include <sys/select.h>
+#include <string.h>
+
+/*
+ * Shared memory ring peer transport
+ *
+ * `shm://<socket path>` peers are connected via a Unix stream socket, over which websocksy sends
+ * one message carrying the request endpoint as payload and three file descriptors (SCM_RIGHTS):
+ * 	* a memfd containing a ring_segment header followed by two rings of `size` bytes each
+ * 	* an eventfd signalled by websocksy
+ * 	* an eventfd signalled by the peer
+ *
+ * Ring RING_TO_PEER carries client messages to the peer, ring RING_FROM_PEER carries peer
+ * messages, each of which is forwarded as exactly one WebSocket frame. Both rings are
+ * single-producer/single-consumer: the producer only advances `head`, the consumer only
+ * advances `tail`, both counting bytes since the start and wrapping at the ring size.
+ *
+ * Records consist of an 8 byte header (32 bit length and 32 bit type, native byte order)
+ * followed by the payload, padded to 8 bytes. Records never wrap; a padding record fills
+ * the remainder of the ring instead.
+ *
+ * To avoid system calls on busy rings, a side only signals the other side's eventfd if it
+ * has indicated that it is about to sleep by setting `consumer_waiting` (waiting for data)
+ * or `producer_waiting` (waiting for space) and checking the ring again afterwards.
+ * The connection is terminated by closing the socket.
+ *
+ * The segment is writable by the other side, which may not be trusted to keep it consistent.
+ * The ring size is therefore passed to all ring functions from private state (websocksy always
+ * uses RING_SIZE) instead of being read back from the segment, and all offsets and record
+ * lengths found in the segment are checked against it.
+ */
+#define RING_MAGIC 0x52534357
+#define RING_VERSION 1
+/* Ring size in bytes per direction, must be a power of two */
+#define RING_SIZE (256 * 1024)
+/* Maximum payload length of a single record */
+#define RING_MESSAGE_MAX (RING_SIZE / 4)
+#define RING_RECORD_HEADER 8
+#define RING_ALIGN(a) (((a) + 7) & ~((uint64_t) 7))
+
+#define RING_TO_PEER 0
+#define RING_FROM_PEER 1
+
+typedef enum {
+	ring_padding = 0,
+	ring_text = 1,
+	ring_binary = 2
+} ring_record;
+
+/* Per-direction ring state, producer and consumer fields live on separate cache lines */
+typedef struct /*_ring_state*/ {
+	uint64_t head;
+	uint32_t producer_waiting;
+	uint8_t producer_pad[52];
+	uint64_t tail;
+	uint32_t consumer_waiting;
+	uint8_t consumer_pad[52];
+} ring_state;
+
+typedef struct /*_ring_segment*/ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint8_t pad[52];
+	ring_state ring[2];
+} ring_segment;
+
+#define RING_SEGMENT_SIZE(size) (sizeof(ring_segment) + 2 * (size))
+#define RING_DATA(segment, size, index) (((uint8_t*) (segment)) + sizeof(ring_segment) + (index) * (size))
+
+/* Bytes free for the producer, 0 if the ring state is inconsistent */
+static inline uint64_t ring_free(ring_segment* segment, uint64_t size, unsigned index){
+	ring_state* state = segment->ring + index;
+	uint64_t used = state->head - __atomic_load_n(&(state->tail), __ATOMIC_ACQUIRE);
+	return (used > size) ? 0 : size - used;
+}
+
+/* Append a record, returns 1 if there is not enough space or the ring state is inconsistent */
+static inline int ring_push(ring_segment* segment, uint64_t size, unsigned index, uint32_t type, const uint8_t* payload, uint32_t length){
+	ring_state* state = segment->ring + index;
+	uint8_t* data = RING_DATA(segment, size, index);
+	uint64_t head = state->head, record = RING_ALIGN(RING_RECORD_HEADER + (uint64_t) length);
+	uint64_t offset = head & (size - 1), pad = 0;
+	uint32_t header[2];
+
+	if(record > size || (offset & 7)){
+		return 1;
+	}
+
+	if(offset + record > size){
+		pad = size - offset;
+	}
+
+	if(ring_free(segment, size, index) < pad + record){
+		return 1;
+	}
+
+	if(pad){
+		header[0] = pad - RING_RECORD_HEADER;
+		header[1] = ring_padding;
+		memcpy(data + offset, header, sizeof(header));
+		head += pad;
+		offset = 0;
+	}
+
+	header[0] = length;
+	header[1] = type;
+	memcpy(data + offset, header, sizeof(header));
+	memcpy(data + offset + RING_RECORD_HEADER, payload, length);
+	__atomic_store_n(&(state->head), head + record, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Find the next record and its payload.
+ * Returns 0 if a record is available, 1 if the ring is empty and -1 if it is corrupted.
+ */
+static inline int ring_peek(ring_segment* segment, uint64_t size, unsigned index, uint8_t** payload, uint32_t* type, uint32_t* length){
+	ring_state* state = segment->ring + index;
+	uint8_t* data = RING_DATA(segment, size, index);
+	uint64_t head, tail = state->tail, offset;
+	uint32_t header[2];
+
+	for(head = __atomic_load_n(&(state->head), __ATOMIC_ACQUIRE); tail != head; head = __atomic_load_n(&(state->head), __ATOMIC_ACQUIRE)){
+		offset = tail & (size - 1);
+		//records start 8 byte aligned, so the header always lies within the ring
+		if(head - tail > size || (offset & 7)){
+			return -1;
+		}
+
+		memcpy(header, data + offset, sizeof(header));
+		if(header[0] > size - offset - RING_RECORD_HEADER){
+			return -1;
+		}
+
+		if(header[1] == ring_padding){
+			tail += size - offset;
+			__atomic_store_n(&(state->tail), tail, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		*payload = data + offset + RING_RECORD_HEADER;
+		*length = header[0];
+		*type = header[1];
+		return 0;
+	}
+	return 1;
+}
+
+/* Release the record returned by ring_peek */
+static inline void ring_consume(ring_segment* segment, unsigned index, uint32_t length){
+	ring_state* state = segment->ring + index;
+	__atomic_store_n(&(state->tail), state->tail + RING_ALIGN(RING_RECORD_HEADER + length), __ATOMIC_RELEASE);
+}
+
+/* Shared memory ring peer handling */
+int ring_attach(websocket* ws);
+void ring_detach(websocket* ws);
+int ring_send(websocket* ws, ws_operation opcode, uint8_t* data, size_t length);
+int ring_ready(websocket* ws);
+void ring_fds(fd_set* fds, int* max_fd);
+void ring_data(fd_set* fds);
+void ring_written(websocket* ws);
+void ring_cleanup();
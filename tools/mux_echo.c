@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "mux.h"
+
+/*
+ * Reference peer for multiplexed (`mux://`) connections.
+ * Echoes every data message back on the channel it was received on and immediately
+ * returns the consumed window to websocksy. A real peer should additionally track the
+ * window granted by websocksy and pause channels that have exhausted it.
+ */
+
+#define MAX_CONNECTIONS 64
+
+typedef struct /*_echo_connection*/ {
+	int fd;
+	uint8_t buffer[MUX_BUFFER_SIZE];
+	size_t offset;
+} echo_connection;
+
+static echo_connection conn[MAX_CONNECTIONS];
+
+static int send_all(int fd, uint8_t* data, size_t length){
+	ssize_t sent;
+	while(length){
+		sent = send(fd, data, length, MSG_NOSIGNAL);
+		if(sent < 0){
+			return 1;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+static int send_message(int fd, uint8_t* channel, mux_message type, uint8_t* data, size_t length){
+	uint8_t header[MUX_HEADER_LENGTH] = {
+		channel[0], channel[1], channel[2], channel[3],
+		type,
+		length >> 16, length >> 8, length
+	};
+	return send_all(fd, header, sizeof(header)) || send_all(fd, data, length);
+}
+
+/* Handle all complete messages in a connection buffer */
+static int handle_messages(echo_connection* c){
+	size_t offset = 0, length;
+	uint8_t* header, increment[4];
+
+	while(c->offset - offset >= MUX_HEADER_LENGTH){
+		header = c->buffer + offset;
+		length = (header[5] << 16) | (header[6] << 8) | header[7];
+		if(length > sizeof(c->buffer) - MUX_HEADER_LENGTH){
+			return 1;
+		}
+		if(c->offset - offset < MUX_HEADER_LENGTH + length){
+			break;
+		}
+
+		switch(header[4]){
+			case mux_open:
+				printf("Channel %02X%02X%02X%02X opened for %.*s\n", header[0], header[1], header[2], header[3], (int) length, header + MUX_HEADER_LENGTH);
+				break;
+			case mux_close:
+				printf("Channel %02X%02X%02X%02X closed\n", header[0], header[1], header[2], header[3]);
+				break;
+			case mux_binary:
+			case mux_text:
+				increment[0] = length >> 24;
+				increment[1] = length >> 16;
+				increment[2] = length >> 8;
+				increment[3] = length;
+				if(send_message(c->fd, header, header[4], header + MUX_HEADER_LENGTH, length)
+						|| send_message(c->fd, header, mux_window, increment, sizeof(increment))){
+					return 1;
+				}
+				break;
+			default:
+				break;
+		}
+		offset += MUX_HEADER_LENGTH + length;
+	}
+
+	memmove(c->buffer, c->buffer + offset, c->offset - offset);
+	c->offset -= offset;
+	return 0;
+}
+
+int main(int argc, char** argv){
+	struct pollfd fds[MAX_CONNECTIONS + 1];
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_ANY_INIT
+	};
+	int listen_fd, yes = 1;
+	size_t u;
+	ssize_t bytes;
+
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	addr.sin6_port = htons(strtoul(argv[1], NULL, 10));
+	listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if(listen_fd < 0
+			|| bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr))
+			|| listen(listen_fd, 16)){
+		fprintf(stderr, "Failed to listen on port %s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for(u = 0; u < MAX_CONNECTIONS; u++){
+		conn[u].fd = -1;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for(;;){
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for(u = 0; u < MAX_CONNECTIONS; u++){
+			fds[u + 1].fd = conn[u].fd;
+			fds[u + 1].events = POLLIN;
+		}
+
+		if(poll(fds, MAX_CONNECTIONS + 1, -1) < 0){
+			fprintf(stderr, "Failed to poll: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		if(fds[0].revents & POLLIN){
+			for(u = 0; u < MAX_CONNECTIONS && conn[u].fd >= 0; u++){
+			}
+			if(u < MAX_CONNECTIONS){
+				conn[u].fd = accept(listen_fd, NULL, NULL);
+				conn[u].offset = 0;
+			}
+		}
+
+		for(u = 0; u < MAX_CONNECTIONS; u++){
+			if(conn[u].fd >= 0 && fds[u + 1].fd == conn[u].fd && fds[u + 1].revents){
+				bytes = recv(conn[u].fd, conn[u].buffer + conn[u].offset, sizeof(conn[u].buffer) - conn[u].offset, 0);
+				if(bytes <= 0){
+					close(conn[u].fd);
+					conn[u].fd = -1;
+					continue;
+				}
+				conn[u].offset += bytes;
+				if(handle_messages(conn + u)){
+					close(conn[u].fd);
+					conn[u].fd = -1;
+				}
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Round trip benchmark for echoing peers behind websocksy, used to compare the `shm://` ring
+ * transport against `unix://` (both served by `ring_echo`). Connects to a route as WebSocket client,
+ * then measures the latency of single messages and the throughput with a window of messages in flight.
+ * Only payload bytes are counted, as stream peers may merge or split the echoed messages.
+ */
+
+#define BENCH_KEY "dGhlIHNhbXBsZSBub25jZQ=="
+#define BENCH_MAX_SIZE 16000
+#define BENCH_WINDOW 64
+#define BENCH_BUFFER (1024 * 1024)
+
+static int fd = -1;
+static uint8_t frame[BENCH_MAX_SIZE + 8];
+static size_t frame_length = 0;
+static uint8_t buffer[BENCH_BUFFER];
+static size_t buffer_offset = 0;
+
+static uint64_t bench_now(){
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int send_all(uint8_t* data, size_t length){
+	ssize_t sent;
+
+	while(length){
+		sent = send(fd, data, length, MSG_NOSIGNAL);
+		if(sent < 0){
+			return 1;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+/* Connect and upgrade to a WebSocket on the given path, returns 0 on success */
+static int bench_connect(char* host, char* port, char* path){
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct addrinfo* info = NULL;
+	char request[1024];
+	ssize_t bytes;
+	int length, yes = 1;
+
+	if(getaddrinfo(host, port, &hints, &info)){
+		fprintf(stderr, "Failed to resolve %s port %s\n", host, port);
+		return 1;
+	}
+
+	fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	if(fd < 0 || connect(fd, info->ai_addr, info->ai_addrlen)){
+		fprintf(stderr, "Failed to connect to %s port %s: %s\n", host, port, strerror(errno));
+		freeaddrinfo(info);
+		return 1;
+	}
+	freeaddrinfo(info);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(yes));
+
+	length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: " BENCH_KEY "\r\nSec-WebSocket-Version: 13\r\n\r\n", path, host);
+	if(length >= sizeof(request) || send_all((uint8_t*) request, length)){
+		fprintf(stderr, "Failed to send upgrade request\n");
+		return 1;
+	}
+
+	//read the response up to the end of the headers, any frame data following it is kept
+	while(!memmem(buffer, buffer_offset, "\r\n\r\n", 4)){
+		bytes = recv(fd, buffer + buffer_offset, sizeof(buffer) - buffer_offset, 0);
+		if(bytes <= 0){
+			fprintf(stderr, "Connection closed during upgrade\n");
+			return 1;
+		}
+		buffer_offset += bytes;
+	}
+
+	if(buffer_offset < 12 || memcmp(buffer + 9, "101", 3)){
+		fprintf(stderr, "Upgrade rejected: %.*s\n", (int) strcspn((char*) buffer, "\r"), (char*) buffer);
+		return 1;
+	}
+
+	length = (uint8_t*) memmem(buffer, buffer_offset, "\r\n\r\n", 4) - buffer + 4;
+	memmove(buffer, buffer + length, buffer_offset - length);
+	buffer_offset -= length;
+	return 0;
+}
+
+/* Prepare the masked binary frame sent for every message */
+static void bench_frame(size_t size){
+	size_t u, header = 2;
+
+	frame[0] = 0x82;
+	if(size < 126){
+		frame[1] = 0x80 | size;
+	}
+	else{
+		frame[1] = 0x80 | 126;
+		frame[2] = size >> 8;
+		frame[3] = size & 0xFF;
+		header = 4;
+	}
+
+	//a zero mask leaves the payload unchanged
+	memset(frame + header, 0, 4);
+	for(u = 0; u < size; u++){
+		frame[header + 4 + u] = u & 0xFF;
+	}
+	frame_length = header + 4 + size;
+}
+
+/* Read until at least `wanted` payload bytes were received, returns the number of bytes or 0 on failure */
+static size_t bench_receive(size_t wanted){
+	size_t received = 0, offset, header;
+	uint64_t length;
+	ssize_t bytes;
+
+	while(received < wanted){
+		bytes = recv(fd, buffer + buffer_offset, sizeof(buffer) - buffer_offset, 0);
+		if(bytes <= 0){
+			fprintf(stderr, "Connection closed\n");
+			return 0;
+		}
+		buffer_offset += bytes;
+
+		for(offset = 0; buffer_offset - offset >= 2; offset += header + length){
+			header = 2;
+			length = buffer[offset + 1] & 0x7F;
+			if(length == 126){
+				header = 4;
+				length = (buffer_offset - offset >= 4) ? (buffer[offset + 2] << 8) | buffer[offset + 3] : 0;
+			}
+			else if(length == 127){
+				header = 10;
+				length = (buffer_offset - offset >= 10) ? be64toh(*(uint64_t*) (buffer + offset + 2)) : 0;
+			}
+
+			if(buffer_offset - offset < header || buffer_offset - offset - header < length){
+				break;
+			}
+
+			if((buffer[offset] & 0x0F) == 0x08){
+				fprintf(stderr, "Connection closed by websocksy\n");
+				return 0;
+			}
+
+			//only data frames carry echoed payload
+			if((buffer[offset] & 0x0F) <= 0x02){
+				received += length;
+			}
+		}
+
+		memmove(buffer, buffer + offset, buffer_offset - offset);
+		buffer_offset -= offset;
+	}
+	return received;
+}
+
+static int compare_latency(const void* a, const void* b){
+	uint64_t first = *(uint64_t*) a, second = *(uint64_t*) b;
+	return (first > second) - (first < second);
+}
+
+static int usage(char* fn){
+	fprintf(stderr, "Usage: %s <host> <port> <path> [<messages> [<message size>]]\n", fn);
+	fprintf(stderr, "\tRun once against a shm:// route and once against a unix:// route to the same ring_echo\n");
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv){
+	size_t u, messages = (argc > 4) ? strtoul(argv[4], NULL, 10) : 10000;
+	size_t size = (argc > 5) ? strtoul(argv[5], NULL, 10) : 64;
+	size_t sent = 0, pending = 0, received;
+	uint64_t start, elapsed, sum = 0;
+	uint64_t* latency = NULL;
+
+	if(argc < 4 || !messages || !size || size > BENCH_MAX_SIZE){
+		return usage(argv[0]);
+	}
+
+	latency = calloc(messages, sizeof(uint64_t));
+	if(!latency || bench_connect(argv[1], argv[2], argv[3])){
+		free(latency);
+		return EXIT_FAILURE;
+	}
+	bench_frame(size);
+
+	//latency: one message in flight
+	for(u = 0; u < messages; u++){
+		start = bench_now();
+		if(send_all(frame, frame_length) || bench_receive(size) != size){
+			free(latency);
+			return EXIT_FAILURE;
+		}
+		latency[u] = bench_now() - start;
+		sum += latency[u];
+	}
+
+	qsort(latency, messages, sizeof(uint64_t), compare_latency);
+	printf("%s: %lu round trips of %lu bytes, mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			argv[3], messages, size, sum / 1000.0 / messages, latency[messages / 2] / 1000.0,
+			latency[messages * 99 / 100] / 1000.0, latency[messages - 1] / 1000.0);
+	free(latency);
+
+	//throughput: a window of messages in flight
+	start = bench_now();
+	while(sent < messages || pending){
+		for(; sent < messages && pending < BENCH_WINDOW * size; sent++){
+			if(send_all(frame, frame_length)){
+				return EXIT_FAILURE;
+			}
+			pending += size;
+		}
+
+		received = bench_receive(1);
+		if(!received){
+			return EXIT_FAILURE;
+		}
+		pending = (received > pending) ? 0 : pending - received;
+	}
+	elapsed = bench_now() - start;
+
+	printf("%s: %lu messages with %d in flight in %.1f ms, %.0f messages/s, %.1f MB/s\n",
+			argv[3], messages, BENCH_WINDOW, elapsed / 1000000.0, messages * 1000000000.0 / elapsed,
+			messages * size * 1000.0 / elapsed);
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "ring_peer.h"
+
+/*
+ * Reference peer for shared memory ring (`shm://`) connections.
+ * Forks a process for every connection, which echoes all messages back to the WebSocket.
+ * For comparison (e.g. using `ring_bench`), the same echo is optionally served on a
+ * plain Unix stream socket for `unix://` peers.
+ */
+
+static uint8_t buffer[RING_MESSAGE_MAX];
+
+/* Echo all data on plain Unix stream connections, forking a process for each */
+static void unix_echo(int listen_fd){
+	ssize_t length, sent, offset;
+	int fd;
+
+	while(1){
+		fd = accept(listen_fd, NULL, NULL);
+		if(fd < 0){
+			continue;
+		}
+
+		if(!fork()){
+			close(listen_fd);
+			for(length = read(fd, buffer, sizeof(buffer)); length > 0; length = read(fd, buffer, sizeof(buffer))){
+				for(offset = 0; offset < length; offset += sent){
+					sent = write(fd, buffer + offset, length - offset);
+					if(sent <= 0){
+						exit(EXIT_FAILURE);
+					}
+				}
+			}
+			exit(EXIT_SUCCESS);
+		}
+		close(fd);
+	}
+}
+
+int main(int argc, char** argv){
+	ring_peer peer;
+	ring_record type;
+	ssize_t length;
+	int listen_fd, unix_fd;
+
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s <socket path> [<unix echo socket path>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	listen_fd = ring_peer_listen(argv[1]);
+	if(listen_fd < 0){
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGCHLD, SIG_IGN);
+	if(argc > 2){
+		//the listening socket is set up the same way for both transports
+		unix_fd = ring_peer_listen(argv[2]);
+		if(unix_fd < 0){
+			return EXIT_FAILURE;
+		}
+
+		if(!fork()){
+			close(listen_fd);
+			unix_echo(unix_fd);
+		}
+		close(unix_fd);
+	}
+	while(1){
+		if(ring_peer_accept(listen_fd, &peer)){
+			ring_peer_close(&peer);
+			continue;
+		}
+
+		if(!fork()){
+			close(listen_fd);
+			fprintf(stderr, "Ring connection for %s\n", peer.endpoint);
+			for(length = ring_peer_read(&peer, buffer, sizeof(buffer), &type); length >= 0; length = ring_peer_read(&peer, buffer, sizeof(buffer), &type)){
+				if(ring_peer_write(&peer, buffer, length, type)){
+					break;
+				}
+			}
+			ring_peer_close(&peer);
+			exit(EXIT_SUCCESS);
+		}
+		ring_peer_close(&peer);
+	}
+	return EXIT_SUCCESS;
+}
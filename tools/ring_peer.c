@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring_peer.h"
+
+/* Hint to the CPU that we are busy-waiting */
+static inline void ring_peer_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* Grow the spin budget if spinning paid off, shrink it if we had to sleep anyway */
+static void ring_peer_adapt(ring_peer* peer, int success){
+	if(success){
+		peer->spin = (peer->spin * 2 > RING_PEER_SPIN_MAX) ? RING_PEER_SPIN_MAX : peer->spin * 2;
+	}
+	else{
+		peer->spin = (peer->spin / 2 < 16) ? 16 : peer->spin / 2;
+	}
+}
+
+static void ring_peer_signal(ring_peer* peer){
+	uint64_t value = 1;
+
+	if(write(peer->notify_core, &value, sizeof(value)) < 0 && errno != EAGAIN){
+		fprintf(stderr, "Failed to signal websocksy: %s\n", strerror(errno));
+	}
+}
+
+/* Sleep until websocksy signals, returns 1 if it closed the connection */
+static int ring_peer_sleep(ring_peer* peer){
+	uint64_t value;
+	struct pollfd fds[2] = {
+		{.fd = peer->notify_peer, .events = POLLIN},
+		{.fd = peer->socket_fd, .events = POLLIN}
+	};
+
+	if(poll(fds, 2, -1) < 0){
+		return (errno == EINTR) ? 0 : 1;
+	}
+
+	//websocksy does not send anything on the socket after the handshake
+	if(fds[1].revents){
+		return 1;
+	}
+
+	if(read(peer->notify_peer, &value, sizeof(value)) < 0 && errno != EAGAIN){
+		return 1;
+	}
+	return 0;
+}
+
+int ring_peer_listen(char* path){
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX
+	};
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if(fd < 0 || strlen(path) >= sizeof(addr.sun_path)){
+		fprintf(stderr, "Failed to create socket for %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+	if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)){
+		fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int ring_peer_accept(int listen_fd, ring_peer* peer){
+	int fds[3];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {
+		.iov_base = peer->endpoint,
+		.iov_len = sizeof(peer->endpoint) - 1
+	};
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	struct cmsghdr* cmsg = NULL;
+	struct stat info;
+	ssize_t bytes;
+
+	peer->notify_peer = peer->notify_core = -1;
+	peer->segment = NULL;
+	peer->spin = RING_PEER_SPIN_MAX / 16;
+
+	peer->socket_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if(peer->socket_fd < 0){
+		fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+		return 1;
+	}
+
+	bytes = recvmsg(peer->socket_fd, &message, MSG_CMSG_CLOEXEC);
+	cmsg = (bytes >= 0) ? CMSG_FIRSTHDR(&message) : NULL;
+	if(!cmsg
+			|| cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(sizeof(fds))){
+		fprintf(stderr, "Failed to receive ring descriptors\n");
+		return 1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	peer->endpoint[bytes] = 0;
+	peer->notify_peer = fds[1];
+	peer->notify_core = fds[2];
+
+	if(fstat(fds[0], &info) || info.st_size < sizeof(ring_segment)){
+		fprintf(stderr, "Invalid ring segment\n");
+		close(fds[0]);
+		return 1;
+	}
+
+	peer->segment_size = info.st_size;
+	peer->segment = mmap(NULL, peer->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if(peer->segment == MAP_FAILED){
+		fprintf(stderr, "Failed to map ring segment: %s\n", strerror(errno));
+		peer->segment = NULL;
+		return 1;
+	}
+
+	peer->size = peer->segment->size;
+	if(peer->segment->magic != RING_MAGIC
+			|| peer->segment->version != RING_VERSION
+			|| peer->size < 2 * RING_RECORD_HEADER
+			|| (peer->size & (peer->size - 1))
+			|| RING_SEGMENT_SIZE(peer->size) > peer->segment_size){
+		fprintf(stderr, "Ring segment version or size mismatch\n");
+		return 1;
+	}
+	return 0;
+}
+
+ssize_t ring_peer_read(ring_peer* peer, uint8_t* buffer, size_t length, ring_record* type){
+	ring_state* state = peer->segment->ring + RING_TO_PEER;
+	uint8_t* payload = NULL;
+	uint32_t record_type, record_length;
+	unsigned u;
+	int status;
+
+	while(1){
+		for(u = 0; u <= peer->spin; u++){
+			status = ring_peek(peer->segment, peer->size, RING_TO_PEER, &payload, &record_type, &record_length);
+			if(status != 1){
+				break;
+			}
+			ring_peer_relax();
+		}
+
+		if(status != 1){
+			if(u){
+				ring_peer_adapt(peer, 1);
+			}
+			break;
+		}
+		ring_peer_adapt(peer, 0);
+
+		//announce that we are about to sleep, then check again before doing so
+		__atomic_store_n(&(state->consumer_waiting), 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		status = ring_peek(peer->segment, peer->size, RING_TO_PEER, &payload, &record_type, &record_length);
+		if(status == 1 && ring_peer_sleep(peer)){
+			return -1;
+		}
+		__atomic_store_n(&(state->consumer_waiting), 0, __ATOMIC_RELAXED);
+		if(status != 1){
+			break;
+		}
+	}
+
+	if(status < 0 || record_length > length){
+		return -1;
+	}
+
+	memcpy(buffer, payload, record_length);
+	*type = record_type;
+	ring_consume(peer->segment, RING_TO_PEER, record_length);
+
+	//websocksy may be waiting for space
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(state->producer_waiting), __ATOMIC_RELAXED)){
+		ring_peer_signal(peer);
+	}
+	return record_length;
+}
+
+int ring_peer_write(ring_peer* peer, uint8_t* data, size_t length, ring_record type){
+	ring_state* state = peer->segment->ring + RING_FROM_PEER;
+	unsigned u;
+	int status = 1;
+
+	if(length > RING_MESSAGE_MAX){
+		return 1;
+	}
+
+	while(status){
+		for(u = 0; u <= peer->spin && (status = ring_push(peer->segment, peer->size, RING_FROM_PEER, type, data, length)); u++){
+			ring_peer_relax();
+		}
+
+		if(!status){
+			if(u){
+				ring_peer_adapt(peer, 1);
+			}
+			break;
+		}
+		ring_peer_adapt(peer, 0);
+
+		//wait for websocksy to consume data
+		__atomic_store_n(&(state->producer_waiting), 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		status = ring_push(peer->segment, peer->size, RING_FROM_PEER, type, data, length);
+		if(status && ring_peer_sleep(peer)){
+			return 1;
+		}
+		__atomic_store_n(&(state->producer_waiting), 0, __ATOMIC_RELAXED);
+	}
+
+	//only wake up websocksy if it waits for data
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(state->consumer_waiting), __ATOMIC_RELAXED)){
+		ring_peer_signal(peer);
+	}
+	return 0;
+}
+
+void ring_peer_close(ring_peer* peer){
+	if(peer->segment){
+		munmap(peer->segment, peer->segment_size);
+		peer->segment = NULL;
+	}
+	if(peer->notify_peer >= 0){
+		close(peer->notify_peer);
+		peer->notify_peer = -1;
+	}
+	if(peer->notify_core >= 0){
+		close(peer->notify_core);
+		peer->notify_core = -1;
+	}
+	if(peer->socket_fd >= 0){
+		close(peer->socket_fd);
+		peer->socket_fd = -1;
+	}
+}
@@ -0,0 +1,39 @@
+#include "ring.h"
+
+/*
+ * Client library for `shm://` peers.
+ *
+ * A peer listens on a Unix stream socket and accepts one connection per WebSocket. Messages
+ * are then exchanged through the shared memory rings passed by websocksy. Blocking calls spin
+ * for a while before sleeping on the eventfd; the spin budget adapts to whether spinning
+ * recently paid off.
+ */
+
+/* Maximum number of polls before a blocking call sleeps */
+#define RING_PEER_SPIN_MAX 16384
+
+typedef struct /*_ring_peer*/ {
+	int socket_fd;
+	int notify_peer;
+	int notify_core;
+	ring_segment* segment;
+	size_t segment_size;
+	/* Ring size, validated once after mapping as the segment may be modified */
+	uint64_t size;
+	unsigned spin;
+	/* Request endpoint of the WebSocket */
+	char endpoint[WS_HTTP_ARENA];
+} ring_peer;
+
+/* Create the listening socket */
+int ring_peer_listen(char* path);
+/* Accept a connection and map its rings, returns 0 on success */
+int ring_peer_accept(int listen_fd, ring_peer* peer);
+/*
+ * Wait for the next message and copy it to `buffer`.
+ * Returns the message length, or -1 if the connection was closed or the message does not fit.
+ */
+ssize_t ring_peer_read(ring_peer* peer, uint8_t* buffer, size_t length, ring_record* type);
+/* Send a message, waiting for space if necessary. Returns 0 on success */
+int ring_peer_write(ring_peer* peer, uint8_t* data, size_t length, ring_record type);
+void ring_peer_close(ring_peer* peer);
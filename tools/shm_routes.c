@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "plugins/backend_shm.h"
+
+/*
+ * Maintain a shared memory routing table for the `shm` backend.
+ * Concurrent writers are serialized with an exclusive lock on the segment.
+ */
+
+static shm_routes_header* table = NULL;
+
+static int usage(char* fn){
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "\t%s <name> create <slots>\n", fn);
+	fprintf(stderr, "\t%s <name> set <key> <peer> [<protocol> [<framing> [<framing-config>]]]\n", fn);
+	fprintf(stderr, "\t%s <name> delete <key>\n", fn);
+	fprintf(stderr, "\t%s <name> load\t\tRead `set`/`delete` commands from stdin\n", fn);
+	fprintf(stderr, "\t%s <name> list\n", fn);
+	fprintf(stderr, "\t%s <name> remove\n", fn);
+	return EXIT_FAILURE;
+}
+
+/* Find the slot for a key within a table, or the first free slot if it does not exist */
+static shm_route* route_find(shm_route* entries, char* key, uint32_t hash, int for_insert){
+	size_t u, slot;
+	shm_route* free_slot = NULL;
+
+	for(u = 0; u < table->slots; u++){
+		slot = (hash + u) % table->slots;
+		if(entries[slot].state == shm_route_empty){
+			return for_insert ? (free_slot ? free_slot : entries + slot) : NULL;
+		}
+		else if(entries[slot].state == shm_route_deleted){
+			free_slot = free_slot ? free_slot : entries + slot;
+		}
+		else if(entries[slot].hash == hash && !strncmp(entries[slot].key, key, SHM_ROUTE_KEY)){
+			return entries + slot;
+		}
+	}
+	return for_insert ? free_slot : NULL;
+}
+
+/* Apply a change to one table while its sequence counter is odd */
+static int route_apply(uint32_t index, shm_route* route, int delete){
+	shm_route* slot = route_find(SHM_ROUTES_TABLE(table, table->slots, index), route->key, route->hash, !delete);
+
+	if(!slot){
+		return delete ? 0 : 1;
+	}
+
+	__atomic_fetch_add(table->sequence + index, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if(delete){
+		slot->state = shm_route_deleted;
+	}
+	else{
+		memcpy(slot, route, sizeof(shm_route));
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_fetch_add(table->sequence + index, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Update the inactive table, make it active and update the other one */
+static int route_update(shm_route* route, int delete){
+	uint32_t inactive = (__atomic_load_n(&(table->active), __ATOMIC_RELAXED) & 1) ^ 1;
+
+	if(route_apply(inactive, route, delete)){
+		fprintf(stderr, "Routing table full\n");
+		return 1;
+	}
+	__atomic_store_n(&(table->active), inactive, __ATOMIC_RELEASE);
+	return route_apply(inactive ^ 1, route, delete);
+}
+
+/* Parse a command into a route and apply it */
+static int route_command(int argc, char** argv){
+	shm_route route = {
+		.state = shm_route_used
+	};
+	size_t limits[] = {SHM_ROUTE_KEY, SHM_ROUTE_HOST, SHM_ROUTE_PROTOCOL, SHM_ROUTE_FRAMING, SHM_ROUTE_FRAMING_CONFIG};
+	char* targets[] = {route.key, route.host, route.protocol, route.framing, route.framing_config};
+	int u;
+
+	if(argc < 2 || (!strcmp(argv[0], "set") && argc < 3)){
+		fprintf(stderr, "Missing arguments for %s\n", argv[0]);
+		return 1;
+	}
+
+	for(u = 1; u < argc && u <= 5; u++){
+		if(strlen(argv[u]) >= limits[u - 1]){
+			fprintf(stderr, "Value %s exceeds the maximum length of %lu\n", argv[u], limits[u - 1] - 1);
+			return 1;
+		}
+		strncpy(targets[u - 1], argv[u], limits[u - 1] - 1);
+	}
+
+	//routes without a subprotocol accept any
+	if(!route.protocol[0]){
+		strcpy(route.protocol, "*");
+	}
+	route.hash = shm_route_hash(route.key, strlen(route.key));
+
+	if(!strcmp(argv[0], "set")){
+		return route_update(&route, 0);
+	}
+	else if(!strcmp(argv[0], "delete")){
+		return route_update(&route, 1);
+	}
+
+	fprintf(stderr, "Unknown command %s\n", argv[0]);
+	return 1;
+}
+
+/* Read commands from stdin, one per line with space-separated arguments */
+static int route_load(){
+	char* line = NULL, *argv[6], *token;
+	size_t line_alloc = 0, line_no = 0;
+	ssize_t length;
+	int argc, rv = 0;
+
+	for(length = getline(&line, &line_alloc, stdin); length >= 0; length = getline(&line, &line_alloc, stdin)){
+		line_no++;
+		for(argc = 0, token = strtok(line, " \t\r\n"); token && argc < 6; token = strtok(NULL, " \t\r\n")){
+			argv[argc++] = token;
+		}
+
+		if(argc && route_command(argc, argv)){
+			fprintf(stderr, "Failed to apply line %lu\n", line_no);
+			rv = 1;
+		}
+	}
+
+	free(line);
+	return rv;
+}
+
+static void route_list(){
+	uint32_t active = table->active & 1;
+	shm_route* entries = SHM_ROUTES_TABLE(table, table->slots, active);
+	size_t u;
+
+	for(u = 0; u < table->slots; u++){
+		if(entries[u].state == shm_route_used){
+			printf("%s %s %s %s %s\n", entries[u].key, entries[u].host, entries[u].protocol, entries[u].framing, entries[u].framing_config);
+		}
+	}
+}
+
+/* Create and initialize a new table segment */
+static int table_create(char* name, size_t slots){
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+	if(fd < 0){
+		fprintf(stderr, "Failed to create %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	if(!slots || ftruncate(fd, SHM_ROUTES_SIZE(slots))){
+		fprintf(stderr, "Failed to size %s\n", name);
+		close(fd);
+		shm_unlink(name);
+		return 1;
+	}
+
+	table = mmap(NULL, SHM_ROUTES_SIZE(slots), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(table == MAP_FAILED){
+		fprintf(stderr, "Failed to map %s: %s\n", name, strerror(errno));
+		shm_unlink(name);
+		return 1;
+	}
+
+	//the segment is zero-filled, so all slots are empty
+	table->slots = slots;
+	table->version = SHM_ROUTES_VERSION;
+	__atomic_store_n(&(table->magic), SHM_ROUTES_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Map an existing table and lock it against other writers */
+static int table_open(char* name){
+	struct stat info;
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+
+	if(fd < 0){
+		fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	//the lock is held until the process exits
+	if(flock(fd, LOCK_EX) || fstat(fd, &info) || info.st_size < sizeof(shm_routes_header)){
+		fprintf(stderr, "Failed to lock %s\n", name);
+		close(fd);
+		return 1;
+	}
+
+	table = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(table == MAP_FAILED){
+		fprintf(stderr, "Failed to map %s: %s\n", name, strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	if(table->magic != SHM_ROUTES_MAGIC
+			|| table->version != SHM_ROUTES_VERSION
+			|| SHM_ROUTES_SIZE(table->slots) > info.st_size){
+		fprintf(stderr, "%s does not contain a valid routing table\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+/* Mark a table as retired, so readers map its replacement, then remove it */
+static int table_remove(char* name){
+	//segments that do not contain a valid table are removed anyway
+	if(!table_open(name)){
+		__atomic_store_n(&(table->retired), 1, __ATOMIC_RELEASE);
+	}
+
+	if(shm_unlink(name)){
+		fprintf(stderr, "Failed to remove %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv){
+	if(argc < 3){
+		return usage(argv[0]);
+	}
+
+	if(!strcmp(argv[2], "create")){
+		return (argc < 4 || table_create(argv[1], strtoul(argv[3], NULL, 10))) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	else if(!strcmp(argv[2], "remove")){
+		return table_remove(argv[1]) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if(table_open(argv[1])){
+		return EXIT_FAILURE;
+	}
+
+	if(!strcmp(argv[2], "list")){
+		route_list();
+		return EXIT_SUCCESS;
+	}
+	else if(!strcmp(argv[2], "load")){
+		return route_load() ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	else if(!strcmp(argv[2], "set") || !strcmp(argv[2], "delete")){
+		return route_command(argc - 2, argv + 2) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	return usage(argv[0]);
+}
@@ -0,0 +1,35 @@
+#ifndef WEBSOCKSY_TRACE_INCLUDED
+#define WEBSOCKSY_TRACE_INCLUDED
+
+/*
+ * Static tracepoints (USDT) for attaching bpftrace, perf or SystemTap to a running websocksy.
+ * Probes are compiled in whenever `sys/sdt.h` (usually shipped as `systemtap-sdt-dev(el)`) is available
+ * and cost a single NOP each until a tracer attaches. Without the header, or when building with
+ * `make USDT=0`, they expand to nothing, without evaluating their arguments.
+ * All probes belong to the provider `websocksy` and carry the connection id as first argument:
+ *
+ * 	* accept(id, fd)
+ * 	* handshake_complete(id, path, resumed)
+ * 	* backend_query_start(id, path)
+ * 	* backend_query_end(id, host)
+ * 	* peer_connect(id, transport, result)
+ * 	* frame_in(id, opcode, bytes)
+ * 	* frame_out(id, opcode, bytes)
+ * 	* framing_call(id, bytes)
+ * 	* framing_return(id, framed)
+ * 	* close(id, code)
+ *
+ * Example scripts can be found in `tools/trace/`.
+ */
+#if !defined(WEBSOCKSY_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE(probe, ...) STAP_PROBEV(websocksy, probe, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef TRACE
+#define TRACE(probe, ...) do{}while(0)
+#endif
+
+#endif
@@ -1,16 +1,65 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <time.h>
 #include <ctype.h>
 #include <errno.h>
+#include <nettle/version.h>
 
 #include "websocket.h"
 #include "network.h"
+#include "mux.h"
+#include "broadcast.h"
+#include "group.h"
+#include "breaker.h"
+#include "reconnect.h"
+#include "resume.h"
+#include "ring.h"
+#include "exec.h"
+#include "memory.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* The SHA-1 compression function is only part of the public nettle API since 3.8 */
+#if NETTLE_VERSION_MAJOR > 3 || (NETTLE_VERSION_MAJOR == 3 && NETTLE_VERSION_MINOR >= 8)
+#define WS_SHA1_COMPRESS 1
+#else
+#define WS_SHA1_COMPRESS 0
+#endif
 
 #define RFC6455_MAGIC_KEY "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-#define WS_FRAME_HEADER_LEN 16
+/* Maximum number of queued frames written per call */
+#define WS_FLUSH_BATCH 64
+/* Maximum number of buffers collected for one write to the peer */
+#define WS_PEER_BATCH 64
+/* Maximum payload moved per spliced frame, the default pipe capacity */
+#define WS_SPLICE_MAX 65536
+/* Time in seconds the kernel may spend delivering the zero-copy sends of a closed connection before aborting it */
+#define WS_ZEROCOPY_LINGER 30
+
+/* Pre-templated HTTP responses, completed with the connection-specific fields */
+#define WS_HTTP_UPGRADE "HTTP/1.1 101 Upgrading\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+#define WS_HTTP_PROTOCOL "\r\nSec-WebSocket-Protocol: "
+#define WS_HTTP_COOKIE "\r\nSet-Cookie: "
+#define WS_HTTP_COOKIE_PATH "; Path="
+#define WS_HTTP_COOKIE_ATTRIBUTES "; HttpOnly"
+#define WS_HTTP_ERROR "HTTP/1.1 "
+#define WS_HTTP_END "\r\n\r\n"
+
+/* Length of the base64-encoded SHA-1 accept key */
+#define WS_ACCEPT_KEY_LENGTH 28
+/* Length of a RFC 4.1 client key (base64 of a 16 byte nonce) */
+#define WS_CLIENT_KEY_LENGTH 24
 
 #define WS_FLAG_FIN 0x80
 #define WS_GET_FIN(a) (((a) & WS_FLAG_FIN) >> 7)
@@ -19,36 +68,261 @@
 #define WS_GET_MASK(a) (((a) & 0x80) >> 7)
 #define WS_GET_LEN(a) ((a) & 0x7F)
 
+/* Client messages for the peer, collected while handling one read buffer */
+static struct iovec peer_batch[WS_PEER_BATCH];
+static size_t peer_batch_entries = 0;
+static size_t peer_batch_messages = 0;
+/* Length prefixes for inbound framing, referenced from the batch */
+static uint32_t peer_batch_prefix[WS_PEER_BATCH];
+
+/* Minimum queued frame size to be sent with MSG_ZEROCOPY, 0 disables zero-copy sends */
+static size_t zerocopy_threshold = 0;
+
+/* Closed client sockets kept open until the kernel reports completion of their zero-copy sends */
+typedef struct /*_ws_zerocopy_socket*/ {
+	int fd;
+	ws_buffer** buffer;
+	size_t entries;
+	uint32_t base;
+} ws_zerocopy_socket;
+
+static size_t lingering = 0;
+static ws_zerocopy_socket* linger = NULL;
+
+/* Id of the most recently accepted connection */
+static uint64_t last_id = 0;
+
+/* Pipe used to splice peer data into client sockets, empty between calls */
+static int splice_pipe[2] = {-1, -1};
+
+/* Configure zero-copy sends for queued frames of at least `threshold` bytes, 0 disables them */
+void ws_zerocopy_init(size_t threshold){
+	zerocopy_threshold = threshold;
+}
+
+/*
+ * Read zero-copy completion notifications from a socket error queue and release the finished buffers
+ * of the sends `base` to `base + entries - 1`. Clears `zerocopy` if the kernel copied the data anyway.
+ * Returns the number of entries still listed.
+ */
+static size_t ws_zerocopy_reap(int fd, ws_buffer** buffer, size_t entries, uint32_t* base, int* zerocopy){
+	uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	struct msghdr message;
+	struct cmsghdr* cmsg = NULL;
+	struct sock_extended_err* error = NULL;
+	uint32_t id;
+	size_t done, index;
+
+	while(entries){
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if(recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+			break;
+		}
+
+		for(cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)){
+			if((cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+					&& (cmsg->cmsg_level != SOL_IPV6 || cmsg->cmsg_type != IPV6_RECVERR)){
+				continue;
+			}
+
+			error = (struct sock_extended_err*) CMSG_DATA(cmsg);
+			if(error->ee_errno || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+				continue;
+			}
+
+			//the kernel had to copy the data anyway, so stop paying for the completion tracking
+			if(error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+				*zerocopy = 0;
+			}
+
+			//notifications cover the range of send calls from ee_info to ee_data
+			for(id = error->ee_info; id != error->ee_data + 1; id++){
+				index = id - *base;
+				if(index < entries && buffer[index]){
+					ws_buffer_release(buffer[index]);
+					buffer[index] = NULL;
+				}
+			}
+		}
+	}
+
+	//drop completed sends from the front of the list
+	for(done = 0; done < entries && !buffer[done]; done++){
+	}
+	memmove(buffer, buffer + done, (entries - done) * sizeof(ws_buffer*));
+	*base += done;
+	return entries - done;
+}
+
+/* Release the buffers of all zero-copy sends on a connection the kernel reported as complete */
+static void ws_zerocopy_complete(websocket* ws){
+	ws->zerocopy_entries = ws_zerocopy_reap(ws->ws_fd, ws->zerocopy_buffer, ws->zerocopy_entries, &(ws->zerocopy_base), &(ws->zerocopy));
+}
+
+/* Hold a reference to a buffer passed to a zero-copy send until its completion is reported */
+static int ws_zerocopy_track(websocket* ws, ws_buffer* buffer){
+	ws_buffer** list = realloc(ws->zerocopy_buffer, (ws->zerocopy_entries + 1) * sizeof(ws_buffer*));
+
+	if(!list){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return 1;
+	}
+	ws->zerocopy_buffer = list;
+
+	buffer->references++;
+	ws->zerocopy_buffer[ws->zerocopy_entries] = buffer;
+	ws->zerocopy_entries++;
+	return 0;
+}
+
+/*
+ * Detach the zero-copy state from a closing connection.
+ * The kernel may read buffers passed to zero-copy sends until it reports their completion, even after
+ * the socket is closed, so sockets with unfinished sends are shut down and kept open on the linger list
+ * until all notifications have arrived. Returns 1 if the socket can be closed right away.
+ */
+static int ws_zerocopy_detach(websocket* ws){
+	ws_zerocopy_socket* list = NULL;
+	unsigned timeout = WS_ZEROCOPY_LINGER * 1000;
+	int close_fd = 1;
+
+	if(ws->zerocopy_entries){
+		ws_zerocopy_complete(ws);
+	}
+
+	if(ws->zerocopy_entries){
+		list = realloc(linger, (lingering + 1) * sizeof(ws_zerocopy_socket));
+		if(!list){
+			//leak the buffers rather than reusing memory the kernel may still send from
+			LOG(log_core, log_error, "Failed to allocate memory, dropping %lu unfinished zero-copy buffers\n", ws->zerocopy_entries);
+			ws->zerocopy_entries = 0;
+		}
+		else{
+			linger = list;
+			//bound the time the kernel keeps retransmitting to an unresponsive client
+			shutdown(ws->ws_fd, SHUT_RDWR);
+			setsockopt(ws->ws_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (void*)&timeout, sizeof(timeout));
+			linger[lingering].fd = ws->ws_fd;
+			linger[lingering].buffer = ws->zerocopy_buffer;
+			linger[lingering].entries = ws->zerocopy_entries;
+			linger[lingering].base = ws->zerocopy_base;
+			lingering++;
+			ws->zerocopy_buffer = NULL;
+			close_fd = 0;
+		}
+	}
+
+	free(ws->zerocopy_buffer);
+	ws->zerocopy_buffer = NULL;
+	ws->zerocopy_entries = 0;
+	ws->zerocopy_base = 0;
+	ws->zerocopy = 0;
+	return close_fd;
+}
+
+/*
+ * Release the buffers of lingering sockets whose zero-copy sends have completed and close them.
+ * Returns the number of sockets still waiting for completions.
+ */
+size_t ws_zerocopy_maintain(){
+	size_t u;
+	int zerocopy = 0;
+
+	for(u = 0; u < lingering; u++){
+		linger[u].entries = ws_zerocopy_reap(linger[u].fd, linger[u].buffer, linger[u].entries, &(linger[u].base), &zerocopy);
+		if(!linger[u].entries){
+			close(linger[u].fd);
+			free(linger[u].buffer);
+			linger[u] = linger[lingering - 1];
+			lingering--;
+			u--;
+		}
+	}
+	return lingering;
+}
+
+/* Close all lingering sockets on shutdown */
+void ws_zerocopy_cleanup(){
+	size_t u, p;
+
+	for(u = 0; u < lingering; u++){
+		close(linger[u].fd);
+		for(p = 0; p < linger[u].entries; p++){
+			if(linger[u].buffer[p]){
+				ws_buffer_release(linger[u].buffer[p]);
+			}
+		}
+		free(linger[u].buffer);
+	}
+	free(linger);
+	linger = NULL;
+	lingering = 0;
+}
+
 /* 
  * Close and shut down a WebSocket connection, including a connected
  * peer stream. Frees all resources associated with either connection.
  */
 int ws_close(websocket* ws, ws_close_reason code, char* reason){
-	size_t p;
+	char response[WS_MAX_LINE];
+	size_t response_length = 0;
 	ws_peer_info empty_peer = {
 		0
 	};
 
+	TRACE(close, ws->id, code);
+	if(ws->state == ws_new || ws->state == ws_http){
+		metrics_handshake_failed((code == ws_close_http) ? reason : NULL);
+	}
+
 	if(ws->state == ws_open && reason){
-		//send close frame
-		//FIXME this should prepend the status code to the reason
-		ws_send_frame(ws, ws_frame_close, (uint8_t*) reason, strlen(reason));
+		//deliver what the socket accepts without waiting, then send close frame unless the socket is stuck in the middle of a frame
+		ws_flush(ws);
+		if(!ws->queue_offset){
+			//FIXME this should prepend the status code to the reason
+			ws_queue_clear(ws);
+			ws_send_frame(ws, ws_frame_close, (uint8_t*) reason, strlen(reason));
+		}
 	}
 	else if(ws->state == ws_http
 			&& code == ws_close_http
-			&& reason){
+			&& reason
+			&& strlen(reason) < sizeof(response) - sizeof(WS_HTTP_ERROR) - sizeof(WS_HTTP_END)){
 		//send http response
-		network_send_str(ws->ws_fd, "HTTP/1.1 ");
-		network_send_str(ws->ws_fd, reason);
-		network_send_str(ws->ws_fd, "\r\n\r\n");
+		memcpy(response, WS_HTTP_ERROR, sizeof(WS_HTTP_ERROR) - 1);
+		response_length = sizeof(WS_HTTP_ERROR) - 1;
+		memcpy(response + response_length, reason, strlen(reason));
+		response_length += strlen(reason);
+		memcpy(response + response_length, WS_HTTP_END, sizeof(WS_HTTP_END) - 1);
+		response_length += sizeof(WS_HTTP_END) - 1;
+		network_send(ws->ws_fd, (uint8_t*) response, response_length);
 	}
 	ws->state = ws_closed;
+	ws_queue_clear(ws);
 
-	if(ws->ws_fd >= 0){
+	if(ws->ws_fd >= 0 && ws_zerocopy_detach(ws)){
 		close(ws->ws_fd);
-		ws->ws_fd = -1;
 	}
+	ws->ws_fd = -1;
 
+	if(ws->peer.transport == peer_mux){
+		mux_detach(ws);
+	}
+	else if(ws->peer.transport == peer_broadcast){
+		broadcast_detach(ws);
+	}
+	else if(ws->peer.transport == peer_shm){
+		ring_detach(ws);
+	}
+	else if(ws->peer.transport == peer_exec){
+		exec_detach(ws);
+	}
+	group_release(ws);
+	reconnect_release(ws);
+
+	network_backlog_clear(&(ws->peer_backlog));
 	if(ws->peer_fd >= 0){
 		close(ws->peer_fd);
 		ws->peer_fd = -1;
@@ -59,138 +333,265 @@ int ws_close(websocket* ws, ws_close_reason code, char* reason){
 		}
 	}
 
-	for(p = 0; p < ws->headers; p++){
-		free(ws->header[p].tag);
-		ws->header[p].tag = NULL;
-		free(ws->header[p].value);
-		ws->header[p].value = NULL;
-	}
+	//all request data lives in the arena, which is kept for the next connection in this slot
 	ws->headers = 0;
-
-	for(p = 0; p < ws->protocols; p++){
-		free(ws->protocol[p]);
-	}
-	free(ws->protocol);
-	ws->protocol = NULL;
 	ws->protocols = 0;
+	ws->request_path = NULL;
+	ws->socket_key = NULL;
+	ws->http_arena_offset = 0;
 
 	ws->read_buffer_offset = 0;
 	ws->peer_buffer_offset = 0;
 
-	free(ws->request_path);
-	ws->request_path = NULL;
-
-	free(ws->socket_key);
-	ws->socket_key = NULL;
-
 	ws->websocket_version = 0;
 	ws->want_upgrade = 0;
 
-	free(ws->peer.host);
-	free(ws->peer.port);
-	free(ws->peer.framing_config);
+	if(!ws->peer.persistent){
+		free(ws->peer.host);
+		free(ws->peer.port);
+		free(ws->peer.framing_config);
+	}
 	ws->peer = empty_peer;
 
 	return 0;
 }
 
-/* Accept a new WebSocket connection */
-int ws_accept(int listen_fd, time_t current_time){
+/* Accept up to `budget` pending WebSocket connections */
+int ws_accept(int listen_fd, size_t budget, time_t current_time){
+	size_t u;
+	int yes = 1;
 	websocket ws = {
-		.ws_fd = accept(listen_fd, NULL, NULL),
+		.ws_fd = -1,
 		.peer_fd = -1,
-		.last_event = current_time
+		.last_event = current_time,
+		.accepted = current_time
 	};
 
-	return client_register(&ws);
+	for(u = 0; u < budget; u++){
+		ws.ws_fd = network_accept(listen_fd);
+		if(ws.ws_fd < 0){
+			break;
+		}
+
+		ws.id = ++last_id;
+		TRACE(accept, ws.id, ws.ws_fd);
+		ws.zerocopy = zerocopy_threshold && !setsockopt(ws.ws_fd, SOL_SOCKET, SO_ZEROCOPY, (void*)&yes, sizeof(yes));
+		metrics_accepted();
+
+		if(client_register(&ws)){
+			return 1;
+		}
+	}
+	return 0;
 }
 
-/* Handle data in the NEW state (expecting a HTTP negotiation) */
-static int ws_handle_new(websocket* ws){
-	size_t u;
-	char* path, *proto;
+/*
+ * Copy request data into the per-connection arena and terminate it.
+ * Returns NULL if the arena is exhausted.
+ */
+static char* ws_arena_store(websocket* ws, char* data, size_t length){
+	char* stored = NULL;
 
-	if(!strncmp((char*) ws->read_buffer, "GET ", 4)){
-		path = (char*) ws->read_buffer + 4;
-		for(u = 0; path[u] && !isspace(path[u]); u++){
+	if(!ws->http_arena){
+		ws->http_arena = malloc(WS_HTTP_ARENA);
+		if(!ws->http_arena){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return NULL;
 		}
-		path[u] = 0;
-		proto = path + u + 1;
+		memory_account(memory_requests, WS_HTTP_ARENA);
 	}
+
+	if(ws->http_arena_offset + length + 1 > WS_HTTP_ARENA){
+		return NULL;
+	}
+
+	stored = ws->http_arena + ws->http_arena_offset;
+	memcpy(stored, data, length);
+	stored[length] = 0;
+	ws->http_arena_offset += length + 1;
+	return stored;
+}
+
+/* Handle data in the NEW state (expecting a HTTP negotiation) */
+static int ws_handle_new(websocket* ws, char* line, size_t length){
+	size_t u;
+
 	//TODO handle other methods
-	else{
-		fprintf(stderr, "Unknown HTTP method in request\n");
+	if(length < 4 || strncmp(line, "GET ", 4)){
+		LOG(log_http, log_warn, "Unknown HTTP method in request\n");
 		return 1;
 	}
 
-	if(strncmp(proto, "HTTP/", 5)){
-		fprintf(stderr, "Malformed HTTP initiation\n");
+	for(u = 4; u < length && !isspace(line[u]); u++){
+	}
+
+	if(length - u < 6 || strncmp(line + u + 1, "HTTP/", 5)){
+		LOG(log_http, log_warn, "Malformed HTTP initiation\n");
+		return 1;
+	}
+
+	ws->request_path = ws_arena_store(ws, line + 4, u - 4);
+	if(!ws->request_path){
+		LOG(log_http, log_warn, "Request path exceeds limit\n");
 		return 1;
 	}
 
 	ws->state = ws_http;
-	ws->request_path = strdup(path);
 	return 0;
 }
 
+/* Encode a SHA-1 digest to base64, unrolled for the fixed digest length */
+static void ws_accept_encode(uint8_t* digest, char* out){
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t u;
+	uint32_t group;
+
+	//6 full groups of 3 bytes
+	for(u = 0; u < 6; u++){
+		group = (digest[u * 3] << 16) | (digest[u * 3 + 1] << 8) | digest[u * 3 + 2];
+		out[u * 4] = alphabet[(group >> 18) & 0x3F];
+		out[u * 4 + 1] = alphabet[(group >> 12) & 0x3F];
+		out[u * 4 + 2] = alphabet[(group >> 6) & 0x3F];
+		out[u * 4 + 3] = alphabet[group & 0x3F];
+	}
+
+	//2 trailing bytes, padded
+	group = (digest[18] << 16) | (digest[19] << 8);
+	out[24] = alphabet[(group >> 18) & 0x3F];
+	out[25] = alphabet[(group >> 12) & 0x3F];
+	out[26] = alphabet[(group >> 6) & 0x3F];
+	out[27] = '=';
+}
+
+/*
+ * Calculate the WebSocket accept key, which for some reason is defined (RFC 4.2.2.5.4) as
+ * base64(sha1(concat(trim(client-key), "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")))
+ * requiring not one but 2 unnecessarily complex operations.
+ * Writes WS_ACCEPT_KEY_LENGTH bytes to `out`.
+ */
+static void ws_accept_key(char* key, char* out){
+	size_t key_length = strlen(key), u;
+	struct sha1_ctx ws_accept_ctx;
+	uint8_t ws_accept_digest[SHA1_DIGEST_SIZE];
+#if WS_SHA1_COMPRESS
+	//a standard client key and the magic key fill exactly one block with the padding marker,
+	//the second block holds only the (constant) message length in bits
+	static const uint8_t length_block[SHA1_BLOCK_SIZE] = {
+		[SHA1_BLOCK_SIZE - 2] = ((WS_CLIENT_KEY_LENGTH + sizeof(RFC6455_MAGIC_KEY) - 1) * 8) >> 8,
+		[SHA1_BLOCK_SIZE - 1] = ((WS_CLIENT_KEY_LENGTH + sizeof(RFC6455_MAGIC_KEY) - 1) * 8) & 0xFF
+	};
+	//initial hash value (FIPS 180-4, 5.3.1)
+	uint32_t state[SHA1_DIGEST_SIZE / 4] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+	};
+	uint8_t block[SHA1_BLOCK_SIZE] = {
+		0
+	};
+
+	if(key_length == WS_CLIENT_KEY_LENGTH){
+		memcpy(block, key, WS_CLIENT_KEY_LENGTH);
+		memcpy(block + WS_CLIENT_KEY_LENGTH, RFC6455_MAGIC_KEY, sizeof(RFC6455_MAGIC_KEY) - 1);
+		block[WS_CLIENT_KEY_LENGTH + sizeof(RFC6455_MAGIC_KEY) - 1] = 0x80;
+
+		//the compression function is dispatched to the SHA extensions by nettle where available
+		nettle_sha1_compress(state, block);
+		nettle_sha1_compress(state, length_block);
+		for(u = 0; u < SHA1_DIGEST_SIZE / 4; u++){
+			ws_accept_digest[u * 4] = state[u] >> 24;
+			ws_accept_digest[u * 4 + 1] = state[u] >> 16;
+			ws_accept_digest[u * 4 + 2] = state[u] >> 8;
+			ws_accept_digest[u * 4 + 3] = state[u];
+		}
+		ws_accept_encode(ws_accept_digest, out);
+		return;
+	}
+#endif
+
+	sha1_init(&ws_accept_ctx);
+	sha1_update(&ws_accept_ctx, key_length, (uint8_t*) key);
+	sha1_update(&ws_accept_ctx, sizeof(RFC6455_MAGIC_KEY) - 1, (uint8_t*) RFC6455_MAGIC_KEY);
+	sha1_digest(&ws_accept_ctx, sizeof(ws_accept_digest), ws_accept_digest);
+	ws_accept_encode(ws_accept_digest, out);
+}
+
 /* Handle end of HTTP header data and upgrade the connection */
 static int ws_upgrade_http(websocket* ws){
+	char response[sizeof(WS_HTTP_UPGRADE) + sizeof(WS_HTTP_PROTOCOL) + sizeof(WS_HTTP_END) + WS_ACCEPT_KEY_LENGTH + WS_HTTP_ARENA
+		+ sizeof(WS_HTTP_COOKIE) + sizeof(WS_HTTP_COOKIE_PATH) + sizeof(WS_HTTP_COOKIE_ATTRIBUTES)
+		+ WS_RESUME_COOKIE + WS_RESUME_TOKEN + WS_RESUME_PATH + 1];
+	size_t response_length = sizeof(WS_HTTP_UPGRADE) - 1, protocol_length = 0;
+	int resumed = 0;
+	struct iovec iov = {
+		.iov_base = response
+	};
+
+	//metrics are served instead of an upgrade, the connection is closed once the response is written
+	if(metrics_requested(ws)){
+		ws->state = ws_closed;
+		if(metrics_respond(ws) || !ws->queue_entries){
+			ws_close(ws, ws_close_http, NULL);
+		}
+		return 0;
+	}
+
 	if(ws->websocket_version == 13
 			&& ws->socket_key
 			&& ws->want_upgrade == 3){
 
-		//find and connect peer
-		if(client_connect(ws)){
-			ws_close(ws, ws_close_http, "500 Peer connection failed");
-			return 0;
+		//take over a parked peer connection or find and connect a new peer
+		resumed = !resume_adopt(ws);
+		switch(resumed ? 0 : client_connect(ws)){
+			case 0:
+				break;
+			case BREAKER_REJECTED:
+				ws_close(ws, ws_close_http, breaker_status());
+				return 0;
+			default:
+				ws_close(ws, ws_close_http, "500 Peer connection failed");
+				return 0;
 		}
 
-		if(network_send_str(ws->ws_fd, "HTTP/1.1 101 Upgrading\r\n")
-				|| network_send_str(ws->ws_fd, "Upgrade: websocket\r\n")
-				|| network_send_str(ws->ws_fd, "Connection: Upgrade\r\n")){
-			ws_close(ws, ws_close_http, NULL);
-			return 0;
-		}
+		//resumed sessions get a new token as well, so each one can only be used once
+		resume_issue(ws);
 
-		//calculate the websocket accept key, which for some reason is defined (RFC 4.2.2.5.4) as
-		//base64(sha1(concat(trim(client-key), "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")))
-		//requiring not one but 2 unnecessarily complex operations
-		size_t encode_offset = 0;
-		struct sha1_ctx ws_accept_ctx;
-		struct base64_encode_ctx ws_accept_encode;
-		uint8_t ws_accept_digest[SHA1_DIGEST_SIZE];
-		char ws_accept_key[BASE64_ENCODE_LENGTH(SHA1_DIGEST_SIZE) + 3] = "";
-		sha1_init(&ws_accept_ctx);
-		sha1_update(&ws_accept_ctx, strlen(ws->socket_key), (uint8_t*) ws->socket_key);
-		sha1_update(&ws_accept_ctx, strlen(RFC6455_MAGIC_KEY), (uint8_t*) RFC6455_MAGIC_KEY);
-		sha1_digest(&ws_accept_ctx, sizeof(ws_accept_digest), (uint8_t*) &ws_accept_digest);
-		base64_encode_init(&ws_accept_encode);
-		encode_offset = base64_encode_update(&ws_accept_encode, (char*) ws_accept_key, SHA1_DIGEST_SIZE, ws_accept_digest);
-		encode_offset += base64_encode_final(&ws_accept_encode, (char*) ws_accept_key + encode_offset);
-		memcpy(ws_accept_key + encode_offset, "\r\n\0", 3);
-
-		//send websocket accept key
-		if(network_send_str(ws->ws_fd, "Sec-WebSocket-Accept: ")
-					|| network_send_str(ws->ws_fd, ws_accept_key)){
-			ws_close(ws, ws_close_http, NULL);
-			return 0;
-		}
+		//the response is assembled from a template and sent with one write
+		memcpy(response, WS_HTTP_UPGRADE, response_length);
+
+		//append the websocket accept key
+		ws_accept_key(ws->socket_key, response + response_length);
+		response_length += WS_ACCEPT_KEY_LENGTH;
 
 		//acknowledge selected protocol
 		if(ws->peer.protocol < ws->protocols){
-			if(network_send_str(ws->ws_fd, "Sec-WebSocket-Protocol: ")
-						|| network_send_str(ws->ws_fd, ws->protocol[ws->peer.protocol])
-						|| network_send_str(ws->ws_fd, "\r\n")){
-				ws_close(ws, ws_close_http, NULL);
-				return 0;
-			}
+			protocol_length = strlen(ws->protocol[ws->peer.protocol]);
+			memcpy(response + response_length, WS_HTTP_PROTOCOL, sizeof(WS_HTTP_PROTOCOL) - 1);
+			response_length += sizeof(WS_HTTP_PROTOCOL) - 1;
+			memcpy(response + response_length, ws->protocol[ws->peer.protocol], protocol_length);
+			response_length += protocol_length;
+		}
+
+		//hand out the resumption token, scoped to the endpoint so sessions to other endpoints on the host are kept
+		if(ws->resume_token[0]){
+			response_length += sprintf(response + response_length, "%s%s=%s%s%.*s%s", WS_HTTP_COOKIE, resume_cookie(), ws->resume_token,
+					WS_HTTP_COOKIE_PATH, (int) resume_path(ws->request_path), ws->request_path, WS_HTTP_COOKIE_ATTRIBUTES);
 		}
 
+		memcpy(response + response_length, WS_HTTP_END, sizeof(WS_HTTP_END) - 1);
+		response_length += sizeof(WS_HTTP_END) - 1;
+
 		ws->state = ws_open;
-		if(network_send_str(ws->ws_fd, "\r\n")){
+		metrics_upgraded(ws);
+		iov.iov_len = response_length;
+		if(ws_send(ws, &iov, 1)){
 			ws_close(ws, ws_close_http, NULL);
 			return 0;
 		}
+		TRACE(handshake_complete, ws->id, ws->request_path, resumed);
+
+		//deliver peer data buffered while the session was parked
+		if(resumed){
+			resume_flush(ws);
+		}
 		return 0;
 	}
 	//RFC 4.2.2.4: An unsupported version must be answered with HTTP 426
@@ -201,83 +602,107 @@ static int ws_upgrade_http(websocket* ws){
 	return 1;
 }
 
+/* Parse a comma-separated list of subprotocol offers */
+static int ws_handle_protocols(websocket* ws, char* value, size_t length){
+	size_t offset, end, start, token_end, p;
+
+	for(offset = 0; offset < length; offset = end + 1){
+		//find the end of the current offer
+		for(end = offset; end < length && value[end] != ','; end++){
+		}
+
+		//trim the offer
+		for(start = offset; start < end && isspace(value[start]); start++){
+		}
+		for(token_end = end; token_end > start && isspace(value[token_end - 1]); token_end--){
+		}
+
+		if(start == token_end){
+			continue;
+		}
+
+		for(p = 0; p < ws->protocols; p++){
+			if(!strncmp(ws->protocol[p], value + start, token_end - start)
+					&& !ws->protocol[p][token_end - start]){
+				break;
+			}
+		}
+
+		//add new protocol
+		if(p == ws->protocols){
+			if(ws->protocols == WS_PROTOCOL_LIMIT){
+				//limit the number of stored protocols to prevent abuse
+				return 0;
+			}
+			ws->protocol[ws->protocols] = ws_arena_store(ws, value + start, token_end - start);
+			if(!ws->protocol[ws->protocols]){
+				return 1;
+			}
+			ws->protocols++;
+		}
+	}
+	return 0;
+}
+
 /* Handle incoming HTTP header lines */
-static int ws_handle_http(websocket* ws){
-	char* header, *value;
-	ssize_t p;
+static int ws_handle_http(websocket* ws, char* line, size_t length){
+	char* value, *tag;
+	size_t tag_length, value_length;
 
-	if(!ws->read_buffer[0]){
+	if(!length){
 		return ws_upgrade_http(ws);
 	}
-	else if(isspace(ws->read_buffer[0])){
+	else if(isspace(line[0])){
 		//i hate header folding
 		ws_close(ws, ws_close_http, "500 Header folding");
 		return 0;
 	}
-	else{
-		header = (char*) ws->read_buffer;
-		value = strchr(header, ':');
-		if(!value){
-			ws_close(ws, ws_close_http, "500 Header format");
-			return 0;
-		}
-		*value = 0;
-		value++;
-		for(; isspace(*value); value++){
-		}
+
+	value = memchr(line, ':', length);
+	if(!value){
+		ws_close(ws, ws_close_http, "500 Header format");
+		return 0;
+	}
+
+	//terminate the tag, trim the value
+	tag_length = value - line;
+	line[tag_length] = 0;
+	for(value++; isspace(*value); value++){
 	}
+	for(value_length = (line + length) - value; value_length && isspace(value[value_length - 1]); value_length--){
+	}
+	value[value_length] = 0;
 
 	//RFC 4.2.1 checks
-	if(!strcmp(header, "Sec-WebSocket-Version")){
+	if(!strcasecmp(line, "Sec-WebSocket-Version")){
 		ws->websocket_version = strtoul(value, NULL, 10);
 	}
-	else if(!strcmp(header, "Sec-WebSocket-Key")){
-		//right-trim the key
-		for(p = strlen(value) - 1; p >= 0 && isspace(value[p]); p--){
-			value[p] = 0;
+	else if(!strcasecmp(line, "Sec-WebSocket-Key")){
+		ws->socket_key = ws_arena_store(ws, value, value_length);
+		if(!ws->socket_key){
+			ws_close(ws, ws_close_http, "431 Request header fields too large");
 		}
-		ws->socket_key = strdup(value);
 	}
-	else if(!strcmp(header, "Upgrade") && !strcasecmp(value, "websocket")){
+	else if(!strcasecmp(line, "Upgrade") && !strcasecmp(value, "websocket")){
 		ws->want_upgrade |= 1;
 	}
-	else if(!strcmp(header, "Connection") && strstr(xstr_lower(value), "upgrade")){
+	else if(!strcasecmp(line, "Connection") && strstr(xstr_lower(value), "upgrade")){
 		ws->want_upgrade |= 2;
 	}
-	else if(!strcmp(header, "Sec-WebSocket-Protocol")){
-		//parse websocket protocol offers
-		for(value = strtok(value, ","); value; value = strtok(NULL, ",")){
-			//ltrim
-			for(; *value && isspace(*value); value++){
-			}
-
-			//rtrim
-			for(p = strlen(value) - 1; p >= 0 && isspace(value[p]); p--){
-				value[p] = 0;
-			}
-
-			for(p = 0; p < ws->protocols; p++){
-				if(!strcmp(ws->protocol[p], value)){
-					break;
-				}
-			}
-
-			//add new protocol
-			if(p == ws->protocols){
-				ws->protocol = realloc(ws->protocol, (ws->protocols + 1) * sizeof(char*));
-				if(!ws->protocol){
-					fprintf(stderr, "Failed to allocate memory\n");
-					return 1;
-				}
-				ws->protocol[ws->protocols] = strdup(value);
-				ws->protocols++;
-			}
+	else if(!strcasecmp(line, "Sec-WebSocket-Protocol")){
+		if(ws_handle_protocols(ws, value, value_length)){
+			ws_close(ws, ws_close_http, "431 Request header fields too large");
 		}
 	}
 	else if(ws->headers < WS_HEADER_LIMIT){
-		ws->header[ws->headers].tag = strdup(header);
-		ws->header[ws->headers].value = strdup(value);
-		ws->headers++;
+		//headers not fitting the arena are dropped just like those over the limit
+		tag = ws_arena_store(ws, line, tag_length);
+		value = tag ? ws_arena_store(ws, value, value_length) : NULL;
+		if(value){
+			ws->header[ws->headers].tag = tag;
+			ws->header[ws->headers].value = value;
+			ws->headers++;
+		}
 	}
 	else{
 		//limit the number of stored headers to prevent abuse
@@ -286,20 +711,108 @@ static int ws_handle_http(websocket* ws){
 	return 0;
 }
 
+/*
+ * Write all collected client messages to the peer with as few system calls as possible:
+ * one writev for stream peers, sendmmsg for datagram peers.
+ * The collected buffers point into the read buffer and must be sent before it is compacted.
+ */
+static void ws_peer_flush(websocket* ws){
+	struct iovec replay[WS_PEER_BATCH];
+	size_t u, entries = peer_batch_entries, messages = peer_batch_messages;
+
+	peer_batch_entries = peer_batch_messages = 0;
+	if(!entries){
+		return;
+	}
+
+	if(ws->peer_lost){
+		//hold the data until the peer is back
+		for(u = 0; u < entries; u++){
+			if(reconnect_buffer(ws, peer_batch[u].iov_base, peer_batch[u].iov_len)){
+				ws_close(ws, ws_close_again, "Peer unavailable");
+				return;
+			}
+		}
+		return;
+	}
+
+	if(ws->peer_fd < 0){
+		return;
+	}
+
+	LOG(log_frames, log_debug, "WS -> Peer %lu messages\n", messages);
+	if(PEER_DATAGRAM(ws->peer.transport)){
+		if(network_send_datagrams(ws->peer_fd, peer_batch, entries)){
+			ws_close(ws, ws_close_unexpected, "Failed to forward");
+		}
+		return;
+	}
+
+	//network_sendv tracks partial writes in the iovecs, keep the complete messages for a replay
+	memcpy(replay, peer_batch, entries * sizeof(struct iovec));
+	if(network_sendv(ws->peer_fd, &(ws->peer_backlog), peer_batch, entries)){
+		if(reconnect_start(ws)){
+			ws_close(ws, ws_close_unexpected, "Failed to forward");
+			return;
+		}
+
+		for(u = 0; u < entries; u++){
+			if(reconnect_buffer(ws, replay[u].iov_base, replay[u].iov_len)){
+				ws_close(ws, ws_close_unexpected, "Failed to forward");
+				return;
+			}
+		}
+	}
+}
+
+/* Write client data the peer did not accept before, called once the peer socket is writable */
+void ws_peer_drain(websocket* ws){
+	if(network_flush(ws->peer_fd, &(ws->peer_backlog)) && reconnect_start(ws)){
+		ws_close(ws, ws_close_unexpected, "Failed to forward");
+	}
+}
+
+/* Collect a client message for the peer, adding the inbound framing as separate buffers */
+static void ws_peer_queue(websocket* ws, uint8_t* data, size_t length){
+	peer_inbound inbound = PEER_DATAGRAM(ws->peer.transport) ? inbound_none : ws->peer.inbound;
+
+	if(peer_batch_entries + 2 > WS_PEER_BATCH){
+		ws_peer_flush(ws);
+	}
+
+	if(inbound == inbound_length){
+		peer_batch_prefix[peer_batch_entries] = htobe32(length);
+		peer_batch[peer_batch_entries].iov_base = peer_batch_prefix + peer_batch_entries;
+		peer_batch[peer_batch_entries].iov_len = sizeof(uint32_t);
+		peer_batch_entries++;
+	}
+
+	peer_batch[peer_batch_entries].iov_base = data;
+	peer_batch[peer_batch_entries].iov_len = length;
+	peer_batch_entries++;
+
+	if(inbound == inbound_newline){
+		peer_batch[peer_batch_entries].iov_base = "\n";
+		peer_batch[peer_batch_entries].iov_len = 1;
+		peer_batch_entries++;
+	}
+	peer_batch_messages++;
+}
+
 //returns bytes handled
-static size_t ws_frame(websocket* ws){
+static size_t ws_frame(websocket* ws, uint8_t* frame, size_t available){
 	size_t u;
 	uint64_t payload_length = 0;
-	uint16_t* payload_len16 = (uint16_t*) (ws->read_buffer + 2);
-	uint64_t* payload_len64 = (uint64_t*) (ws->read_buffer + 2);
-	uint8_t* masking_key = NULL, *payload = ws->read_buffer + 2;
+	uint16_t* payload_len16 = (uint16_t*) (frame + 2);
+	uint64_t* payload_len64 = (uint64_t*) (frame + 2);
+	uint8_t* masking_key = NULL, *payload = frame + 2;
 
 	//need at least the header bits
-	if(ws->read_buffer_offset < 2){
+	if(available < 2){
 		return 0;
 	}
 
-	if(WS_GET_RESERVED(ws->read_buffer[0])){
+	if(WS_GET_RESERVED(frame[0])){
 		//reserved bits set without any extensions
 		//RFC 5.2 says we MUST close the connection
 		//ignoring it for now
@@ -307,60 +820,60 @@ static size_t ws_frame(websocket* ws){
 
 	//calculate the payload length from one of 3 cases (RFC 5.2)
 	//could've used a uint64 and be done with it...
-	payload_length = WS_GET_LEN(ws->read_buffer[1]);
-	if(WS_GET_MASK(ws->read_buffer[1])){
-		if(ws->read_buffer_offset < 6){
+	payload_length = WS_GET_LEN(frame[1]);
+	if(WS_GET_MASK(frame[1])){
+		if(available < 6){
 			return 0;
 		}
-		masking_key = ws->read_buffer + 2;
-		payload = ws->read_buffer + 6;
+		masking_key = frame + 2;
+		payload = frame + 6;
 	}
 
 	if(payload_length == 126){
 		//16-bit payload length
-		if(ws->read_buffer_offset < 4){
+		if(available < 4){
 			return 0;
 		}
 		payload_length = htobe16(*payload_len16);
-		payload = ws->read_buffer + 4;
-		if(WS_GET_MASK(ws->read_buffer[1])){
-			if(ws->read_buffer_offset < 8){
+		payload = frame + 4;
+		if(WS_GET_MASK(frame[1])){
+			if(available < 8){
 				return 0;
 			}
-			masking_key = ws->read_buffer + 4;
-			payload = ws->read_buffer + 8;
+			masking_key = frame + 4;
+			payload = frame + 8;
 		}
 	}
 	else if(payload_length == 127){
 		//64-bit payload length
-		if(ws->read_buffer_offset < 10){
+		if(available < 10){
 			return 0;
 		}
 		payload_length = htobe64(*payload_len64);
-		payload = ws->read_buffer + 10;
-		if(WS_GET_MASK(ws->read_buffer[1])){
-			if(ws->read_buffer_offset < 14){
+		payload = frame + 10;
+		if(WS_GET_MASK(frame[1])){
+			if(available < 14){
 				return 0;
 			}
-			masking_key = ws->read_buffer + 10;
-			payload = ws->read_buffer + 14;
+			masking_key = frame + 10;
+			payload = frame + 14;
 		}
 	}
 
 	//check for complete WS frame
-	if(ws->read_buffer_offset < (payload - ws->read_buffer) + payload_length){
-		//fprintf(stderr, "Incomplete payload: offset %lu, want %lu\n", ws->read_buffer_offset, (payload - ws->read_buffer) + payload_length);
+	if(available < (payload - frame) + payload_length){
+		//fprintf(stderr, "Incomplete payload: offset %lu, want %lu\n", available, (payload - frame) + payload_length);
 		return 0;
 	}
 
 	//RFC Section 5.1: If the client sends an unmasked frame, close the connection
-	if(!WS_GET_MASK(ws->read_buffer[1])){
+	if(!WS_GET_MASK(frame[1])){
 		ws_close(ws, ws_close_proto, "Unmasked client frame");
 		return 0;
 	}
 
 	//unmask data
-	if(WS_GET_MASK(ws->read_buffer[1])){
+	if(WS_GET_MASK(frame[1])){
 		for(u = 0; u < payload_length; u++){
 			payload[u] = payload[u] ^ masking_key[u % 4];
 		}
@@ -370,26 +883,37 @@ static size_t ws_frame(websocket* ws){
 	//TODO handle control frames within fragmented frames
 
 	/*fprintf(stderr, "Incoming websocket data: %s %s OP %02X LEN %u %lu\n",
-			WS_GET_FIN(ws->read_buffer[0]) ? "FIN" : "CONT",
-			WS_GET_MASK(ws->read_buffer[1]) ? "MASK" : "CLEAR",
-			WS_GET_OP(ws->read_buffer[0]),
-			WS_GET_LEN(ws->read_buffer[1]),
+			WS_GET_FIN(frame[0]) ? "FIN" : "CONT",
+			WS_GET_MASK(frame[1]) ? "MASK" : "CLEAR",
+			WS_GET_OP(frame[0]),
+			WS_GET_LEN(frame[1]),
 			payload_length);*/
 
 	//handle data
-	switch(WS_GET_OP(ws->read_buffer[0])){
+	TRACE(frame_in, ws->id, WS_GET_OP(frame[0]), payload_length);
+	switch(WS_GET_OP(frame[0])){
 		case ws_frame_text:
 			//fprintf(stderr, "Text payload: %.*s\n", (int) payload_length, (char*) payload);
 		case ws_frame_binary:
-			//forward to peer
-			if(ws->peer_fd >= 0){
-				fprintf(stderr, "WS -> Peer %lu bytes\n", payload_length);
-				if(network_send(ws->peer_fd, payload, payload_length)){
+			metrics_traffic(ws, metrics_to_peer, payload_length);
+			//forward to peer, collecting all messages from one read into a single write
+			if(ws->peer_fd >= 0 || ws->peer_lost){
+				ws_peer_queue(ws, payload, payload_length);
+			}
+			else if(ws->peer.transport == peer_mux){
+				if(mux_send(ws, WS_GET_OP(frame[0]), payload, payload_length)){
+					ws_close(ws, ws_close_unexpected, "Failed to forward");
+				}
+			}
+			else if(ws->peer.transport == peer_shm){
+				if(ring_send(ws, WS_GET_OP(frame[0]), payload, payload_length)){
 					ws_close(ws, ws_close_unexpected, "Failed to forward");
 				}
 			}
 			break;
 		case ws_frame_close:
+			//deliver client messages preceding the close frame
+			ws_peer_flush(ws);
 			ws_close(ws, ws_close_normal, "Client requested termination");
 			break;
 		case ws_frame_ping:
@@ -402,110 +926,452 @@ static size_t ws_frame(websocket* ws){
 			break;
 		default:
 			//unknown frame type received
-			fprintf(stderr, "Unknown WebSocket opcode %02X in frame\n", WS_GET_OP(ws->read_buffer[0]));
+			LOG(log_frames, log_warn, "Unknown WebSocket opcode %02X in frame\n", WS_GET_OP(frame[0]));
 			ws_close(ws, ws_close_proto, "Invalid opcode");
 			break;
 	}
 
-	return ((payload - ws->read_buffer) + payload_length);
+	return ((payload - frame) + payload_length);
 }
 
-/* Construct and send a WebSocket frame */
-int ws_send_frame(websocket* ws, ws_operation opcode, uint8_t* data, size_t len){
-	fprintf(stderr, "Peer -> WS %lu bytes (%02X)\n", len, opcode);
-	uint8_t frame_header[WS_FRAME_HEADER_LEN];
-	size_t header_bytes = 2;
-	uint16_t* payload_len16 = (uint16_t*) (frame_header + 2);
-	uint64_t* payload_len64 = (uint64_t*) (frame_header + 2);
+/* Encode a WebSocket frame header, returns the number of header bytes */
+size_t ws_frame_header(uint8_t* frame_header, ws_operation opcode, size_t len){
+	uint16_t payload_len16;
+	uint64_t payload_len64;
 
 	//set up the basic frame header
 	frame_header[0] = WS_FLAG_FIN | opcode;
 	if(len <= 125){
 		frame_header[1] = len;
+		return 2;
 	}
 	else if(len <= 0xFFFF){
 		frame_header[1] = 126;
-		*payload_len16 = htobe16(len);
-		header_bytes += 2;
+		payload_len16 = htobe16(len);
+		memcpy(frame_header + 2, &payload_len16, 2);
+		return 4;
 	}
-	else{
-		frame_header[1] = 127;
-		*payload_len64 = htobe64(len);
-		header_bytes += 8;
+
+	frame_header[1] = 127;
+	payload_len64 = htobe64(len);
+	memcpy(frame_header + 2, &payload_len64, 8);
+	return 10;
+}
+
+/* Allocate a reference-counted frame buffer with one reference */
+ws_buffer* ws_buffer_alloc(size_t length){
+	ws_buffer* buffer = malloc(sizeof(ws_buffer) + length);
+	if(!buffer){
+		LOG(log_core, log_error, "Failed to allocate memory\n");
+		return NULL;
 	}
 
-	if(network_send(ws->ws_fd, frame_header, header_bytes)
-			|| network_send(ws->ws_fd, data, len)){
+	buffer->references = 1;
+	buffer->length = length;
+	memory_account(memory_frames, sizeof(ws_buffer) + length);
+	return buffer;
+}
+
+/* Release a reference to a frame buffer */
+void ws_buffer_release(ws_buffer* buffer){
+	if(buffer && !--buffer->references){
+		memory_account(memory_frames, -(ssize_t) (sizeof(ws_buffer) + buffer->length));
+		free(buffer);
+	}
+}
+
+/*
+ * Write as much of the outbound queue as the socket accepts without blocking.
+ * Returns 0 on success (including a partial write)
+ */
+int ws_flush(websocket* ws){
+	struct iovec iov[WS_FLUSH_BATCH];
+	size_t u, entries = (ws->queue_entries < WS_FLUSH_BATCH) ? ws->queue_entries : WS_FLUSH_BATCH;
+	ssize_t sent;
+	int zerocopy = 0;
+	struct msghdr message = {
+		.msg_iov = iov
+	};
+
+	if(ws->zerocopy_entries){
+		ws_zerocopy_complete(ws);
+	}
+
+	if(!ws->queue_entries){
+		return 0;
+	}
+
+	for(u = 0; u < entries; u++){
+		iov[u].iov_base = ws->queue[u]->data;
+		iov[u].iov_len = ws->queue[u]->length;
+
+		//large buffers are sent on their own without copying
+		if(ws->zerocopy && ws->queue[u]->length - (u ? 0 : ws->queue_offset) >= zerocopy_threshold){
+			zerocopy = !u;
+			entries = u ? u : 1;
+			break;
+		}
+	}
+	iov[0].iov_base = ws->queue[0]->data + ws->queue_offset;
+	iov[0].iov_len -= ws->queue_offset;
+
+	message.msg_iovlen = entries;
+	sent = sendmsg(ws->ws_fd, &message, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+	if(sent < 0 && zerocopy && errno == ENOBUFS){
+		//out of memory for pinning pages, send with a copy instead
+		zerocopy = 0;
+		sent = sendmsg(ws->ws_fd, &message, MSG_NOSIGNAL);
+	}
+
+	//the buffer has to stay untouched until the kernel is done with it
+	if(sent > 0 && zerocopy && ws_zerocopy_track(ws, ws->queue[0])){
 		return 1;
 	}
 
+	if(sent < 0){
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+			return 0;
+		}
+		LOG(log_core, log_warn, "Failed to send: %s\n", strerror(errno));
+		return 1;
+	}
+	ws->queue_bytes -= sent;
+
+	//release all completely written buffers
+	sent += ws->queue_offset;
+	for(u = 0; u < ws->queue_entries && sent >= ws->queue[u]->length; u++){
+		sent -= ws->queue[u]->length;
+		ws_buffer_release(ws->queue[u]);
+	}
+
+	memmove(ws->queue, ws->queue + u, (ws->queue_entries - u) * sizeof(ws_buffer*));
+	ws->queue_entries -= u;
+	ws->queue_offset = sent;
+	return 0;
+}
+
+/*
+ * Append a frame buffer to the outbound queue of a WebSocket, taking a reference.
+ * Returns 0 on success
+ */
+int ws_queue(websocket* ws, ws_buffer* buffer){
+	ws_buffer** queue = NULL;
+
+	if(ws->queue_bytes + buffer->length > WS_QUEUE_LIMIT){
+		LOG(log_core, log_warn, "Outbound queue limit exceeded\n");
+		return 1;
+	}
+
+	if(ws->queue_entries == ws->queue_alloc){
+		queue = realloc(ws->queue, (ws->queue_alloc + WS_FLUSH_BATCH) * sizeof(ws_buffer*));
+		if(!queue){
+			//the connection is failed by the caller, its pending frames are lost either way
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			ws_queue_clear(ws);
+			return 1;
+		}
+		ws->queue = queue;
+		ws->queue_alloc += WS_FLUSH_BATCH;
+		memory_account(memory_frames, WS_FLUSH_BATCH * sizeof(ws_buffer*));
+	}
+
+	buffer->references++;
+	ws->queue[ws->queue_entries] = buffer;
+	ws->queue_entries++;
+	ws->queue_bytes += buffer->length;
+
+	//try to send immediately if this is the only entry
+	if(ws->queue_entries == 1){
+		return ws_flush(ws);
+	}
 	return 0;
 }
 
+/* Release all queued outbound frames */
+void ws_queue_clear(websocket* ws){
+	size_t u;
+
+	for(u = 0; u < ws->queue_entries; u++){
+		ws_buffer_release(ws->queue[u]);
+	}
+	memory_account(memory_frames, -(ssize_t) (ws->queue_alloc * sizeof(ws_buffer*)));
+	free(ws->queue);
+	ws->queue = NULL;
+	ws->queue_entries = ws->queue_alloc = ws->queue_offset = ws->queue_bytes = 0;
+}
+
+/*
+ * Send data to a WebSocket client, queueing anything the socket does not accept immediately.
+ * Returns 0 on success
+ */
+int ws_send(websocket* ws, struct iovec* iov, size_t count){
+	size_t u, length = 0, offset = 0;
+	ssize_t sent = 0;
+	ws_buffer* buffer = NULL;
+	int rv = 0;
+
+	for(u = 0; u < count; u++){
+		length += iov[u].iov_len;
+	}
+
+	//data may only be sent directly if nothing else is waiting
+	if(!ws->queue_entries){
+		sent = writev(ws->ws_fd, iov, count);
+		if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+			LOG(log_core, log_warn, "Failed to send: %s\n", strerror(errno));
+			return 1;
+		}
+		else if(sent == length){
+			return 0;
+		}
+		sent = (sent < 0) ? 0 : sent;
+	}
+
+	//queue the remainder
+	buffer = ws_buffer_alloc(length - sent);
+	if(!buffer){
+		return 1;
+	}
+
+	for(u = 0; u < count; u++){
+		if(sent >= iov[u].iov_len){
+			sent -= iov[u].iov_len;
+			continue;
+		}
+		memcpy(buffer->data + offset, (uint8_t*) iov[u].iov_base + sent, iov[u].iov_len - sent);
+		offset += iov[u].iov_len - sent;
+		sent = 0;
+	}
+
+	rv = ws_queue(ws, buffer);
+	ws_buffer_release(buffer);
+	return rv;
+}
+
+/* Construct and send a WebSocket frame, queueing anything the socket does not accept immediately */
+int ws_send_frame(websocket* ws, ws_operation opcode, uint8_t* data, size_t len){
+	uint8_t frame_header[WS_FRAME_HEADER_LEN];
+	size_t header_bytes = ws_frame_header(frame_header, opcode, len);
+	struct iovec iov[2] = {
+		{.iov_base = frame_header, .iov_len = header_bytes},
+		{.iov_base = data, .iov_len = len}
+	};
+
+	LOG(log_frames, log_debug, "Peer -> WS %lu bytes (%02X)\n", len, opcode);
+	TRACE(frame_out, ws->id, opcode, len);
+	if(opcode == ws_frame_text || opcode == ws_frame_binary){
+		metrics_traffic(ws, metrics_to_client, len);
+	}
+
+	return ws_send(ws, iov, 2);
+}
+
+/* Drop the splice pipe after a failure, it may still contain data */
+static void ws_splice_reset(){
+	close(splice_pipe[0]);
+	close(splice_pipe[1]);
+	splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+/*
+ * Forward the data waiting on a stream peer as one binary frame, moving it through a pipe within the kernel.
+ * Returns the number of bytes forwarded, 0 if the data needs to be read normally and -1 on failure
+ */
+ssize_t ws_splice_frame(websocket* ws, int fd){
+	uint8_t frame_header[WS_FRAME_HEADER_LEN];
+	size_t header_bytes;
+	ssize_t length, moved = 0, sent = 0, bytes;
+	int available = 0;
+	ws_buffer* buffer = NULL;
+
+	//frames may only be sent directly if nothing else is waiting, an empty socket may signal the end of the stream
+	if(ws->queue_entries || ioctl(fd, FIONREAD, &available) || available <= 0){
+		return 0;
+	}
+
+	if(splice_pipe[0] < 0 && pipe2(splice_pipe, O_NONBLOCK | O_CLOEXEC)){
+		LOG(log_peer, log_error, "Failed to create splice pipe: %s\n", strerror(errno));
+		return 0;
+	}
+
+	//the frame length is only known once the data is in the pipe
+	length = splice(fd, NULL, splice_pipe[1], NULL, (available < WS_SPLICE_MAX) ? available : WS_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if(length <= 0){
+		return 0;
+	}
+
+	LOG(log_frames, log_debug, "Peer -> WS %lu bytes (spliced)\n", length);
+	TRACE(frame_out, ws->id, ws_frame_binary, length);
+	metrics_traffic(ws, metrics_to_client, length);
+	header_bytes = ws_frame_header(frame_header, ws_frame_binary, length);
+	sent = send(ws->ws_fd, frame_header, header_bytes, MSG_MORE | MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(sent == header_bytes){
+		for(moved = 0; moved < length; moved += bytes){
+			bytes = splice(splice_pipe[0], NULL, ws->ws_fd, NULL, length - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(bytes <= 0){
+				break;
+			}
+		}
+
+		if(moved == length){
+			return length;
+		}
+		sent += moved;
+	}
+
+	if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+		LOG(log_core, log_warn, "Failed to send: %s\n", strerror(errno));
+		ws_splice_reset();
+		return -1;
+	}
+	sent = (sent < 0) ? 0 : sent;
+
+	//the client socket is congested, queue the remainder of the frame from the pipe
+	buffer = ws_buffer_alloc(header_bytes + length - sent);
+	if(!buffer){
+		ws_splice_reset();
+		return -1;
+	}
+
+	if(sent < header_bytes){
+		memcpy(buffer->data, frame_header + sent, header_bytes - sent);
+	}
+
+	for(moved = (sent < header_bytes) ? header_bytes - sent : 0; moved < buffer->length; moved += bytes){
+		bytes = read(splice_pipe[0], buffer->data + moved, buffer->length - moved);
+		if(bytes <= 0){
+			LOG(log_peer, log_error, "Failed to read from splice pipe: %s\n", strerror(errno));
+			ws_buffer_release(buffer);
+			ws_splice_reset();
+			return -1;
+		}
+	}
+
+	bytes = ws_queue(ws, buffer);
+	ws_buffer_release(buffer);
+	return bytes ? -1 : length;
+}
+
+/* Handle all complete frames in the read buffer */
+static void ws_frames(websocket* ws){
+	size_t n, offset = 0;
+
+	for(n = ws_frame(ws, ws->read_buffer, ws->read_buffer_offset);
+			n > 0 && offset + n < ws->read_buffer_offset;
+			n = ws_frame(ws, ws->read_buffer + offset, ws->read_buffer_offset - offset)){
+		offset += n;
+	}
+	offset += n;
+
+	//send collected messages before the frames they point to are moved
+	ws_peer_flush(ws);
+
+	//remove all handled frames from the buffer at once
+	if(offset && offset <= ws->read_buffer_offset){
+		memmove(ws->read_buffer, ws->read_buffer + offset, ws->read_buffer_offset - offset);
+		ws->read_buffer_offset -= offset;
+	}
+}
+
+/* Handle all complete HTTP lines in the read buffer, scanning only new data */
+static void ws_lines(websocket* ws, size_t scan_offset){
+	uint8_t* line = ws->read_buffer, *line_end = NULL, *end = ws->read_buffer + ws->read_buffer_offset;
+	size_t length;
+	int rv = 0;
+
+	for(line_end = memchr(ws->read_buffer + scan_offset, '\n', end - (ws->read_buffer + scan_offset));
+			line_end;
+			line_end = memchr(line, '\n', end - line)){
+		//terminate line
+		length = line_end - line;
+		if(length && line[length - 1] == '\r'){
+			length--;
+		}
+		line[length] = 0;
+
+		if(ws->state == ws_new){
+			rv = ws_handle_new(ws, (char*) line, length);
+		}
+		else{
+			rv = ws_handle_http(ws, (char*) line, length);
+		}
+
+		if(rv){
+			ws_close(ws, ws_close_http, "400 Bad request");
+		}
+
+		line = line_end + 1;
+		if(ws->state != ws_new && ws->state != ws_http){
+			break;
+		}
+	}
+
+	if(ws->state == ws_closed){
+		return;
+	}
+
+	//remove all handled lines from the buffer at once
+	if(line != ws->read_buffer){
+		ws->read_buffer_offset = end - line;
+		memmove(ws->read_buffer, line, ws->read_buffer_offset);
+	}
+
+	//handle frames pipelined directly after the upgrade request
+	if(ws->state == ws_open && ws->read_buffer_offset){
+		ws_frames(ws);
+	}
+}
+
 /* Handle incoming data on a WebSocket client */
 int ws_data(websocket* ws){
-	ssize_t bytes_read, n, bytes_left = sizeof(ws->read_buffer) - ws->read_buffer_offset;
+	ssize_t bytes_read, bytes_left = sizeof(ws->read_buffer) - ws->read_buffer_offset;
+	size_t scan_offset = ws->read_buffer_offset;
 	int rv = 0;
 
+	//pending zero-copy completions make the socket readable
+	if(ws->zerocopy_entries){
+		ws_zerocopy_complete(ws);
+	}
+
 	bytes_read = recv(ws->ws_fd, ws->read_buffer + ws->read_buffer_offset, bytes_left - 1, 0);
-	if(bytes_read < 0){
-		fprintf(stderr, "Failed to receive from websocket: %s\n", strerror(errno));
+	if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		//spurious wakeup on a nonblocking client
+		return 0;
+	}
+	else if(bytes_read < 0){
+		LOG(log_core, log_warn, "Failed to receive from websocket: %s\n", strerror(errno));
+		resume_park(ws);
 		ws_close(ws, ws_close_unexpected, NULL);
 		return 0;
 	}
 	else if(bytes_read == 0){
-		//client closed connection
+		//client closed connection, keep the peer connection around if the client may resume
+		resume_park(ws);
 		ws_close(ws, ws_close_unexpected, NULL);
 		return 0;
 	}
 
 	//terminate new data
 	ws->read_buffer[ws->read_buffer_offset + bytes_read] = 0;
+	ws->read_buffer_offset += bytes_read;
 
 	switch(ws->state){
 		case ws_new:
 		case ws_http:
-			//scan for newline, handle line
-			for(n = 0; n < bytes_read - 1; n++){
-				if(!strncmp((char*) ws->read_buffer + ws->read_buffer_offset + n, "\r\n", 2)){
-					//terminate line
-					ws->read_buffer[ws->read_buffer_offset + n] = 0;
-
-					if(ws->state == ws_new){
-						ws_handle_new(ws);
-					}
-					else{
-						ws_handle_http(ws);
-					}
-
-					//remove from buffer
-					bytes_read -= (n + 2);
-					memmove(ws->read_buffer, ws->read_buffer + ws->read_buffer_offset + n + 2, bytes_read);
-					ws->read_buffer_offset = 0;
-
-					//restart from the beginning
-					n = -1;
-				}
-			}
-			//update read buffer offset
-			ws->read_buffer_offset = bytes_read;
+			ws_lines(ws, scan_offset);
 			break;
 		case ws_open:
-			ws->read_buffer_offset += bytes_read;
-			for(n = ws_frame(ws); n > 0 && ws->read_buffer_offset > 0; n = ws_frame(ws)){
-				memmove(ws->read_buffer, ws->read_buffer + n, ws->read_buffer_offset - n);
-				ws->read_buffer_offset -= n;
-			}
+			ws_frames(ws);
 			break;
 		//this should never be reached, as ws_close also closes the client fd
 		case ws_closed:
-			fprintf(stderr, "This should not have happened\n");
+			LOG(log_core, log_error, "This should not have happened\n");
 			break;
 	}
 
 	//disconnect spammy clients
 	if(sizeof(ws->read_buffer) - ws->read_buffer_offset < 2){
-		fprintf(stderr, "Disconnecting misbehaving client\n");
+		LOG(log_http, log_warn, "Disconnecting misbehaving client\n");
 		ws_close(ws, ws_close_limit, "Receive size limit exceeded");
 		return 0;
 	}
@@ -1,7 +1,26 @@
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "websocksy.h"
 
+/* Maximum WebSocket frame header length */
+#define WS_FRAME_HEADER_LEN 16
+
 /* WebSocket connection handling functions */
 int ws_close(websocket* ws, ws_close_reason code, char* reason);
-int ws_accept(int listen_fd, time_t current_time);
+int ws_accept(int listen_fd, size_t budget, time_t current_time);
+int ws_send(websocket* ws, struct iovec* iov, size_t count);
 int ws_send_frame(websocket* ws, ws_operation opcode, uint8_t* data, size_t len);
+ssize_t ws_splice_frame(websocket* ws, int fd);
 int ws_data(websocket* ws);
+void ws_peer_drain(websocket* ws);
+void ws_zerocopy_init(size_t threshold);
+size_t ws_zerocopy_maintain();
+void ws_zerocopy_cleanup();
+
+/* Outbound frame queue */
+size_t ws_frame_header(uint8_t* frame_header, ws_operation opcode, size_t len);
+ws_buffer* ws_buffer_alloc(size_t length);
+void ws_buffer_release(ws_buffer* buffer);
+int ws_queue(websocket* ws, ws_buffer* buffer);
+int ws_flush(websocket* ws);
+void ws_queue_clear(websocket* ws);
@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <string.h>
@@ -17,9 +20,25 @@
 #include "websocket.h"
 #include "plugin.h"
 #include "config.h"
+#include "pool.h"
+#include "mux.h"
+#include "broadcast.h"
+#include "cache.h"
+#include "group.h"
+#include "breaker.h"
+#include "reconnect.h"
+#include "resume.h"
+#include "ring.h"
+#include "exec.h"
+#include "memory.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define DEFAULT_HOST "::"
 #define DEFAULT_PORT "8001"
+/* Initial number of client slots, the registry grows by doubling */
+#define CLIENT_SLOTS_INITIAL 16
 
 /* TODO
  * - TLS
@@ -36,7 +55,7 @@ static websocket* sock = NULL;
 /* Lowercase input string in-place */
 char* xstr_lower(char* in){
 	size_t n;
-	for(n = 0; n < strlen(in); n++){
+	for(n = 0; in[n]; n++){
 		in[n] = tolower(in[n]);
 	}
 	return in;
@@ -47,6 +66,27 @@ static ws_config config = {
 	.host = NULL,
 	.port = NULL,
 	.ping_interval = 30,
+	.handshake_timeout = 10,
+	.accept_budget = 64,
+	.max_connections = 0,
+	.defer_accept = 0,
+	.pool_min = 0,
+	.pool_max = 0,
+	.pool_check = 5,
+	.mux_connections = 1,
+	.broadcast_queue = 64,
+	.cache_ttl = 10,
+	.group_fail_threshold = 3,
+	.group_eject_time = 10,
+	.breaker_threshold = 5,
+	.breaker_interval = 5,
+	.resume_buffer = RESUME_BUFFER_DEFAULT,
+	.exec_workers = EXEC_WORKERS_DEFAULT,
+	.io_budget = 65536,
+	.io_messages = 64,
+	.memory_limit = 0,
+	.memory_pressure = 0,
+	.metrics_path = NULL,
 	/* Assign the built-in defaultpeer backend by default */
 	.backend.init = backend_defaultpeer_init,
 	.backend.config = backend_defaultpeer_configure,
@@ -56,7 +96,9 @@ static ws_config config = {
 
 /* Push a new client to the registry */
 int client_register(websocket* ws){
-	size_t n = 0;
+	size_t n = 0, slots;
+	char* arena = NULL;
+	websocket* resized = NULL;
 
 	//try to find a slot to occupy
 	for(n = 0; n < socks; n++){
@@ -67,33 +109,146 @@ int client_register(websocket* ws){
 
 	//none found, need to extend
 	if(n == socks){
-		sock = realloc(sock, (socks + 1) * sizeof(websocket));
-		if(!sock){
+		slots = socks ? socks * 2 : CLIENT_SLOTS_INITIAL;
+		resized = realloc(sock, slots * sizeof(websocket));
+		if(!resized){
 			close(ws->ws_fd);
-			fprintf(stderr, "Failed to allocate memory\n");
+			LOG(log_core, log_error, "Failed to allocate memory\n");
 			return 1;
 		}
-		socks++;
+		sock = resized;
+		memory_account(memory_clients, (slots - socks) * sizeof(websocket));
+
+		//mark new slots as unused without touching their buffers
+		for(; socks < slots; socks++){
+			sock[socks].ws_fd = -1;
+			sock[socks].peer_fd = -1;
+			sock[socks].http_arena = NULL;
+		}
 	}
 
+	//keep the request data arena of the reused slot
+	arena = sock[n].http_arena;
 	sock[n] = *ws;
+	sock[n].http_arena = arena;
 
 	return 0;
 }
 
+/* Access a client by its registry index, returns NULL for unused slots */
+websocket* client_get(size_t index){
+	if(index >= socks || sock[index].ws_fd < 0){
+		return NULL;
+	}
+	return sock + index;
+}
+
+/* Number of registry slots, including unused ones */
+size_t client_slots(){
+	return socks;
+}
+
+/* Find the registry index of a client */
+size_t client_index(websocket* ws){
+	return ws - sock;
+}
+
 /* Clean up and close all connections */
 void client_cleanup(){
 	size_t n;
 	for(n = 0; n < socks; n++){ 
-		 ws_close(sock + n, ws_close_shutdown, "Shutting down");
+		if(sock[n].ws_fd >= 0){
+			ws_close(sock + n, ws_close_shutdown, "Shutting down");
+		}
+		if(sock[n].http_arena){
+			memory_account(memory_requests, -WS_HTTP_ARENA);
+		}
+		free(sock[n].http_arena);
 	}
 
+	memory_account(memory_clients, -(ssize_t) (socks * sizeof(websocket)));
 	free(sock);
 	sock = NULL;
 	socks = 0;
 }
 
-static peer_transport client_detect_transport(char* host){
+/* Release the buffers of unused slots and idle connections, and trim the registry if mostly unused */
+static void client_shrink(){
+	size_t n, used = 0;
+	websocket* list = NULL;
+
+	for(n = 0; n < socks; n++){
+		if(sock[n].ws_fd >= 0){
+			used = n + 1;
+			//the request data stays referenced for the lifetime of the connection, only the queue can go
+			if(!sock[n].queue_entries && sock[n].queue){
+				ws_queue_clear(sock + n);
+			}
+			continue;
+		}
+
+		if(sock[n].http_arena){
+			memory_account(memory_requests, -WS_HTTP_ARENA);
+			free(sock[n].http_arena);
+			sock[n].http_arena = NULL;
+		}
+	}
+
+	if(used < CLIENT_SLOTS_INITIAL){
+		used = CLIENT_SLOTS_INITIAL;
+	}
+
+	if(used <= socks / 2){
+		list = realloc(sock, used * sizeof(websocket));
+		if(list){
+			memory_account(memory_clients, -(ssize_t) ((socks - used) * sizeof(websocket)));
+			sock = list;
+			socks = used;
+		}
+	}
+}
+
+/*
+ * Close the connections holding the most memory until the memory response drops below shedding,
+ * at most `budget` connections per call
+ */
+static void client_shed(size_t budget){
+	size_t n, shed, bytes, heaviest, heaviest_bytes;
+
+	for(shed = 0; shed < budget; shed++){
+		heaviest = socks;
+		heaviest_bytes = 0;
+		for(n = 0; n < socks; n++){
+			if(sock[n].ws_fd >= 0){
+				bytes = memory_connection(sock + n);
+				if(heaviest == socks || bytes > heaviest_bytes){
+					heaviest = n;
+					heaviest_bytes = bytes;
+				}
+			}
+		}
+
+		if(heaviest == socks){
+			break;
+		}
+
+		LOG(log_core, log_warn, "Shedding connection holding %lu bytes under memory pressure\n", heaviest_bytes);
+		if(sock[heaviest].state == ws_open){
+			ws_close(sock + heaviest, ws_close_again, "Server overloaded, try again later");
+		}
+		else{
+			ws_close(sock + heaviest, ws_close_http, "503 Service Unavailable");
+		}
+
+		//return the slot buffers before measuring again
+		client_shrink();
+		if(memory_level_current() < memory_shed){
+			break;
+		}
+	}
+}
+
+peer_transport client_detect_transport(char* host){
 	if(!strncmp(host, "tcp://", 6)){
 		memmove(host, host + 6, strlen(host) - 5);
 		return peer_tcp_client;
@@ -118,12 +273,36 @@ static peer_transport client_detect_transport(char* host){
 		memmove(host, host + 13, strlen(host) - 12);
 		return peer_unix_dgram;
 	}
+	else if(!strncmp(host, "unix-seqpacket://", 17)){
+		memmove(host, host + 17, strlen(host) - 16);
+		return peer_unix_seqpacket;
+	}
+	else if(!strncmp(host, "mux://", 6)){
+		memmove(host, host + 6, strlen(host) - 5);
+		return peer_mux;
+	}
+	else if(!strncmp(host, "broadcast://", 12)){
+		memmove(host, host + 12, strlen(host) - 11);
+		return peer_broadcast;
+	}
+	else if(!strncmp(host, "group://", 8)){
+		memmove(host, host + 8, strlen(host) - 7);
+		return peer_group;
+	}
+	else if(!strncmp(host, "shm://", 6)){
+		memmove(host, host + 6, strlen(host) - 5);
+		return peer_shm;
+	}
+	else if(!strncmp(host, "exec://", 7)){
+		memmove(host, host + 7, strlen(host) - 6);
+		return peer_exec;
+	}
 
-	fprintf(stderr, "Peer address %s does not include any known protocol identifier, guessing tcp_client\n", host);
+	LOG(log_peer, log_warn, "Peer address %s does not include any known protocol identifier, guessing tcp_client\n", host);
 	return peer_tcp_client;
 }
 
-static char* client_detect_port(char* host){
+char* client_detect_port(char* host){
 	size_t u;
 
 	for(u = 0; host[u]; u++){
@@ -136,14 +315,127 @@ static char* client_detect_port(char* host){
 	return NULL;
 }
 
+/*
+ * Parse and strip options appended to a peer address as `?<option>=<value>[&...]`.
+ * Returns 0 on success.
+ */
+int client_peer_options(ws_peer_info* peer){
+	char* option = strchr(peer->host, '?'), *next = NULL;
+
+	if(!option){
+		return 0;
+	}
+	*option = 0;
+
+	for(option++; option && *option; option = next){
+		next = strchr(option, '&');
+		if(next){
+			*next = 0;
+			next++;
+		}
+
+		if(!strncmp(option, "reconnect=", 10)){
+			peer->reconnect = strtoul(option + 10, NULL, 10);
+			if(!peer->reconnect_buffer){
+				peer->reconnect_buffer = RECONNECT_BUFFER_DEFAULT;
+			}
+		}
+		else if(!strncmp(option, "buffer=", 7)){
+			peer->reconnect_buffer = strtoul(option + 7, NULL, 10);
+		}
+		else if(!strncmp(option, "weight=", 7)){
+			peer->weight = strtoul(option + 7, NULL, 10);
+		}
+		else if(!strcmp(option, "priority=high")){
+			peer->priority = priority_high;
+		}
+		else if(!strcmp(option, "priority=low")){
+			peer->priority = priority_low;
+		}
+		else if(!strcmp(option, "inbound=newline")){
+			peer->inbound = inbound_newline;
+		}
+		else if(!strcmp(option, "inbound=length")){
+			peer->inbound = inbound_length;
+		}
+		else{
+			LOG(log_peer, log_warn, "Unknown peer address option %s\n", option);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Find the value of a cookie within the Cookie request header */
+char* client_cookie(websocket* ws, char* name, size_t* length){
+	size_t u, name_length = strlen(name);
+	char* value = NULL;
+
+	for(u = 0; u < ws->headers; u++){
+		if(!strcasecmp(ws->header[u].tag, "Cookie")){
+			value = ws->header[u].value;
+			break;
+		}
+	}
+
+	while(value && *value){
+		for(; *value == ' '; value++){
+		}
+
+		if(!strncmp(value, name, name_length) && value[name_length] == '='){
+			value += name_length + 1;
+			for(*length = 0; value[*length] && value[*length] != ';'; (*length)++){
+			}
+			return value;
+		}
+
+		value = strchr(value, ';');
+		value = value ? value + 1 : NULL;
+	}
+	return NULL;
+}
+
 /* Establish peer connection for negotiated websocket */
 int client_connect(websocket* ws){
-	ws->peer = config.backend.query(ws->request_path, ws->protocols, ws->protocol, ws->headers, ws->header, ws);
+	uint64_t start;
+
+	//only ask the backend if no recent result is cached for this request
+	if(cache_lookup(ws, &(ws->peer))){
+		start = metrics_now();
+		TRACE(backend_query_start, ws->id, ws->request_path);
+		ws->peer = config.backend.query(ws->request_path, ws->protocols, ws->protocol, ws->headers, ws->header, ws);
+		TRACE(backend_query_end, ws->id, ws->peer.host);
+		metrics_observe(metrics_backend_query, start);
+		cache_store(&(ws->peer));
+	}
+
 	if(!ws->peer.host){
 		//no peer provided
 		return 1;
 	}
 
+	//persistent peer data is shared with the backend, take a private copy where it needs to be modified
+	if(ws->peer.persistent
+			&& (ws->peer.transport == peer_transport_detect
+				|| ws->peer.transport == peer_mux
+				|| ws->peer.transport == peer_broadcast
+				|| strchr(ws->peer.host, '?')
+				|| ((ws->peer.transport == peer_tcp_client || ws->peer.transport == peer_udp_client) && !ws->peer.port))){
+		ws->peer.persistent = 0;
+		ws->peer.host = strdup(ws->peer.host);
+		ws->peer.port = ws->peer.port ? strdup(ws->peer.port) : NULL;
+		ws->peer.framing_config = ws->peer.framing_config ? strdup(ws->peer.framing_config) : NULL;
+		if(!ws->peer.host){
+			LOG(log_core, log_error, "Failed to allocate memory\n");
+			return 1;
+		}
+	}
+
+	//split off address options
+	if(client_peer_options(&(ws->peer))){
+		return 1;
+	}
+
 	//assign default framing function if none provided
 	if(!ws->peer.framing){
 		ws->peer.framing = framing_auto;
@@ -154,7 +446,23 @@ int client_connect(websocket* ws){
 		ws->peer.transport = client_detect_transport(ws->peer.host);
 	}
 
-	if((ws->peer.transport == peer_tcp_client || ws->peer.transport == peer_udp_client)
+	//groups select one of their members as peer
+	if(ws->peer.transport == peer_group){
+		return group_connect(ws);
+	}
+	return client_connect_peer(ws);
+}
+
+/* Connect a websocket to the (resolved) peer address */
+static int client_connect_transport(websocket* ws){
+	peer_transport mux_transport = peer_transport_detect;
+
+	//shared peers carry the underlying transport in the address
+	if(ws->peer.transport == peer_mux || ws->peer.transport == peer_broadcast){
+		mux_transport = client_detect_transport(ws->peer.host);
+	}
+
+	if((ws->peer.transport == peer_tcp_client || ws->peer.transport == peer_udp_client || mux_transport == peer_tcp_client)
 		       && !ws->peer.port){
 		ws->peer.port = client_detect_port(ws->peer.host);
 		if(!ws->peer.port){
@@ -163,10 +471,19 @@ int client_connect(websocket* ws){
 		}
 	}
 
+	//fail fast while the peer is known to be down
+	if((ws->peer.transport == peer_tcp_client || ws->peer.transport == peer_unix_stream)
+			&& breaker_open(ws->peer.transport, ws->peer.host, ws->peer.port)){
+		return BREAKER_REJECTED;
+	}
+
 	//TODO connection establishment should be async in the future
 	switch(ws->peer.transport){
 		case peer_tcp_client:
-			ws->peer_fd = network_socket(ws->peer.host, ws->peer.port, SOCK_STREAM, 0);
+			ws->peer_fd = pool_take(ws->peer.transport, ws->peer.host, ws->peer.port);
+			if(ws->peer_fd < 0){
+				ws->peer_fd = network_socket(ws->peer.host, ws->peer.port, SOCK_STREAM, 0);
+			}
 			break;
 		case peer_udp_client:
 			ws->peer_fd = network_socket(ws->peer.host, ws->peer.port, SOCK_DGRAM, 0);
@@ -174,22 +491,50 @@ int client_connect(websocket* ws){
 		case peer_fifo_tx:
 		case peer_fifo_rx:
 			//TODO implement other peer modes
-			fprintf(stderr, "Peer connection mode not yet implemented\n");
+			LOG(log_peer, log_error, "Peer connection mode not yet implemented\n");
 			return 1;
 		case peer_unix_stream:
-			ws->peer_fd = network_socket_unix(ws->peer.host, SOCK_STREAM, 0);
+			ws->peer_fd = pool_take(ws->peer.transport, ws->peer.host, NULL);
+			if(ws->peer_fd < 0){
+				ws->peer_fd = network_socket_unix(ws->peer.host, SOCK_STREAM, 0);
+			}
 			break;
 		case peer_unix_dgram:
 			ws->peer_fd = network_socket_unix(ws->peer.host, SOCK_DGRAM, 0);
 			break;
+		case peer_unix_seqpacket:
+			ws->peer_fd = network_socket_unix(ws->peer.host, SOCK_SEQPACKET, 0);
+			break;
+		case peer_mux:
+			return mux_attach(ws, mux_transport, config.mux_connections);
+		case peer_broadcast:
+			return broadcast_attach(ws, mux_transport);
+		case peer_shm:
+			return ring_attach(ws);
+		case peer_exec:
+			return exec_attach(ws);
 		default:
-			fprintf(stderr, "Invalid peer transport selected\n");
+			LOG(log_peer, log_error, "Invalid peer transport selected\n");
 			return 1;
 	}
 
+	if(ws->peer.transport == peer_tcp_client || ws->peer.transport == peer_unix_stream){
+		breaker_result(ws->peer.transport, ws->peer.host, ws->peer.port, ws->peer_fd >= 0);
+	}
+
 	return (ws->peer_fd == -1) ? 1 : 0;
 }
 
+/* Connect a websocket to the (resolved) peer address, recording the connection time */
+int client_connect_peer(websocket* ws){
+	uint64_t start = metrics_now();
+	int rv = client_connect_transport(ws);
+
+	metrics_observe(metrics_peer_connect, start);
+	TRACE(peer_connect, ws->id, ws->peer.transport, rv);
+	return rv;
+}
+
 ws_framing core_framing(char* name){
 	return plugin_framing(name);
 }
@@ -218,33 +563,29 @@ static int usage(char* fn){
 	return EXIT_FAILURE;
 }
 
-static int ws_peer_data(websocket* ws){
-	ssize_t bytes_read, bytes_left = sizeof(ws->peer_buffer) - ws->peer_buffer_offset;
+/* Messages forwarded from the peer currently being served, counted against its budget */
+static size_t turn_messages = 0;
+
+/* Pass newly read data in the peer buffer through the framing function and forward complete frames */
+static int ws_peer_frames(websocket* ws, ssize_t bytes_read){
+	uint64_t received = metrics_now(), start;
 	int64_t bytes_framed;
 	//default to a binary frame
 	ws_operation opcode = ws_frame_binary;
 
-	bytes_read = recv(ws->peer_fd, ws->peer_buffer + ws->peer_buffer_offset, bytes_left - 1, 0);
-	if(bytes_read < 0){
-		fprintf(stderr, "Failed to receive from peer: %s\n", strerror(errno));
-		ws_close(ws, ws_close_unexpected, "Peer connection failed");
-		return 0;
-	}
-	else if(bytes_read == 0){
-		//peer closed connection
-		ws_close(ws, ws_close_normal, "Peer closed connection");
-		return 0;
-	}
-
 	ws->peer_buffer[ws->peer_buffer_offset + bytes_read] = 0;
 
 	do{
 		//call the framing function
+		start = metrics_now();
+		TRACE(framing_call, ws->id, ws->peer_buffer_offset + bytes_read);
 		bytes_framed = ws->peer.framing(ws->peer_buffer, ws->peer_buffer_offset + bytes_read, bytes_read, &opcode, &(ws->peer_framing_data), ws->peer.framing_config);
+		TRACE(framing_return, ws->id, bytes_framed);
+		metrics_observe(metrics_framing, start);
 		if(bytes_framed > 0){
 			if(bytes_framed > ws->peer_buffer_offset + bytes_read){
 				ws_close(ws, ws_close_unexpected, "Internal error");
-				fprintf(stderr, "Overrun by framing function, have %lu + %lu bytes, framed %lu\n", ws->peer_buffer_offset, bytes_read, bytes_framed);
+				LOG(log_peer, log_warn, "Overrun by framing function, have %lu + %lu bytes, framed %lu\n", ws->peer_buffer_offset, bytes_read, bytes_framed);
 				return 0;
 			}
 			if(opcode != ws_frame_discard){
@@ -252,6 +593,8 @@ static int ws_peer_data(websocket* ws){
 				if(ws_send_frame(ws, opcode, ws->peer_buffer, bytes_framed)){
 					return 1;
 				}
+				metrics_observe(metrics_forward, received);
+				turn_messages++;
 			}
 			//copy back
 			memmove(ws->peer_buffer, ws->peer_buffer + bytes_framed, (ws->peer_buffer_offset + bytes_read) - bytes_framed);
@@ -275,14 +618,172 @@ static int ws_peer_data(websocket* ws){
 	return 0;
 }
 
+/*
+ * Forward a batch of datagrams from a message-oriented peer, one WebSocket frame each.
+ * The framing function is bypassed, except to select text frames for the default framing.
+ * Returns the number of bytes forwarded, 0 if no more data is to be read and -1 on failure.
+ */
+static ssize_t ws_peer_datagrams(websocket* ws){
+	static uint8_t buffer[PEER_DATAGRAM_BATCH][PEER_BUFFER_SIZE];
+	struct iovec iov[PEER_DATAGRAM_BATCH];
+	struct mmsghdr batch[PEER_DATAGRAM_BATCH] = {
+		0
+	};
+	ws_operation opcode;
+	int u, received;
+	ssize_t bytes = 0;
+	uint64_t start;
+
+	for(u = 0; u < PEER_DATAGRAM_BATCH; u++){
+		iov[u].iov_base = buffer[u];
+		iov[u].iov_len = sizeof(buffer[u]);
+		batch[u].msg_hdr.msg_iov = iov + u;
+		batch[u].msg_hdr.msg_iovlen = 1;
+	}
+
+	received = recvmmsg(ws->peer_fd, batch, PEER_DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+	start = metrics_now();
+	if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return 0;
+	}
+	else if(received < 0){
+		LOG(log_peer, log_warn, "Failed to receive from peer: %s\n", strerror(errno));
+		ws_close(ws, ws_close_unexpected, "Peer connection failed");
+		return 0;
+	}
+	//a sequenced packet socket signals the end of the connection with an empty message
+	else if(!received || (ws->peer.transport == peer_unix_seqpacket && !batch[0].msg_len)){
+		ws_close(ws, ws_close_normal, "Peer closed connection");
+		return 0;
+	}
+
+	for(u = 0; u < received && ws->ws_fd >= 0; u++){
+		if(batch[u].msg_hdr.msg_flags & MSG_TRUNC){
+			LOG(log_peer, log_warn, "Dropping truncated peer datagram\n");
+			continue;
+		}
+
+		opcode = ws_frame_binary;
+		if(ws->peer.framing == framing_auto){
+			framing_auto(buffer[u], batch[u].msg_len, batch[u].msg_len, &opcode, NULL, NULL);
+		}
+
+		if(ws_send_frame(ws, opcode, buffer[u], batch[u].msg_len)){
+			return -1;
+		}
+		metrics_observe(metrics_forward, start);
+		bytes += batch[u].msg_len;
+		turn_messages++;
+	}
+	//a full batch may be followed by more datagrams
+	return (received == PEER_DATAGRAM_BATCH) ? bytes : 0;
+}
+
+/*
+ * Read once from a peer and forward the data.
+ * Returns the number of bytes read, 0 if no more data is to be read and -1 on failure.
+ */
+static ssize_t ws_peer_read(websocket* ws, int flags){
+	ssize_t bytes_read, bytes_left = sizeof(ws->peer_buffer) - ws->peer_buffer_offset;
+
+	if(PEER_DATAGRAM(ws->peer.transport)){
+		return ws_peer_datagrams(ws);
+	}
+
+	//binary framing forwards the peer stream unchanged, so it does not need to pass through the peer buffer
+	if(ws->peer.framing == framing_binary && !ws->peer_buffer_offset){
+		bytes_read = ws_splice_frame(ws, ws->peer_fd);
+		if(bytes_read > 0){
+			turn_messages++;
+			return bytes_read;
+		}
+		else if(bytes_read < 0){
+			ws_close(ws, ws_close_unexpected, "Failed to forward");
+			return 0;
+		}
+		//nothing to splice, the normal path handles the end of the stream
+	}
+
+	bytes_read = recv(ws->peer_fd, ws->peer_buffer + ws->peer_buffer_offset, bytes_left - 1, flags);
+	if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return 0;
+	}
+	else if(bytes_read < 0){
+		LOG(log_peer, log_warn, "Failed to receive from peer: %s\n", strerror(errno));
+		if(reconnect_start(ws)){
+			ws_close(ws, ws_close_unexpected, "Peer connection failed");
+		}
+		return 0;
+	}
+	else if(bytes_read == 0){
+		//peer closed connection, keep the WebSocket open if the peer is to be reconnected
+		if(reconnect_start(ws)){
+			ws_close(ws, ws_close_normal, "Peer closed connection");
+		}
+		return 0;
+	}
+
+	return ws_peer_frames(ws, bytes_read) ? -1 : bytes_read;
+}
+
+/*
+ * Forward peer data while the connection has budget left in this loop turn, scaled by its route weight.
+ * Data beyond the budget stays in the socket and is picked up in the next turn, so a busy peer
+ * can not hold up the other connections.
+ */
+static int ws_peer_data(websocket* ws){
+	size_t weight = ws->peer.weight ? ws->peer.weight : 1, bytes = 0;
+	ssize_t rv;
+
+	turn_messages = 0;
+	do{
+		//only the first read is known not to block
+		rv = ws_peer_read(ws, bytes ? MSG_DONTWAIT : 0);
+		bytes += (rv > 0) ? rv : 0;
+	}
+	while(rv > 0
+			&& ws->peer_fd >= 0
+			&& !ws->queue_entries
+			&& bytes < config.io_budget * weight
+			&& turn_messages < config.io_messages * weight);
+
+	return (rv < 0) ? 1 : 0;
+}
+
+/* Feed peer data received outside of the core loop (e.g. for a resumed session) through the framing function */
+int client_peer_input(websocket* ws, uint8_t* data, size_t length){
+	size_t chunk;
+
+	while(length && ws->ws_fd >= 0){
+		chunk = sizeof(ws->peer_buffer) - ws->peer_buffer_offset - 1;
+		if(!chunk){
+			LOG(log_peer, log_warn, "Peer buffer exhausted, dropping %lu bytes\n", length);
+			return 1;
+		}
+		chunk = (chunk < length) ? chunk : length;
+
+		memcpy(ws->peer_buffer + ws->peer_buffer_offset, data, chunk);
+		if(ws_peer_frames(ws, chunk)){
+			return 1;
+		}
+		data += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
 int main(int argc, char** argv){
-	fd_set read_fds;
-	size_t n;
+	fd_set read_fds, write_fds;
+	int pass;
+	size_t n, u, turn = 0, active, handshakes, accept_budget, pool_outstanding = 0, breakers_open = 0, reconnects_pending = 0, sessions_parked = 0, workers_outstanding = 0, sockets_lingering = 0;
+	size_t cache_hits, cache_misses, cache_entries;
 	int listen_fd = -1, status, max_fd;
+	memory_level memory_state = memory_normal;
 	struct timespec current_time;
 	struct timeval select_timeout = {
 		0
 	};
+	struct timeval* select_timeout_p = NULL;
 
 	//register default framing functions before parsing arguments, as they may be assigned within a backend configuration
 	if(plugin_register_framing("auto", framing_auto)
@@ -316,6 +817,32 @@ int main(int argc, char** argv){
 		exit(usage(argv[0]));
 	}
 
+	//only wake up for connections that have already sent data
+	if(config.defer_accept
+			&& setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept))){
+		fprintf(stderr, "Failed to enable TCP_DEFER_ACCEPT on listening socket: %s\n", strerror(errno));
+	}
+
+	//set up peer connection pooling
+	pool_init(config.pool_min, config.pool_max, config.pool_check);
+	broadcast_init(config.broadcast_queue, config.broadcast_skip ? broadcast_skip : broadcast_drop);
+	cache_init(config.cache_size, config.cache_ttl);
+	group_init(config.group_fail_threshold, config.group_eject_time);
+	breaker_init(config.breaker_threshold, config.breaker_interval, config.breaker_status);
+	resume_init(config.resume_grace, config.resume_buffer, config.resume_cookie);
+	exec_init(config.exec_workers);
+	ws_zerocopy_init(config.zerocopy_threshold);
+	if(memory_init(config.memory_limit, config.memory_pressure)){
+		exit(EXIT_FAILURE);
+	}
+
+	metrics_init(config.metrics_path);
+
+	//move log output off the core loop
+	if(log_init()){
+		exit(EXIT_FAILURE);
+	}
+
 	//attach signal handler to catch Ctrl-C
 	signal(SIGINT, signal_handler);
 	//ignore broken pipes when writing
@@ -326,33 +853,84 @@ int main(int argc, char** argv){
 		//reset the select timeout
 		select_timeout.tv_sec = config.ping_interval / 2;
 		select_timeout.tv_usec = 0;
+		select_timeout_p = config.ping_interval ? &select_timeout : NULL;
+		active = 0;
+		handshakes = 0;
 
 		//clear the select set
 		FD_ZERO(&read_fds);
-
-		//push the websocket fd
-		FD_SET(listen_fd, &read_fds);
-		max_fd = listen_fd;
+		FD_ZERO(&write_fds);
+		max_fd = -1;
 
 		//push all fds to the select set
 		for(n = 0; n < socks; n++){
 			if(sock[n].ws_fd >= 0){
-				FD_SET(sock[n].ws_fd, &read_fds);
-				if(max_fd < sock[n].ws_fd){
-					max_fd = sock[n].ws_fd;
+				active++;
+				if(sock[n].state != ws_open){
+					handshakes++;
+				}
+
+				//pause reading from clients whose multiplexed channel has no credit left, whose ring is full
+				//or whose peer has not accepted the previous data yet, closed clients only wait for their queue
+				if(sock[n].state != ws_closed
+						&& !sock[n].peer_backlog.length
+						&& (sock[n].peer.transport != peer_mux || mux_ready(sock + n))
+						&& (sock[n].peer.transport != peer_shm || ring_ready(sock + n))){
+					FD_SET(sock[n].ws_fd, &read_fds);
+					if(max_fd < sock[n].ws_fd){
+						max_fd = sock[n].ws_fd;
+					}
+				}
+
+				//wait for queued outbound frames to drain before reading more peer data
+				if(sock[n].queue_entries){
+					FD_SET(sock[n].ws_fd, &write_fds);
+					if(max_fd < sock[n].ws_fd){
+						max_fd = sock[n].ws_fd;
+					}
 				}
-				
-				if(sock[n].peer_fd >= 0){
+				else if(sock[n].peer_fd >= 0){
 					FD_SET(sock[n].peer_fd, &read_fds);
 					if(max_fd < sock[n].peer_fd){
 						max_fd = sock[n].peer_fd;
 					}
 				}
+
+				if(sock[n].peer_fd >= 0 && sock[n].peer_backlog.length){
+					FD_SET(sock[n].peer_fd, &write_fds);
+					if(max_fd < sock[n].peer_fd){
+						max_fd = sock[n].peer_fd;
+					}
+				}
+			}
+		}
+
+		//push multiplexed peer connections
+		mux_fds(&read_fds, &write_fds, &max_fd);
+		pool_fds(&write_fds, &max_fd);
+		reconnect_fds(&write_fds, &max_fd);
+		broadcast_fds(&read_fds, &max_fd);
+		ring_fds(&read_fds, &max_fd);
+		resume_fds(&read_fds, &max_fd);
+
+		//push the listening fd while below the connection limit and not under memory pressure
+		if((!config.max_connections || active < config.max_connections) && memory_state < memory_refuse){
+			FD_SET(listen_fd, &read_fds);
+			if(max_fd < listen_fd){
+				max_fd = listen_fd;
 			}
 		}
 
+		//wake up regularly to enforce handshake deadlines and refill pools
+		if(((handshakes && config.handshake_timeout) || pool_outstanding || breakers_open || reconnects_pending || sessions_parked || workers_outstanding
+					|| sockets_lingering || memory_state || config.memory_pressure)
+				&& (!select_timeout_p || select_timeout.tv_sec > 1)){
+			select_timeout.tv_sec = 1;
+			select_timeout_p = &select_timeout;
+		}
+
 		//block until something happens
-		status = select(max_fd + 1, &read_fds, NULL, NULL, config.ping_interval ? &select_timeout : NULL);
+		status = select(max_fd + 1, &read_fds, &write_fds, NULL, select_timeout_p);
 		if(status < 0){
 			fprintf(stderr, "Failed to select: %s\n", strerror(errno));
 			break;
@@ -364,16 +942,80 @@ int main(int argc, char** argv){
 				break;
 			}
 
-			//new websocket client
+			//new websocket clients, drained up to the per-iteration budget
 			if(FD_ISSET(listen_fd, &read_fds)){
-				if(ws_accept(listen_fd, current_time.tv_sec)){
+				accept_budget = config.accept_budget;
+				if(config.max_connections && config.max_connections - active < accept_budget){
+					accept_budget = config.max_connections - active;
+				}
+
+				if(ws_accept(listen_fd, accept_budget, current_time.tv_sec)){
 					break;
 				}
 			}
 
-			//websocket or peer data ready
-			for(n = 0; n < socks; n++){
-				if(sock[n].ws_fd >= 0){
+			//data on multiplexed peer connections
+			mux_data(&read_fds, &write_fds);
+
+			//established pooled peer connections
+			pool_data(&write_fds, current_time.tv_sec);
+
+			//completed peer reconnection attempts
+			reconnect_data(&write_fds, current_time.tv_sec);
+
+			//data on broadcast sources
+			broadcast_data(&read_fds);
+
+			//messages on shared memory rings
+			ring_data(&read_fds);
+
+			//data on parked peer connections
+			resume_data(&read_fds);
+
+			//websocket or peer data ready, serving priority classes in order and rotating the first slot served
+			for(pass = priority_high; pass <= priority_low; pass++){
+				for(u = 0; u < socks; u++){
+					n = (turn + u) % socks;
+					if(sock[n].ws_fd < 0 || sock[n].peer.priority != pass){
+						continue;
+					}
+
+					if(FD_ISSET(sock[n].ws_fd, &write_fds)){
+						if(ws_flush(sock + n)){
+							ws_close(sock + n, ws_close_unexpected, NULL);
+							continue;
+						}
+
+						//written data makes room in the window of multiplexed channels
+						if(sock[n].peer.transport == peer_mux){
+							mux_written(sock + n);
+							if(sock[n].ws_fd < 0){
+								continue;
+							}
+						}
+
+						//shared memory rings are drained again once the queue is empty
+						if(sock[n].peer.transport == peer_shm){
+							ring_written(sock + n);
+							if(sock[n].ws_fd < 0){
+								continue;
+							}
+						}
+					}
+
+					//closed clients are only kept until their response is written
+					if(sock[n].state == ws_closed && !sock[n].queue_entries){
+						ws_close(sock + n, ws_close_http, NULL);
+						continue;
+					}
+
+					if(sock[n].peer_fd >= 0 && FD_ISSET(sock[n].peer_fd, &write_fds)){
+						ws_peer_drain(sock + n);
+						if(sock[n].ws_fd < 0){
+							continue;
+						}
+					}
+
 					if(FD_ISSET(sock[n].ws_fd, &read_fds)){
 						sock[n].last_event = current_time.tv_sec;
 						if(ws_data(sock + n)){
@@ -387,8 +1029,16 @@ int main(int argc, char** argv){
 						}
 					}
 
+					//enforce the handshake deadline, which also limits the time taken to write a final response
+					if(sock[n].state != ws_open
+							&& config.handshake_timeout
+							&& current_time.tv_sec - sock[n].accepted >= config.handshake_timeout){
+						ws_close(sock + n, ws_close_http, "408 Request timeout");
+						continue;
+					}
+
 					//send keep-alive frames
-					if(config.ping_interval &&
+					if(sock[n].state == ws_open && config.ping_interval &&
 							current_time.tv_sec - sock[n].last_event > config.ping_interval){
 						if(ws_send_frame(sock + n, ws_frame_ping, (uint8_t*) "PING", 4)){
 							ws_close(sock + n, ws_close_unexpected, NULL);
@@ -396,15 +1046,61 @@ int main(int argc, char** argv){
 					}
 				}
 			}
+			turn++;
+
+			//refill peer connection pools
+			pool_outstanding = pool_maintain(current_time.tv_sec);
+
+			//probe unavailable peers
+			breakers_open = breaker_maintain(current_time.tv_sec);
+
+			//re-establish lost peer connections
+			reconnects_pending = reconnect_maintain(current_time.tv_sec);
+
+			//expire parked sessions
+			sessions_parked = resume_maintain(current_time.tv_sec);
+
+			//reap peer processes and refill worker pools
+			workers_outstanding = exec_maintain(current_time.tv_sec);
+
+			//release zero-copy buffers of closed connections
+			sockets_lingering = ws_zerocopy_maintain();
+
+			//respond to memory pressure
+			memory_state = memory_maintain(current_time.tv_sec);
+			if(memory_state >= memory_shrink){
+				client_shrink();
+			}
+			if(memory_state == memory_shed){
+				client_shed(MEMORY_SHED_BUDGET);
+				memory_state = memory_level_current();
+			}
 		}
 	}
 
 	//cleanup
+	if(config.cache_size){
+		cache_stats(&cache_hits, &cache_misses, &cache_entries);
+		fprintf(stderr, "Route cache: %lu hits, %lu misses, %lu entries\n", cache_hits, cache_misses, cache_entries);
+	}
+	cache_cleanup();
 	if(config.backend.cleanup){
 		config.backend.cleanup();
 	}
 	client_cleanup();
+	ws_zerocopy_cleanup();
+	mux_cleanup();
+	broadcast_cleanup();
+	ring_cleanup();
+	group_cleanup();
+	breaker_cleanup();
+	reconnect_cleanup();
+	resume_cleanup();
+	exec_cleanup();
+	pool_cleanup();
 	plugin_cleanup();
+	metrics_cleanup();
 	close(listen_fd);
+	log_cleanup();
 	return 0;
 }
@@ -13,8 +13,20 @@
 #define WS_MAX_LINE 16384
 /* Peer read buffer size / proxy packet limit */
 #define PEER_BUFFER_SIZE 16384
+/* Number of datagrams moved per system call for message-oriented peers */
+#define PEER_DATAGRAM_BATCH 16
+/* Outbound queue limit per connection in bytes */
+#define WS_QUEUE_LIMIT (4 * 1024 * 1024)
 /* Maximum number of HTTP headers to accept */
 #define WS_HEADER_LIMIT 10
+/* Maximum number of WebSocket subprotocols to accept */
+#define WS_PROTOCOL_LIMIT 16
+/* Per-connection storage for HTTP request data (path, headers, protocols) */
+#define WS_HTTP_ARENA 8192
+/* Session resumption token length (hex characters), cookie name limit and cookie path limit */
+#define WS_RESUME_TOKEN 32
+#define WS_RESUME_COOKIE 64
+#define WS_RESUME_PATH 256
 
 /*
  * State machine for WebSocket connections
@@ -53,7 +65,8 @@ typedef enum {
 	ws_close_format = 1007,
 	ws_close_policy = 1008,
 	ws_close_limit = 1009,
-	ws_close_unexpected = 1011
+	ws_close_unexpected = 1011,
+	ws_close_again = 1013
 } ws_close_reason;
 
 /*
@@ -96,9 +109,35 @@ typedef enum {
 	peer_fifo_tx,
 	peer_fifo_rx,
 	peer_unix_stream,
-	peer_unix_dgram
+	peer_unix_dgram,
+	peer_mux,
+	peer_broadcast,
+	peer_group,
+	peer_shm,
+	peer_unix_seqpacket,
+	peer_exec
 } peer_transport;
 
+/* Peer transports preserving message boundaries, where each peer message maps to one WebSocket frame */
+#define PEER_DATAGRAM(transport) ((transport) == peer_udp_client \
+		|| (transport) == peer_unix_dgram \
+		|| (transport) == peer_unix_seqpacket)
+
+/* Framing added to client messages written to stream peers */
+typedef enum {
+	inbound_none = 0,
+	inbound_newline,
+	/* 32 bit big endian length prefix */
+	inbound_length
+} peer_inbound;
+
+/* Scheduling classes, connections of higher priority are served first in every loop turn */
+typedef enum {
+	priority_high = -1,
+	priority_normal = 0,
+	priority_low = 1
+} peer_priority;
+
 /* Peer address model */
 typedef struct /*_ws_peer_info*/ {
 	/* Peer protocol data */
@@ -112,21 +151,70 @@ typedef struct /*_ws_peer_info*/ {
 
 	/* WebSocket subprotocol indication index*/
 	size_t protocol;
+
+	/* Set if the fields are owned by the backend and must not be free'd or modified by the core */
+	uint8_t persistent;
+
+	/* Reconnection policy: seconds to keep the WebSocket open without its peer (0 to disable) and client data buffer limit */
+	time_t reconnect;
+	size_t reconnect_buffer;
+
+	/* Framing of client messages towards the peer */
+	peer_inbound inbound;
+
+	/* Scheduling class and multiplier of the per-turn I/O budget (0 is treated as 1) */
+	peer_priority priority;
+	unsigned weight;
 } ws_peer_info;
 
+/*
+ * Reference-counted, pre-encoded outbound frame data, which may be queued
+ * to any number of connections without copying
+ */
+typedef struct /*_ws_buffer*/ {
+	size_t references;
+	size_t length;
+	uint8_t data[];
+} ws_buffer;
+
+/* Outbound data a nonblocking socket did not accept yet, written once the socket becomes writable */
+typedef struct /*_network_backlog*/ {
+	uint8_t* data;
+	size_t length;
+} network_backlog;
+
 /* Core connection model */
 typedef struct /*_web_socket*/ {
-	/* WebSocket state & data */
+	/* WebSocket state & data, the id is unique for the lifetime of the process */
+	uint64_t id;
 	int ws_fd;
 	uint8_t read_buffer[WS_MAX_LINE];
 	size_t read_buffer_offset;
 	ws_state state;
 	time_t last_event;
+	time_t accepted;
+
+	/* Outbound frames not yet accepted by the socket */
+	ws_buffer** queue;
+	size_t queue_entries;
+	size_t queue_alloc;
+	size_t queue_offset;
+	size_t queue_bytes;
+
+	/* Queued buffers sent with MSG_ZEROCOPY, held until the kernel reports completion of send `zerocopy_base + index` */
+	int zerocopy;
+	ws_buffer** zerocopy_buffer;
+	size_t zerocopy_entries;
+	uint32_t zerocopy_base;
 
 	/* HTTP request headers */
 	size_t headers;
 	ws_http_header header[WS_HEADER_LIMIT];
 
+	/* Request data storage, allocated once per slot and reused */
+	char* http_arena;
+	size_t http_arena_offset;
+
 	/* WebSocket parameters */
 	char* request_path;
 	unsigned websocket_version;
@@ -135,7 +223,7 @@ typedef struct /*_web_socket*/ {
 
 	/* WebSocket indicated subprotocols*/
 	size_t protocols;
-	char** protocol;
+	char* protocol[WS_PROTOCOL_LIMIT];
 
 	/* Peer data */
 	ws_peer_info peer;
@@ -143,6 +231,32 @@ typedef struct /*_web_socket*/ {
 	uint8_t peer_buffer[PEER_BUFFER_SIZE];
 	size_t peer_buffer_offset;
 	void* peer_framing_data;
+
+	/* Client data the peer did not accept yet, no further client data is read until it is written */
+	network_backlog peer_backlog;
+
+	/* Shared (multiplexed or broadcast) peer connection & channel or subscriber position, if any */
+	size_t peer_shared;
+	uint32_t peer_channel;
+
+	/* Peer group member this connection is counted against, if any */
+	struct _group_member* peer_member;
+
+	/* Shared memory ring connection, if any */
+	struct _ring_connection* peer_ring;
+
+	/* Peer reconnection state: time the peer was lost (0 while connected), next attempt and buffered client data */
+	time_t peer_lost;
+	time_t peer_retry;
+	unsigned peer_retries;
+	uint8_t* peer_replay;
+	size_t peer_replay_length;
+
+	/* Session resumption token handed to the client, empty if none */
+	char resume_token[WS_RESUME_TOKEN + 1];
+
+	/* Peer the connection's traffic is counted against */
+	size_t metrics_peer;
 } websocket;
 
 /*
@@ -180,7 +294,8 @@ typedef uint64_t (*ws_backend_configure)(char* key, char* value);
  * the Web Socket, as well as the indicated subprotocol to use (or none, if set to the provided maximum
  * number of protocols).
  * The fields within the structure should be allocated with `calloc` and will be free'd by websocky
- * after use.
+ * after use, unless the `persistent` flag is set. In that case, the fields must stay valid until the
+ * backend is cleaned up.
  */
 typedef ws_peer_info (*ws_backend_query)(char* endpoint, size_t protocols, char** protocol, size_t headers, ws_http_header* header, websocket* ws);
 /*
@@ -201,9 +316,27 @@ typedef struct /*_ws_backend*/ {
 /* Core API */
 ws_framing core_framing(char* name);
 int core_register_framing(char* name, ws_framing func);
+/*
+ * Route cache control for backends. Query results are cached per request path and offered
+ * subprotocols; backends using request headers or cookies to select a peer need to declare them
+ * as significant. Returns 0 on success.
+ */
+int core_cache_header(char* tag);
+int core_cache_cookie(char* name);
+/* Drop cached query results for an endpoint, or all results if NULL */
+void core_cache_invalidate(char* endpoint);
 
 /* Internal helper functions */
 char* xstr_lower(char* in);
 int client_register(websocket* ws);
+websocket* client_get(size_t index);
+size_t client_slots();
+size_t client_index(websocket* ws);
 int client_connect(websocket* ws);
+int client_connect_peer(websocket* ws);
+char* client_cookie(websocket* ws, char* name, size_t* length);
+peer_transport client_detect_transport(char* host);
+char* client_detect_port(char* host);
+int client_peer_options(ws_peer_info* peer);
+int client_peer_input(websocket* ws, uint8_t* data, size_t length);
 #endif